@@ -0,0 +1,379 @@
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <limits>
+
+#include "pathy.h"
+#include "benchmark.h"
+
+// Micro benchmarks of the innermost kernels of the renderer. Every kernel runs over a pregenerated set
+// of inputs so that only the kernel itself is measured, the fastest of several runs is reported as
+// nanoseconds and as kernel calls per cycle. Cycles are core cycles where the hardware counters are
+// available and time stamp counter cycles otherwise. Pass a substring of the benchmark names to only
+// run the matching benchmarks, and -isa with a level to run the kernels compiled for that instruction
+// set level, or with all to run every benchmark at every level the processor supports.
+
+constexpr int input_count = 1 << 12;
+constexpr int run_count = 15;
+
+// Results are summed into this so that the compiler can not drop the kernels
+volatile float g_sink;
+
+const char* g_filter = nullptr;
+
+template <typename F>
+void run(const char* name, int calls_per_run, F&& kernel)
+{
+	if (g_filter && !strstr(name, g_filter))
+	{
+		return;
+	}
+
+	// Warm up the caches and the branch predictors
+	kernel();
+
+	double best_ns = std::numeric_limits<double>::infinity();
+	double best_cycles = std::numeric_limits<double>::infinity();
+	bool core_cycles = false;
+
+	for (int r = 0; r < run_count; ++r)
+	{
+		benchmark::hardware_counters counters;
+		benchmark::timer timer;
+
+		counters.start();
+		timer.start();
+		const uint64_t tsc_begin = __rdtsc();
+
+		kernel();
+
+		const uint64_t tsc_end = __rdtsc();
+		const double ms = timer.stop();
+		const benchmark::hardware_counters::counts counts = counters.stop();
+
+		core_cycles = counts.valid[benchmark::hardware_counters::cycles];
+		const double cycles = core_cycles ? counts.values[benchmark::hardware_counters::cycles] : static_cast<double>(tsc_end - tsc_begin);
+
+		best_ns = std::min(best_ns, ms * 1e6);
+		best_cycles = std::min(best_cycles, cycles);
+	}
+
+	printf("%-44s %9.2f ns/op %8.3f ops/cycle%s\n", name, best_ns / calls_per_run, calls_per_run / best_cycles, core_cycles ? "" : " (tsc)");
+}
+
+struct ray_sphere_pair
+{
+	ray r;
+	sphere s;
+};
+
+// Rays aimed at a point of the disk the sphere covers as seen from the ray origin, at a distance from
+// the center between min_offset and max_offset sphere radii. Offsets below one hit, above one miss and
+// close to one graze the silhouette.
+std::vector<ray_sphere_pair> make_ray_sphere_pairs(std::mt19937& rng, float min_offset, float max_offset)
+{
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	auto random_direction = [&]()
+	{
+		const float z = uniform(rng) * 2 - 1;
+		const float phi = uniform(rng) * 2 * math::pi;
+		const float r = std::sqrt(std::max(0.0f, 1 - z * z));
+		return math::vec<3>(r * std::cos(phi), r * std::sin(phi), z);
+	};
+
+	std::vector<ray_sphere_pair> pairs;
+	pairs.reserve(input_count);
+
+	for (int i = 0; i < input_count; ++i)
+	{
+		const sphere s = { random_direction() * (uniform(rng) * 10), 0.1f + uniform(rng) * 2 };
+		const math::vec<3> origin = s.position + random_direction() * (s.radius * (2 + uniform(rng) * 20));
+
+		math::vec<3> to_center = math::normalize(s.position - origin);
+		math::vec<3> u, v;
+		math::orthonormal_basis(to_center, &u, &v);
+
+		// Offsets are measured in the plane through the center, which is close enough to the silhouette
+		// for origins a few radii away
+		const float offset = (min_offset + uniform(rng) * (max_offset - min_offset)) * s.radius;
+		const float angle = uniform(rng) * 2 * math::pi;
+		const math::vec<3> target = s.position + (u * std::cos(angle) + v * std::sin(angle)) * offset;
+
+		pairs.push_back({ { origin, math::normalize(target - origin) }, s });
+	}
+
+	return pairs;
+}
+
+scene make_scene(std::mt19937& rng, int sphere_count)
+{
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	scene s;
+	s.spheres.push_back({ { 0, -1000, 0 }, 1000 });
+	s.sphere_materials.push_back({ { 0.8f, 0.8f, 0.8f }, false });
+
+	for (int i = 0; i < sphere_count; ++i)
+	{
+		s.spheres.push_back({ { uniform(rng) * 20 - 10, uniform(rng) * 2, uniform(rng) * 20 - 10 }, 0.05f + uniform(rng) * 0.3f });
+		s.sphere_materials.push_back({ { uniform(rng), uniform(rng), uniform(rng) }, i % 8 == 0 });
+	}
+
+	s.build_acceleration_structure();
+
+	return s;
+}
+
+// Rays from above the scene, aimed at random spheres (hit heavy), into the sky (miss heavy) or at the
+// silhouettes of random spheres (grazing)
+std::vector<ray> make_scene_rays(std::mt19937& rng, const scene& s, int kind)
+{
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	std::vector<ray> rays;
+	rays.reserve(input_count);
+
+	for (int i = 0; i < input_count; ++i)
+	{
+		const math::vec<3> origin = { uniform(rng) * 30 - 15, 5 + uniform(rng) * 5, uniform(rng) * 30 - 15 };
+		const sphere& target = s.spheres[1 + rng() % (s.spheres.size() - 1)];
+
+		math::vec<3> direction;
+		if (kind == 1)
+		{
+			direction = math::normalize(math::vec<3>(uniform(rng) - 0.5f, 0.2f + uniform(rng), uniform(rng) - 0.5f));
+		}
+		else
+		{
+			math::vec<3> to_center = math::normalize(target.position - origin);
+			math::vec<3> u, v;
+			math::orthonormal_basis(to_center, &u, &v);
+			const float offset = (kind == 0) ? uniform(rng) * 0.9f : 0.98f + uniform(rng) * 0.04f;
+			direction = math::normalize(target.position + u * (offset * target.radius) - origin);
+		}
+
+		rays.push_back({ origin, direction });
+	}
+
+	return rays;
+}
+
+void run_benchmarks()
+{
+	std::mt19937 rng(1);
+
+	// intersect_ray_sphere
+	{
+		const char* names[] = { "intersect_ray_sphere/hit", "intersect_ray_sphere/miss", "intersect_ray_sphere/grazing" };
+		const float offsets[][2] = { { 0.0f, 0.9f }, { 1.1f, 3.0f }, { 0.98f, 1.02f } };
+
+		for (int kind = 0; kind < 3; ++kind)
+		{
+			const std::vector<ray_sphere_pair> pairs = make_ray_sphere_pairs(rng, offsets[kind][0], offsets[kind][1]);
+
+			run(names[kind], input_count, [&]()
+			{
+				float sum = 0;
+				for (const ray_sphere_pair& p : pairs)
+				{
+					float t = 0;
+					if (intersect_ray_sphere(p.r, 0.001f, std::numeric_limits<float>::infinity(), p.s, &t))
+					{
+						sum += t;
+					}
+				}
+				g_sink = sum;
+			});
+		}
+	}
+
+	// scene::intersect, closest hit and occlusion, and the packet version on camera rays
+	{
+		const scene s = make_scene(rng, 1000);
+
+		const char* closest_names[] = { "scene::intersect/hit", "scene::intersect/miss", "scene::intersect/grazing" };
+		const char* occluded_names[] = { "scene::intersect occlusion/hit", "scene::intersect occlusion/miss", "scene::intersect occlusion/grazing" };
+
+		for (int kind = 0; kind < 3; ++kind)
+		{
+			const std::vector<ray> rays = make_scene_rays(rng, s, kind);
+
+			run(closest_names[kind], input_count, [&]()
+			{
+				float sum = 0;
+				for (const ray& r : rays)
+				{
+					intersection its;
+					if (s.intersect(r, &its))
+					{
+						sum += its.t;
+					}
+				}
+				g_sink = sum;
+			});
+
+			run(occluded_names[kind], input_count, [&]()
+			{
+				int count = 0;
+				for (const ray& r : rays)
+				{
+					count += s.intersect(r, 100.0f);
+				}
+				g_sink = static_cast<float>(count);
+			});
+		}
+
+		// Rows of 16 camera rays, the way render_tile_pass traces them
+		const camera camera(1.0f, { 0, 3, 12 }, { 0, 0, 0 });
+		const int packet_count = input_count / 16;
+		std::vector<ray_packet<16>> packets(packet_count);
+		for (int i = 0; i < packet_count; ++i)
+		{
+			const int x = (i % 4) * 16;
+			const int y = i / 4;
+			for (int lane = 0; lane < 16; ++lane)
+			{
+				const ray r = camera.create_ray((x + lane + 0.5f) / 64, (y + 0.5f) / packet_count * 4);
+				packets[i].set(lane, r.origin, r.direction);
+			}
+			packets[i].finalize();
+		}
+
+		run("scene::intersect packet/camera (per ray)", input_count, [&]()
+		{
+			float sum = 0;
+			for (const ray_packet<16>& p : packets)
+			{
+				ray_packet<16> packet = p;
+				intersection its[16];
+				const uint32_t hit_mask = s.intersect(packet, its);
+				sum += static_cast<float>(hit_mask);
+			}
+			g_sink = sum;
+		});
+	}
+
+	// random_point_on_visible_sphere from points at varying distances
+	{
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+		std::vector<ray_sphere_pair> inputs = make_ray_sphere_pairs(rng, 0.0f, 1.0f);
+		seed_random(1, 0);
+
+		run("random_point_on_visible_sphere", input_count, [&]()
+		{
+			float sum = 0;
+			for (const ray_sphere_pair& p : inputs)
+			{
+				float pdf;
+				sum += random_point_on_visible_sphere(p.r.origin, p.s, &pdf).x + pdf;
+			}
+			g_sink = sum;
+		});
+	}
+
+	// camera::create_ray at jittered pixel positions
+	{
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+		const camera camera(4.0f / 3.0f);
+		std::vector<float> uvs(2 * input_count);
+		for (float& uv : uvs)
+		{
+			uv = uniform(rng);
+		}
+
+		run("camera::create_ray", input_count, [&]()
+		{
+			float sum = 0;
+			for (int i = 0; i < input_count; ++i)
+			{
+				sum += camera.create_ray(uvs[2 * i], uvs[2 * i + 1]).direction.x;
+			}
+			g_sink = sum;
+		});
+	}
+
+	// linear_to_srgb over the range radiance takes, mostly below one with some highlights above
+	{
+		std::exponential_distribution<float> radiance(2.0f);
+
+		alignas(16) float values[input_count];
+		for (float& value : values)
+		{
+			value = radiance(rng);
+		}
+
+		run("linear_to_srgb", input_count, [&]()
+		{
+			float sum = 0;
+			for (float value : values)
+			{
+				sum += linear_to_srgb(value);
+			}
+			g_sink = sum;
+		});
+
+		// Through the dispatched row encoder the image is written with, so that -isa selects its variant.
+		// Every value is one channel of a pixel.
+		constexpr int width = input_count / 3;
+		std::vector<uint8_t> encoded(3 * width);
+
+		run("encode_srgb8_row (per value)", 3 * width, [&]()
+		{
+			encode_srgb8_row(values, values + width, values + 2 * width, width, 0, false, encoded.data());
+			g_sink = encoded[0] + encoded[width];
+		});
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bool all_levels = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-isa") == 0 && i + 1 < argc)
+		{
+			isa_level level;
+			if (strcmp(argv[++i], "all") == 0)
+			{
+				all_levels = true;
+			}
+			else if (parse_isa_level(argv[i], &level))
+			{
+				force_isa_level(level);
+			}
+			else
+			{
+				fprintf(stderr, "expected sse2, sse4.2, avx2, avx512 or all after -isa\n");
+				return 1;
+			}
+		}
+		else
+		{
+			g_filter = argv[i];
+		}
+	}
+
+	if (!all_levels)
+	{
+		printf("%s\n", isa_level_name(g_isa_level));
+		run_benchmarks();
+
+		return 0;
+	}
+
+	// The inputs are generated again for every level, from the same seed
+	const isa_level supported = detect_isa_level();
+	for (int i = 0; i <= static_cast<int>(supported); ++i)
+	{
+		force_isa_level(static_cast<isa_level>(i));
+		printf("%s%s\n", (i > 0) ? "\n" : "", isa_level_name(g_isa_level));
+		run_benchmarks();
+	}
+
+	return 0;
+}
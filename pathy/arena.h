@@ -0,0 +1,241 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+// A bump allocator for short lived data like the task graph of a render pass or the scratch buffers of
+// a task. Allocating moves a pointer forward, nothing is freed on its own, and reset() or rewind()
+// release everything allocated since at once. The blocks are kept, so once an arena has grown to the
+// size of a frame the following frames allocate nothing from the heap. An arena is not thread safe,
+// every thread uses its own.
+class arena
+{
+public:
+	static constexpr size_t default_block_size = 64 * 1024;
+
+	// Where the arena stood at some point, to rewind to
+	struct marker
+	{
+		size_t block;
+		size_t offset;
+		void* destructors;
+	};
+
+	explicit arena(size_t block_size = default_block_size) :
+		_block_size(block_size)
+	{
+	}
+
+	~arena()
+	{
+		reset();
+	}
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	void* allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+	{
+		for (;;)
+		{
+			if (_current < _blocks.size())
+			{
+				const block& b = _blocks[_current];
+				const uintptr_t begin = reinterpret_cast<uintptr_t>(b.memory.get());
+				const uintptr_t aligned = (begin + _offset + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+				if (aligned + size <= begin + b.size)
+				{
+					_offset = aligned + size - begin;
+					return reinterpret_cast<void*>(aligned);
+				}
+
+				// Blocks of earlier frames that are too small for this allocation are skipped
+				if (_current + 1 < _blocks.size())
+				{
+					++_current;
+					_offset = 0;
+					continue;
+				}
+			}
+
+			const size_t block_size = std::max(_block_size, size + alignment);
+			_blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[block_size]), block_size });
+			_current = _blocks.size() - 1;
+			_offset = 0;
+		}
+	}
+
+	// Uninitialized storage for count objects, which must not need destructing
+	template <typename T>
+	T* allocate_array(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "the arena does not destruct arrays");
+		return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	// Constructs an object in the arena. Its destructor runs when the arena is reset or rewound past it.
+	template <typename T, typename... Args>
+	T* create(Args&&... args)
+	{
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+		if (!std::is_trivially_destructible<T>::value)
+		{
+			destructor* d = new (allocate(sizeof(destructor), alignof(destructor))) destructor;
+			d->destroy = [](void* o) { static_cast<T*>(o)->~T(); };
+			d->object = object;
+			d->next = _destructors;
+			_destructors = d;
+		}
+
+		return object;
+	}
+
+	marker mark() const
+	{
+		return { _current, _offset, _destructors };
+	}
+
+	// Releases everything allocated since the marker was taken, destroying the objects in reverse order
+	void rewind(const marker& m)
+	{
+		destroy_until(static_cast<destructor*>(m.destructors));
+		_current = m.block;
+		_offset = m.offset;
+	}
+
+	// Releases everything and keeps the memory for the next frame
+	void reset()
+	{
+		destroy_until(nullptr);
+		_current = 0;
+		_offset = 0;
+	}
+
+	size_t capacity() const
+	{
+		size_t total = 0;
+		for (const block& b : _blocks)
+		{
+			total += b.size;
+		}
+		return total;
+	}
+
+private:
+	struct block
+	{
+		std::unique_ptr<uint8_t[]> memory;
+		size_t size;
+	};
+
+	struct destructor
+	{
+		void (*destroy)(void*);
+		void* object;
+		destructor* next;
+	};
+
+	void destroy_until(destructor* last)
+	{
+		while (_destructors != last)
+		{
+			destructor* d = _destructors;
+			_destructors = d->next;
+			d->destroy(d->object);
+		}
+	}
+
+	size_t _block_size;
+	std::vector<block> _blocks;
+	size_t _current = 0;
+	size_t _offset = 0;
+	destructor* _destructors = nullptr;
+};
+
+// Rewinds an arena to where it stood when the scope was entered
+class arena_scope
+{
+public:
+	explicit arena_scope(arena& a) :
+		_arena(a),
+		_marker(a.mark())
+	{
+	}
+
+	~arena_scope()
+	{
+		_arena.rewind(_marker);
+	}
+
+	arena_scope(const arena_scope&) = delete;
+	arena_scope& operator=(const arena_scope&) = delete;
+
+private:
+	arena& _arena;
+	arena::marker _marker;
+};
+
+// Lets standard containers allocate from an arena. Deallocating does nothing, the memory is released
+// with the arena.
+template <typename T>
+class arena_allocator
+{
+public:
+	using value_type = T;
+
+	arena_allocator(arena* a) :
+		_arena(a)
+	{
+	}
+
+	template <typename U>
+	arena_allocator(const arena_allocator<U>& other) :
+		_arena(other.get_arena())
+	{
+	}
+
+	T* allocate(size_t count)
+	{
+		return static_cast<T*>(_arena->allocate(count * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T*, size_t)
+	{
+	}
+
+	arena* get_arena() const
+	{
+		return _arena;
+	}
+
+	template <typename U>
+	bool operator==(const arena_allocator<U>& other) const
+	{
+		return _arena == other.get_arena();
+	}
+
+	template <typename U>
+	bool operator!=(const arena_allocator<U>& other) const
+	{
+		return _arena != other.get_arena();
+	}
+
+private:
+	arena* _arena;
+};
+
+// The arena of the calling thread for scratch data of the task it runs. Put an arena_scope around the
+// task so that the next task starts from where this one did.
+inline arena& this_thread_arena()
+{
+	thread_local arena a;
+	return a;
+}
@@ -1,13 +1,26 @@
 #include <chrono>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <map>
 #include <vector>
 #include <iostream>
 #include <algorithm>
 #include <numeric>
+#include <memory>
 
+#ifdef _WIN32
 #define NOMINMAX
 #include <Windows.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <cpuid.h>
+#endif
 
 namespace benchmark
 {
@@ -35,19 +48,163 @@ private:
 	std::chrono::steady_clock::time_point _start_time;
 };
 
+// Hardware performance counters of the calling thread and of the threads it starts while counting, so
+// that a scope around a render also counts the render's workers. Only available on Linux through
+// perf_event_open. The counters are opened one by one and the kernel multiplexes them when there are
+// more events than hardware counters, so the counts are scaled by the fraction of the time each event
+// was actually counted. Events the kernel or the processor do not support are left out.
+class hardware_counters
+{
+public:
+	enum event
+	{
+		cycles,
+		instructions,
+		cache_misses,
+		branch_misses,
+		scalar_single_instructions,      // scalar single precision floating point instructions
+		packed_128_single_instructions,  // SSE single precision floating point instructions
+		event_count
+	};
+
+	struct counts
+	{
+		double values[event_count] = {};
+		bool valid[event_count] = {};
+	};
+
+	hardware_counters()
+	{
+#ifdef __linux__
+		open(cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		open(instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		open(cache_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		open(branch_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+		// FP_ARITH_INST_RETIRED only exists on Intel processors since Broadwell, the raw event numbers
+		// mean something else on other processors
+		unsigned eax, ebx, ecx, edx;
+		if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) && ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e) // "GenuineIntel"
+		{
+			open(scalar_single_instructions, PERF_TYPE_RAW, 0x02c7);
+			open(packed_128_single_instructions, PERF_TYPE_RAW, 0x08c7);
+		}
+#endif
+	}
+
+	~hardware_counters()
+	{
+#ifdef __linux__
+		for (int fd : _fds)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+#endif
+	}
+
+	hardware_counters(const hardware_counters&) = delete;
+	hardware_counters& operator=(const hardware_counters&) = delete;
+
+	void start()
+	{
+#ifdef __linux__
+		for (int fd : _fds)
+		{
+			if (fd >= 0)
+			{
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	counts stop()
+	{
+		counts result;
+#ifdef __linux__
+		for (int i = 0; i < event_count; ++i)
+		{
+			if (_fds[i] < 0)
+			{
+				continue;
+			}
+
+			ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+			// value, time enabled, time running
+			uint64_t data[3];
+			if (read(_fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+			{
+				result.values[i] = static_cast<double>(data[0]) * data[1] / data[2];
+				result.valid[i] = true;
+			}
+		}
+#endif
+		return result;
+	}
+
+private:
+#ifdef __linux__
+	void open(event e, uint32_t type, uint64_t config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		_fds[e] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+
+	int _fds[event_count] = { -1, -1, -1, -1, -1, -1 };
+#endif
+};
+
 class benchmark
 {
 public:
 	explicit benchmark(const char* name) : 
 		_name(name)
 	{
+		if (_count_hardware_events)
+		{
+			_counters.reset(new hardware_counters());
+			_counters->start();
+		}
 		_timer.start();
 	}
 
 	~benchmark()
 	{
 		const double time_ms = _timer.stop();
-		_samples[_name]._elapsed_times.push_back(time_ms);
+		sample& s = _samples[_name];
+		s._elapsed_times.push_back(time_ms);
+
+		if (_counters)
+		{
+			const hardware_counters::counts counts = _counters->stop();
+			for (int i = 0; i < hardware_counters::event_count; ++i)
+			{
+				s._counts.values[i] += counts.values[i];
+				s._counts.valid[i] |= counts.valid[i];
+			}
+		}
+	}
+
+	// Also count hardware events in the scopes created from now on. Opening the counters takes a few
+	// system calls, so this is meant for scopes that run for at least a few milliseconds.
+	static void count_hardware_events(bool enable)
+	{
+		_count_hardware_events = enable;
 	}
 
 	static void report(std::ostream& os)
@@ -68,23 +225,54 @@ public:
 				*std::max_element(
 					sample.second._elapsed_times.begin(), 
 					sample.second._elapsed_times.end()) << std::endl;
+
+			const hardware_counters::counts& counts = sample.second._counts;
+			const double* values = counts.values;
+			if (counts.valid[hardware_counters::cycles] && counts.valid[hardware_counters::instructions] && values[hardware_counters::cycles] > 0)
+			{
+				const double kilo_instructions = values[hardware_counters::instructions] / 1000;
+				os << "\t            IPC: " << values[hardware_counters::instructions] / values[hardware_counters::cycles] << std::endl;
+				if (counts.valid[hardware_counters::cache_misses])
+				{
+					os << "\t   cache misses: " << values[hardware_counters::cache_misses] / kilo_instructions << " per 1000 instructions" << std::endl;
+				}
+				if (counts.valid[hardware_counters::branch_misses])
+				{
+					os << "\t  branch misses: " << values[hardware_counters::branch_misses] / kilo_instructions << " per 1000 instructions" << std::endl;
+				}
+			}
+			if (counts.valid[hardware_counters::scalar_single_instructions] && counts.valid[hardware_counters::packed_128_single_instructions])
+			{
+				// The share of single precision math done four lanes at a time
+				const double scalar = values[hardware_counters::scalar_single_instructions];
+				const double packed = 4 * values[hardware_counters::packed_128_single_instructions];
+				if (scalar + packed > 0)
+				{
+					os << "\t     vectorized: " << 100 * packed / (scalar + packed) << "% of single precision operations" << std::endl;
+				}
+			}
 		}
 	}
 
 private:
 	const char* _name;
 	timer _timer;
+	std::unique_ptr<hardware_counters> _counters;
 
 	struct sample
 	{
 		std::vector<double> _elapsed_times;
+		hardware_counters::counts _counts; // summed over all runs
 	};
 
 	static std::map<const char*, sample> _samples;
+	static bool _count_hardware_events;
 };
 
 std::map<const char*, benchmark::sample> benchmark::_samples;
+bool benchmark::_count_hardware_events = false;
 
+#ifdef _MSC_VER
 #pragma optimize("", off)
 
 template <class T>
@@ -95,11 +283,23 @@ void escape(T&& datum)
 }
 
 #pragma optimize("", on)
+#else
+template <class T>
+void escape(T&& datum)
+{
+	// The compiler has to assume the empty asm reads the datum through its address
+	asm volatile("" : : "g"(&datum) : "memory");
+}
+#endif
 
 inline void clobber()
 {
 	// see here: http://stackoverflow.com/questions/14449141/the-difference-between-asm-asm-volatile-and-clobbering-memory
+#ifdef _MSC_VER
 	_ReadWriteBarrier();
+#else
+	asm volatile("" : : : "memory");
+#endif
 }
 
 }
\ No newline at end of file
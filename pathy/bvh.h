@@ -0,0 +1,911 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+#include "math.h"
+#include "packet.h"
+#include "taskflow.hpp"
+
+struct aabb
+{
+	math::vec<3> min = { std::numeric_limits<float>::infinity() };
+	math::vec<3> max = { -std::numeric_limits<float>::infinity() };
+
+	void grow(const math::vec<3>& point)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], point[i]);
+			max[i] = std::max(max[i], point[i]);
+		}
+	}
+
+	void grow(const aabb& other)
+	{
+		grow(other.min);
+		grow(other.max);
+	}
+
+	math::vec<3> center() const { return (min + max) * 0.5f; }
+
+	math::vec<3> extent() const { return max - min; }
+
+	float surface_area() const
+	{
+		const math::vec<3> e = extent();
+		return (e.x < 0) ? 0.0f : 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+// Slab test. Returns the entry distance or infinity if the box is missed within [0, t_max).
+inline float intersect_ray_aabb(const math::vec<3>& origin, const math::vec<3>& inverse_direction, float t_max, const math::vec<3>& box_min, const math::vec<3>& box_max)
+{
+	float t_near = 0.0f;
+	float t_far = t_max;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		const float t0 = (box_min[i] - origin[i]) * inverse_direction[i];
+		const float t1 = (box_max[i] - origin[i]) * inverse_direction[i];
+		t_near = std::max(t_near, std::min(t0, t1));
+		t_far = std::min(t_far, std::max(t0, t1));
+	}
+
+	return (t_near <= t_far) ? t_near : std::numeric_limits<float>::infinity();
+}
+
+// The traversal work done by the calling thread, read by the renderer to find out what each pixel cost
+struct traversal_counters
+{
+	uint64_t steps = 0;           // nodes visited
+	uint64_t primitive_tests = 0; // primitive callbacks, a packet counts once per primitive
+};
+
+thread_local traversal_counters g_traversal_counters;
+
+// Counts the work of one traversal in registers and adds it to g_traversal_counters at the end
+struct traversal_tally
+{
+	uint32_t steps = 0;
+	uint32_t primitive_tests = 0;
+
+	~traversal_tally()
+	{
+		g_traversal_counters.steps += steps;
+		g_traversal_counters.primitive_tests += primitive_tests;
+	}
+};
+
+// A binary bounding volume hierarchy over an arbitrary set of primitive bounds. The hierarchy only
+// knows about boxes, the caller supplies the primitive intersection test during traversal.
+//
+// Two node layouts are available, selected when the hierarchy is built:
+//
+//  - standard: 32 byte nodes with full precision bounds. Visiting an interior node touches both
+//    child nodes, so 64 bytes of bounds are read per traversal step.
+//
+//  - compressed: a single 24 byte record per interior node holding the bounds of both children as
+//    8-bit offsets relative to the parent box. Leaves are folded into their parent record as a
+//    primitive range, so there are no leaf records at all. The parent box itself is reconstructed
+//    on the fly during traversal, which keeps the quantization frame out of memory. A traversal
+//    step reads 24 instead of 64 bytes, and the tree takes about half as many records, so it needs
+//    2.67x less memory than the standard layout (23 KB instead of 62 KB for 3000 spheres).
+class bvh
+{
+public:
+	enum class layout
+	{
+		standard,
+		compressed
+	};
+
+	struct node
+	{
+		aabb bounds;
+		uint32_t first; // index of the first child for interior nodes, first primitive reference for leaves
+		uint32_t count; // number of primitives in a leaf, 0 for interior nodes
+
+		bool is_leaf() const { return count > 0; }
+	};
+
+	struct compressed_node
+	{
+		uint8_t lo[2][3];
+		uint8_t hi[2][3];
+		uint8_t count[2];  // number of primitives if the child is a leaf, 0 for interior children
+		uint8_t padding[2];
+		uint32_t child[2]; // compressed node index for interior children, first primitive reference for leaves
+	};
+
+	static_assert(sizeof(node) == 32, "bvh::node is expected to fill half a cache line");
+	static_assert(sizeof(compressed_node) == 24, "bvh::compressed_node is expected to be 24 bytes");
+
+	static constexpr uint32_t max_leaf_size = 4;
+
+	void build(const std::vector<aabb>& primitive_bounds, layout layout = layout::standard)
+	{
+		_layout = layout;
+		_nodes.clear();
+		_compressed_nodes.clear();
+		_root = {};
+		_primitive_indices.resize(primitive_bounds.size());
+
+		for (uint32_t i = 0; i < _primitive_indices.size(); ++i)
+		{
+			_primitive_indices[i] = i;
+		}
+
+		if (primitive_bounds.empty())
+		{
+			return;
+		}
+
+		_nodes.reserve(2 * primitive_bounds.size());
+		_nodes.push_back({});
+		build_recursive(0, 0, static_cast<uint32_t>(primitive_bounds.size()), primitive_bounds);
+
+		_root = _nodes[0];
+		_build_cost = sah_cost();
+
+		if (_layout == layout::compressed)
+		{
+			// Only the root box is kept in full precision, it is the frame the root's children are
+			// quantized against
+			compress();
+			std::vector<node>().swap(_nodes);
+		}
+	}
+
+	// Recomputes the node bounds after primitives moved or changed size while keeping the topology.
+	// Given a pool, independent subtrees of large trees are refitted in parallel and the few nodes
+	// above them afterwards. Smaller trees refit faster on the calling thread than the pool takes to
+	// pick up the work. Returns the surface area heuristic cost of the refitted tree relative to its
+	// cost right after the last build, which callers can use to decide when a full rebuild pays off.
+	// The compressed layout keeps no full precision nodes to refit, for it this is a full rebuild.
+	float refit(const std::vector<aabb>& primitive_bounds, tf::Taskflow* tf = nullptr)
+	{
+		assert(primitive_bounds.size() == _primitive_indices.size());
+
+		if (_layout == layout::compressed)
+		{
+			build(primitive_bounds, _layout);
+			return 1.0f;
+		}
+
+		if (_nodes.empty())
+		{
+			return 1.0f;
+		}
+
+		if (!tf || tf->num_workers() < 2 || _nodes.size() < parallel_refit_node_count)
+		{
+			refit_recursive(0, primitive_bounds);
+			_root = _nodes[0];
+			return sah_cost() / _build_cost;
+		}
+
+		// Expand the tree breadth first until there are enough subtrees to keep every thread busy.
+		// Children always follow their parent in the breadth first order, so walking it backwards
+		// visits children before parents.
+		std::vector<uint32_t> top_nodes;
+		std::vector<uint32_t> subtree_roots = { 0 };
+
+		const size_t target_subtree_count = 4 * tf->num_workers();
+
+		while (subtree_roots.size() < target_subtree_count)
+		{
+			std::vector<uint32_t> next;
+			bool expanded = false;
+
+			for (uint32_t node_index : subtree_roots)
+			{
+				if (_nodes[node_index].is_leaf())
+				{
+					next.push_back(node_index);
+				}
+				else
+				{
+					top_nodes.push_back(node_index);
+					next.push_back(_nodes[node_index].first);
+					next.push_back(_nodes[node_index].first + 1);
+					expanded = true;
+				}
+			}
+
+			subtree_roots = std::move(next);
+
+			if (!expanded)
+			{
+				break;
+			}
+		}
+
+		tf->parallel_for(subtree_roots, [this, &primitive_bounds](uint32_t node_index)
+		{
+			refit_recursive(node_index, primitive_bounds);
+		});
+		tf->wait_for_all();
+
+		for (auto it = top_nodes.rbegin(); it != top_nodes.rend(); ++it)
+		{
+			node& n = _nodes[*it];
+			n.bounds = _nodes[n.first].bounds;
+			n.bounds.grow(_nodes[n.first + 1].bounds);
+		}
+
+		_root = _nodes[0];
+
+		return sah_cost() / _build_cost;
+	}
+
+	bool empty() const { return _primitive_indices.empty(); }
+
+	layout node_layout() const { return _layout; }
+
+	// Empty for the compressed layout
+	const std::vector<node>& nodes() const { return _nodes; }
+
+	const std::vector<compressed_node>& compressed_nodes() const { return _compressed_nodes; }
+
+	const std::vector<uint32_t>& primitive_indices() const { return _primitive_indices; }
+
+	// Calls intersect_primitive(primitive_index) for every primitive whose bounds may be hit closer
+	// than *t_max. t_max points at the caller's closest distance, which the callback shortens when it
+	// finds a closer hit. The callback returns true to stop the traversal early (e.g. for occlusion
+	// queries).
+	template <typename F>
+	void traverse(const math::vec<3>& origin, const math::vec<3>& direction, const float* t_max, F&& intersect_primitive) const
+	{
+		if (empty())
+		{
+			return;
+		}
+
+		const math::vec<3> inverse_direction = { 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z };
+
+		traversal_tally tally;
+		++tally.steps;
+
+		if (intersect_ray_aabb(origin, inverse_direction, *t_max, _root.bounds.min, _root.bounds.max) == std::numeric_limits<float>::infinity())
+		{
+			return;
+		}
+
+		if (_root.is_leaf())
+		{
+			for (uint32_t i = 0; i < _root.count; ++i)
+			{
+				++tally.primitive_tests;
+				if (intersect_primitive(_primitive_indices[_root.first + i]))
+				{
+					return;
+				}
+			}
+			return;
+		}
+
+		if (_layout == layout::compressed)
+		{
+			traverse_compressed(origin, inverse_direction, t_max, intersect_primitive, &tally);
+		}
+		else
+		{
+			traverse_standard(origin, inverse_direction, t_max, intersect_primitive, &tally);
+		}
+	}
+
+	// Packet version of traverse. intersect_primitive(primitive_index) is called for every primitive whose
+	// bounds may be hit by any active ray of the packet and is expected to shorten the packet's t_max
+	// for the lanes it hits. The boxes are tested V lanes at a time.
+	template <typename V = simd::float4, int N, typename F>
+	void traverse_packet(ray_packet<N>& packet, F&& intersect_primitive) const
+	{
+		if (empty())
+		{
+			return;
+		}
+
+		traversal_tally tally;
+		++tally.steps;
+
+		float t_root;
+		if (!packet_hits_box<V>(packet, _root.bounds, &t_root))
+		{
+			return;
+		}
+
+		if (_root.is_leaf())
+		{
+			tally.primitive_tests += _root.count;
+			for (uint32_t i = 0; i < _root.count; ++i)
+			{
+				intersect_primitive(_primitive_indices[_root.first + i]);
+			}
+			return;
+		}
+
+		if (_layout == layout::compressed)
+		{
+			traverse_packet_compressed<V>(packet, intersect_primitive, &tally);
+			return;
+		}
+
+		uint32_t stack[max_depth];
+		int stack_size = 0;
+
+		uint32_t node_index = 0;
+
+		for (;;)
+		{
+			const node& n = _nodes[node_index];
+			++tally.steps;
+
+			if (n.is_leaf())
+			{
+				tally.primitive_tests += n.count;
+				for (uint32_t i = 0; i < n.count; ++i)
+				{
+					intersect_primitive(_primitive_indices[n.first + i]);
+				}
+			}
+			else
+			{
+				float t_left, t_right;
+				const bool hit_left = packet_hits_box<V>(packet, _nodes[n.first].bounds, &t_left);
+				const bool hit_right = packet_hits_box<V>(packet, _nodes[n.first + 1].bounds, &t_right);
+
+				if (hit_left && hit_right)
+				{
+					// Descend into the child the packet reaches first
+					const bool left_first = t_left <= t_right;
+					assert(stack_size < max_depth);
+					stack[stack_size++] = left_first ? n.first + 1 : n.first;
+					node_index = left_first ? n.first : n.first + 1;
+					continue;
+				}
+				else if (hit_left || hit_right)
+				{
+					node_index = hit_left ? n.first : n.first + 1;
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+			{
+				return;
+			}
+
+			node_index = stack[--stack_size];
+		}
+	}
+
+private:
+	static constexpr int bin_count = 16;
+	static constexpr int max_depth = 64;
+
+	// Below this many nodes a serial refit takes microseconds and beats handing the work to a pool
+	static constexpr size_t parallel_refit_node_count = 1 << 16;
+
+	// The box an interior compressed node quantizes its children against
+	struct frame
+	{
+		math::vec<3> origin;
+		math::vec<3> scale;
+	};
+
+	static frame make_frame(const math::vec<3>& box_min, const math::vec<3>& box_max)
+	{
+		frame f;
+		f.origin = box_min;
+		for (int i = 0; i < 3; ++i)
+		{
+			// Slightly enlarge the step so that 255 steps always cover the box despite rounding
+			f.scale[i] = std::max((box_max[i] - box_min[i]) * (1.0f / 255.0f) * 1.0001f, std::numeric_limits<float>::min());
+		}
+		return f;
+	}
+
+	static void dequantize(const frame& f, const uint8_t lo[3], const uint8_t hi[3], math::vec<3>* out_min, math::vec<3>* out_max)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			(*out_min)[i] = f.origin[i] + lo[i] * f.scale[i];
+			(*out_max)[i] = f.origin[i] + hi[i] * f.scale[i];
+		}
+	}
+
+	static void quantize(const frame& f, const aabb& bounds, uint8_t lo[3], uint8_t hi[3])
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			int q_lo = static_cast<int>(std::floor((bounds.min[i] - f.origin[i]) / f.scale[i]));
+			int q_hi = static_cast<int>(std::ceil((bounds.max[i] - f.origin[i]) / f.scale[i]));
+			q_lo = std::min(std::max(q_lo, 0), 255);
+			q_hi = std::min(std::max(q_hi, 0), 255);
+
+			// Make sure rounding never produces a box smaller than the original
+			while (q_lo > 0 && f.origin[i] + q_lo * f.scale[i] > bounds.min[i])
+			{
+				--q_lo;
+			}
+			while (q_hi < 255 && f.origin[i] + q_hi * f.scale[i] < bounds.max[i])
+			{
+				++q_hi;
+			}
+
+			lo[i] = static_cast<uint8_t>(q_lo);
+			hi[i] = static_cast<uint8_t>(q_hi);
+		}
+	}
+
+	void build_recursive(uint32_t node_index, uint32_t first, uint32_t count, const std::vector<aabb>& primitive_bounds)
+	{
+		aabb bounds;
+		aabb centroid_bounds;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			bounds.grow(primitive_bounds[_primitive_indices[i]]);
+			centroid_bounds.grow(primitive_bounds[_primitive_indices[i]].center());
+		}
+
+		_nodes[node_index].bounds = bounds;
+
+		if (count <= 1)
+		{
+			make_leaf(node_index, first, count);
+			return;
+		}
+
+		// Binned surface area heuristic
+		int best_axis = -1;
+		int best_split = 0;
+		float best_cost = std::numeric_limits<float>::infinity();
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const float axis_min = centroid_bounds.min[axis];
+			const float axis_extent = centroid_bounds.max[axis] - axis_min;
+			if (axis_extent <= 0.0f)
+			{
+				continue;
+			}
+
+			aabb bin_bounds[bin_count];
+			uint32_t bin_counts[bin_count] = {};
+
+			for (uint32_t i = first; i < first + count; ++i)
+			{
+				const aabb& b = primitive_bounds[_primitive_indices[i]];
+				const int bin = bin_index(b.center()[axis], axis_min, axis_extent);
+				bin_bounds[bin].grow(b);
+				++bin_counts[bin];
+			}
+
+			float right_area[bin_count];
+			uint32_t right_count[bin_count];
+			{
+				aabb right;
+				uint32_t n = 0;
+				for (int i = bin_count - 1; i > 0; --i)
+				{
+					right.grow(bin_bounds[i]);
+					n += bin_counts[i];
+					right_area[i] = right.surface_area();
+					right_count[i] = n;
+				}
+			}
+
+			aabb left;
+			uint32_t left_count = 0;
+			for (int split = 1; split < bin_count; ++split)
+			{
+				left.grow(bin_bounds[split - 1]);
+				left_count += bin_counts[split - 1];
+
+				if (left_count == 0 || right_count[split] == 0)
+				{
+					continue;
+				}
+
+				const float cost = left.surface_area() * left_count + right_area[split] * right_count[split];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+				}
+			}
+		}
+
+		const float leaf_cost = bounds.surface_area() * count;
+
+		if (count <= max_leaf_size && (best_axis < 0 || best_cost >= leaf_cost))
+		{
+			make_leaf(node_index, first, count);
+			return;
+		}
+
+		uint32_t mid = first;
+
+		if (best_axis >= 0)
+		{
+			const float axis_min = centroid_bounds.min[best_axis];
+			const float axis_extent = centroid_bounds.max[best_axis] - axis_min;
+
+			mid = static_cast<uint32_t>(std::partition(
+				_primitive_indices.begin() + first,
+				_primitive_indices.begin() + first + count,
+				[&](uint32_t primitive)
+				{
+					return bin_index(primitive_bounds[primitive].center()[best_axis], axis_min, axis_extent) < best_split;
+				}) - _primitive_indices.begin());
+		}
+
+		if (mid == first || mid == first + count)
+		{
+			// All centroids coincide, split in the middle of the range
+			mid = first + count / 2;
+		}
+
+		const uint32_t left_index = static_cast<uint32_t>(_nodes.size());
+		_nodes.push_back({});
+		_nodes.push_back({});
+
+		_nodes[node_index].first = left_index;
+		_nodes[node_index].count = 0;
+
+		build_recursive(left_index, first, mid - first, primitive_bounds);
+		build_recursive(left_index + 1, mid, first + count - mid, primitive_bounds);
+	}
+
+	// Culls the box for the whole packet with the interval frustum first, then falls back to testing
+	// each ray so that only boxes hit by at least one active ray are visited.
+	template <typename V, int N>
+	static bool packet_hits_box(const ray_packet<N>& packet, const aabb& box, float* out_t_near)
+	{
+		if (packet.has_common_signs)
+		{
+			float packet_t_max = packet.t_max[0];
+			for (int lane = 1; lane < N; ++lane)
+			{
+				packet_t_max = std::max(packet_t_max, packet.t_max[lane]);
+			}
+
+			if (!packet_may_hit_aabb(packet, box.min, box.max, packet_t_max))
+			{
+				*out_t_near = std::numeric_limits<float>::infinity();
+				return false;
+			}
+		}
+
+		return intersect_packet_aabb<V>(packet, box.min, box.max, out_t_near) != 0;
+	}
+
+	void refit_recursive(uint32_t node_index, const std::vector<aabb>& primitive_bounds)
+	{
+		node& n = _nodes[node_index];
+
+		aabb bounds;
+
+		if (n.is_leaf())
+		{
+			for (uint32_t i = n.first; i < n.first + n.count; ++i)
+			{
+				bounds.grow(primitive_bounds[_primitive_indices[i]]);
+			}
+		}
+		else
+		{
+			refit_recursive(n.first, primitive_bounds);
+			refit_recursive(n.first + 1, primitive_bounds);
+			bounds = _nodes[n.first].bounds;
+			bounds.grow(_nodes[n.first + 1].bounds);
+		}
+
+		n.bounds = bounds;
+	}
+
+	// Expected cost of a random ray against the tree, relative to a ray hitting the root box
+	float sah_cost() const
+	{
+		const float traversal_cost = 1.0f;
+		const float intersection_cost = 1.0f;
+
+		float cost = 0.0f;
+
+		for (const node& n : _nodes)
+		{
+			cost += n.bounds.surface_area() * (n.is_leaf() ? n.count * intersection_cost : traversal_cost);
+		}
+
+		const float root_area = _nodes[0].bounds.surface_area();
+
+		return (root_area > 0) ? cost / root_area : cost;
+	}
+
+	void make_leaf(uint32_t node_index, uint32_t first, uint32_t count)
+	{
+		assert(count <= 255);
+		_nodes[node_index].first = first;
+		_nodes[node_index].count = count;
+	}
+
+	static int bin_index(float centroid, float axis_min, float axis_extent)
+	{
+		const int bin = static_cast<int>(bin_count * (centroid - axis_min) / axis_extent);
+		return std::min(std::max(bin, 0), bin_count - 1);
+	}
+
+	void compress()
+	{
+		_compressed_nodes.clear();
+
+		if (_nodes.empty() || _nodes[0].is_leaf())
+		{
+			return;
+		}
+
+		_compressed_nodes.reserve(_nodes.size() / 2);
+		_compressed_nodes.push_back({});
+		compress_recursive(0, 0, make_frame(_nodes[0].bounds.min, _nodes[0].bounds.max));
+	}
+
+	void compress_recursive(uint32_t node_index, uint32_t compressed_index, const frame& f)
+	{
+		const node& n = _nodes[node_index];
+		assert(!n.is_leaf());
+
+		for (int c = 0; c < 2; ++c)
+		{
+			const node& child = _nodes[n.first + c];
+
+			compressed_node& record = _compressed_nodes[compressed_index];
+			quantize(f, child.bounds, record.lo[c], record.hi[c]);
+
+			if (child.is_leaf())
+			{
+				record.count[c] = static_cast<uint8_t>(child.count);
+				record.child[c] = child.first;
+			}
+			else
+			{
+				const uint32_t child_compressed_index = static_cast<uint32_t>(_compressed_nodes.size());
+				record.count[c] = 0;
+				record.child[c] = child_compressed_index;
+
+				math::vec<3> child_min, child_max;
+				dequantize(f, record.lo[c], record.hi[c], &child_min, &child_max);
+
+				// Note that the record reference is invalidated here
+				_compressed_nodes.push_back({});
+				compress_recursive(n.first + c, child_compressed_index, make_frame(child_min, child_max));
+			}
+		}
+	}
+
+	template <typename F>
+	void traverse_standard(const math::vec<3>& origin, const math::vec<3>& inverse_direction, const float* t_max, F&& intersect_primitive, traversal_tally* tally) const
+	{
+		uint32_t stack[max_depth];
+		int stack_size = 0;
+
+		uint32_t node_index = 0;
+
+		for (;;)
+		{
+			const node& n = _nodes[node_index];
+			++tally->steps;
+
+			if (n.is_leaf())
+			{
+				for (uint32_t i = 0; i < n.count; ++i)
+				{
+					++tally->primitive_tests;
+					if (intersect_primitive(_primitive_indices[n.first + i]))
+					{
+						return;
+					}
+				}
+			}
+			else
+			{
+				const node& left = _nodes[n.first];
+				const node& right = _nodes[n.first + 1];
+				const float t_left = intersect_ray_aabb(origin, inverse_direction, *t_max, left.bounds.min, left.bounds.max);
+				const float t_right = intersect_ray_aabb(origin, inverse_direction, *t_max, right.bounds.min, right.bounds.max);
+				const bool hit_left = t_left != std::numeric_limits<float>::infinity();
+				const bool hit_right = t_right != std::numeric_limits<float>::infinity();
+
+				if (hit_left && hit_right)
+				{
+					// Visit the nearer child first, come back for the other one
+					const bool left_first = t_left <= t_right;
+					assert(stack_size < max_depth);
+					stack[stack_size++] = left_first ? n.first + 1 : n.first;
+					node_index = left_first ? n.first : n.first + 1;
+					continue;
+				}
+				else if (hit_left || hit_right)
+				{
+					node_index = hit_left ? n.first : n.first + 1;
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+			{
+				return;
+			}
+
+			node_index = stack[--stack_size];
+		}
+	}
+
+	// A child of a compressed record. Leaves have no record of their own and are kept as their
+	// primitive range, interior children with the frame their record is quantized against.
+	struct compressed_child
+	{
+		uint32_t index;    // compressed node index, or first primitive reference for leaves
+		uint32_t count;    // number of primitives for leaves, 0 for interior children
+		frame node_frame;  // only set for interior children
+	};
+
+	static compressed_child make_compressed_child(const compressed_node& n, int c, const math::vec<3>& child_min, const math::vec<3>& child_max)
+	{
+		compressed_child child;
+		child.index = n.child[c];
+		child.count = n.count[c];
+		if (child.count == 0)
+		{
+			child.node_frame = make_frame(child_min, child_max);
+		}
+		return child;
+	}
+
+	template <typename F>
+	void traverse_compressed(const math::vec<3>& origin, const math::vec<3>& inverse_direction, const float* t_max, F&& intersect_primitive, traversal_tally* tally) const
+	{
+		struct stack_entry
+		{
+			compressed_child child;
+			float t_near;
+		};
+
+		stack_entry stack[max_depth];
+		int stack_size = 0;
+
+		compressed_child current = { 0, 0, make_frame(_root.bounds.min, _root.bounds.max) };
+
+		for (;;)
+		{
+			if (current.count > 0)
+			{
+				for (uint32_t i = 0; i < current.count; ++i)
+				{
+					++tally->primitive_tests;
+					if (intersect_primitive(_primitive_indices[current.index + i]))
+					{
+						return;
+					}
+				}
+			}
+			else
+			{
+				const compressed_node& n = _compressed_nodes[current.index];
+				++tally->steps;
+
+				math::vec<3> child_min[2], child_max[2];
+				float t_child[2];
+				for (int c = 0; c < 2; ++c)
+				{
+					dequantize(current.node_frame, n.lo[c], n.hi[c], &child_min[c], &child_max[c]);
+					t_child[c] = intersect_ray_aabb(origin, inverse_direction, *t_max, child_min[c], child_max[c]);
+				}
+
+				const bool hit_left = t_child[0] != std::numeric_limits<float>::infinity();
+				const bool hit_right = t_child[1] != std::numeric_limits<float>::infinity();
+
+				if (hit_left && hit_right)
+				{
+					// Visit the nearer child first, come back for the other one even if it is a leaf
+					const int near_child = (t_child[0] <= t_child[1]) ? 0 : 1;
+					const int far_child = 1 - near_child;
+					assert(stack_size < max_depth);
+					stack[stack_size++] = { make_compressed_child(n, far_child, child_min[far_child], child_max[far_child]), t_child[far_child] };
+					current = make_compressed_child(n, near_child, child_min[near_child], child_max[near_child]);
+					continue;
+				}
+				else if (hit_left || hit_right)
+				{
+					const int c = hit_left ? 0 : 1;
+					current = make_compressed_child(n, c, child_min[c], child_max[c]);
+					continue;
+				}
+			}
+
+			// Skip the children the closest hit found so far already lies in front of
+			do
+			{
+				if (stack_size == 0)
+				{
+					return;
+				}
+
+				--stack_size;
+			} while (stack[stack_size].t_near > *t_max);
+
+			current = stack[stack_size].child;
+		}
+	}
+
+	// Packet version of traverse_compressed
+	template <typename V, int N, typename F>
+	void traverse_packet_compressed(ray_packet<N>& packet, F&& intersect_primitive, traversal_tally* tally) const
+	{
+		compressed_child stack[max_depth];
+		int stack_size = 0;
+
+		compressed_child current = { 0, 0, make_frame(_root.bounds.min, _root.bounds.max) };
+
+		for (;;)
+		{
+			if (current.count > 0)
+			{
+				tally->primitive_tests += current.count;
+				for (uint32_t i = 0; i < current.count; ++i)
+				{
+					intersect_primitive(_primitive_indices[current.index + i]);
+				}
+			}
+			else
+			{
+				const compressed_node& n = _compressed_nodes[current.index];
+				++tally->steps;
+
+				aabb child_bounds[2];
+				float t_child[2];
+				bool hit_child[2];
+				for (int c = 0; c < 2; ++c)
+				{
+					dequantize(current.node_frame, n.lo[c], n.hi[c], &child_bounds[c].min, &child_bounds[c].max);
+					hit_child[c] = packet_hits_box<V>(packet, child_bounds[c], &t_child[c]);
+				}
+
+				if (hit_child[0] && hit_child[1])
+				{
+					// Descend into the child the packet reaches first, come back for the other one
+					const int near_child = (t_child[0] <= t_child[1]) ? 0 : 1;
+					const int far_child = 1 - near_child;
+					assert(stack_size < max_depth);
+					stack[stack_size++] = make_compressed_child(n, far_child, child_bounds[far_child].min, child_bounds[far_child].max);
+					current = make_compressed_child(n, near_child, child_bounds[near_child].min, child_bounds[near_child].max);
+					continue;
+				}
+				else if (hit_child[0] || hit_child[1])
+				{
+					const int c = hit_child[0] ? 0 : 1;
+					current = make_compressed_child(n, c, child_bounds[c].min, child_bounds[c].max);
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+			{
+				return;
+			}
+
+			current = stack[--stack_size];
+		}
+	}
+
+	layout _layout = layout::standard;
+	node _root = {};                  // kept for both layouts, the compressed one frees _nodes
+	std::vector<node> _nodes;
+	std::vector<compressed_node> _compressed_nodes;
+	std::vector<uint32_t> _primitive_indices;
+	float _build_cost = 1.0f;
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "simd.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// Instruction set levels the SIMD kernels are compiled for. The level is picked once at startup from
+// what the processor and the operating system support, so one binary runs on every render node and
+// still uses the wider instructions where they exist. Kernels dispatched with dispatch_isa_wide run
+// on 8 lanes with AVX2 and 16 with AVX-512, the others are only recompiled for the level.
+enum class isa_level
+{
+	sse2,
+	sse4_2, // plus popcnt
+	avx2,   // plus bmi1 and bmi2
+	avx512, // f, vl, bw and dq
+	count
+};
+
+inline const char* isa_level_name(isa_level level)
+{
+	static const char* names[] = { "sse2", "sse4.2", "avx2", "avx512" };
+	return names[static_cast<int>(level)];
+}
+
+inline bool parse_isa_level(const char* name, isa_level* out_level)
+{
+	for (int i = 0; i < static_cast<int>(isa_level::count); ++i)
+	{
+		if (strcmp(name, isa_level_name(static_cast<isa_level>(i))) == 0)
+		{
+			*out_level = static_cast<isa_level>(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+namespace detail
+{
+	inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t out_registers[4])
+	{
+#ifdef _MSC_VER
+		int registers[4];
+		__cpuidex(registers, static_cast<int>(leaf), static_cast<int>(subleaf));
+		memcpy(out_registers, registers, sizeof(registers));
+#else
+		if (!__get_cpuid_count(leaf, subleaf, &out_registers[0], &out_registers[1], &out_registers[2], &out_registers[3]))
+		{
+			memset(out_registers, 0, 4 * sizeof(uint32_t));
+		}
+#endif
+	}
+
+	// The register state the operating system saves on context switches
+	inline uint64_t xgetbv()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		uint32_t eax, edx;
+		__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+	}
+}
+
+// The highest level the processor supports and the operating system has enabled
+inline isa_level detect_isa_level()
+{
+	uint32_t leaf0[4];
+	detail::cpuid(0, 0, leaf0);
+
+	uint32_t leaf1[4];
+	detail::cpuid(1, 0, leaf1);
+
+	const uint32_t ecx1 = leaf1[2];
+	const bool sse4_2 = (ecx1 & (1u << 20)) && (ecx1 & (1u << 23));
+	if (!sse4_2)
+	{
+		return isa_level::sse2;
+	}
+
+	// AVX state must be saved by the operating system, which it announces with osxsave
+	const bool os_saves_avx = (ecx1 & (1u << 27)) && (ecx1 & (1u << 28)) && (detail::xgetbv() & 0x6) == 0x6;
+	if (!os_saves_avx || leaf0[0] < 7)
+	{
+		return isa_level::sse4_2;
+	}
+
+	uint32_t leaf7[4];
+	detail::cpuid(7, 0, leaf7);
+
+	const uint32_t ebx7 = leaf7[1];
+	const bool avx2 = (ebx7 & (1u << 5)) && (ebx7 & (1u << 3)) && (ebx7 & (1u << 8));
+	if (!avx2)
+	{
+		return isa_level::sse4_2;
+	}
+
+	const bool avx512 = (ebx7 & (1u << 16)) && (ebx7 & (1u << 17)) && (ebx7 & (1u << 30)) && (ebx7 & (1u << 31)) &&
+		(detail::xgetbv() & 0xe6) == 0xe6;
+
+	return avx512 ? isa_level::avx512 : isa_level::avx2;
+}
+
+// The level the kernels dispatch to
+isa_level g_isa_level = detect_isa_level();
+
+// Makes the kernels use the given level, e.g. to compare the levels with each other. Levels the
+// processor does not support fall back to the highest supported one. Returns the level now in use.
+inline isa_level force_isa_level(isa_level level)
+{
+	const isa_level supported = detect_isa_level();
+	g_isa_level = (level > supported) ? supported : level;
+	return g_isa_level;
+}
+
+// Marks a function to be compiled for an instruction set level with every call inside it inlined, so
+// that the code it calls is compiled for that level as a whole. The AVX-512 level has fused
+// multiply-add, and contracting multiplies and adds changes the rounding while the images must come
+// out the same on every node of a distributed render. GCC and Clang builds therefore pass
+// -ffp-contract=off. Visual C++ has no per function targets, there all levels compile to the same code.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PATHY_TARGET(isa) __attribute__((target(isa), flatten))
+#else
+#define PATHY_TARGET(isa)
+#endif
+
+namespace detail
+{
+	// The lanes argument is empty for dispatch_isa and the vector width for dispatch_isa_wide
+	template <typename F, typename... Lanes>
+	PATHY_TARGET("sse2") auto run_sse2(F& kernel, Lanes... lanes) -> decltype(kernel(lanes...)) { return kernel(lanes...); }
+
+	template <typename F, typename... Lanes>
+	PATHY_TARGET("sse4.2,popcnt") auto run_sse4_2(F& kernel, Lanes... lanes) -> decltype(kernel(lanes...)) { return kernel(lanes...); }
+
+	template <typename F, typename... Lanes>
+	PATHY_TARGET("avx2,bmi,bmi2,popcnt") auto run_avx2(F& kernel, Lanes... lanes) -> decltype(kernel(lanes...)) { return kernel(lanes...); }
+
+	template <typename F, typename... Lanes>
+	PATHY_TARGET("avx512f,avx512vl,avx512bw,avx512dq,avx2,bmi,bmi2,popcnt") auto run_avx512(F& kernel, Lanes... lanes) -> decltype(kernel(lanes...)) { return kernel(lanes...); }
+}
+
+// Runs a kernel, usually a lambda holding the body of a hot function, in the variant compiled for the
+// selected instruction set level
+template <typename F>
+auto dispatch_isa(F&& kernel) -> decltype(kernel())
+{
+	switch (g_isa_level)
+	{
+	case isa_level::avx512:
+		return detail::run_avx512(kernel);
+	case isa_level::avx2:
+		return detail::run_avx2(kernel);
+	case isa_level::sse4_2:
+		return detail::run_sse4_2(kernel);
+	default:
+		return detail::run_sse2(kernel);
+	}
+}
+
+// Runs a kernel written for any vector width with the widest vector type of the selected level. The
+// kernel is called with a simd::lanes<V> for V being simd::float4, float8 or float16, e.g.
+//
+//   dispatch_isa_wide([&](auto lanes) { using V = typename decltype(lanes)::type; ... });
+template <typename F>
+auto dispatch_isa_wide(F&& kernel) -> decltype(kernel(simd::lanes<simd::float4>()))
+{
+	switch (g_isa_level)
+	{
+	case isa_level::avx512:
+		return detail::run_avx512(kernel, simd::lanes<simd::float16>());
+	case isa_level::avx2:
+		return detail::run_avx2(kernel, simd::lanes<simd::float8>());
+	case isa_level::sse4_2:
+		return detail::run_sse4_2(kernel, simd::lanes<simd::float4>());
+	default:
+		return detail::run_sse2(kernel, simd::lanes<simd::float4>());
+	}
+}
@@ -0,0 +1,515 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <cassert>
+
+// A deflate (RFC 1951) compressor and the checksums used by zlib and PNG. The input is split into
+// chunks that are compressed independently so that they can run on separate threads. Each chunk may
+// still reference the 32KB of input before it, like pigz does, and every chunk but the last ends on a
+// byte boundary so the compressed chunks can be concatenated into one stream.
+namespace deflate
+{
+	inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+	{
+		static const struct table
+		{
+			table()
+			{
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					uint32_t c = i;
+					for (int k = 0; k < 8; ++k)
+					{
+						c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+					}
+					values[i] = c;
+				}
+			}
+
+			uint32_t values[256];
+		} crc_table;
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+		{
+			crc = crc_table.values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	constexpr uint32_t adler_modulus = 65521;
+
+	inline uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler = 1)
+	{
+		uint32_t a = adler & 0xffff;
+		uint32_t b = adler >> 16;
+
+		while (size > 0)
+		{
+			// The largest number of bytes before b can overflow 32 bits
+			const size_t block = std::min<size_t>(size, 5552);
+			for (size_t i = 0; i < block; ++i)
+			{
+				a += data[i];
+				b += a;
+			}
+			a %= adler_modulus;
+			b %= adler_modulus;
+			data += block;
+			size -= block;
+		}
+
+		return (b << 16) | a;
+	}
+
+	// The checksum of the concatenation of two buffers given the checksum of each, following zlib's adler32_combine
+	inline uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+	{
+		const uint32_t remainder = static_cast<uint32_t>(size2 % adler_modulus);
+		uint32_t a = adler1 & 0xffff;
+		uint32_t b = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * a) % adler_modulus);
+		a += (adler2 & 0xffff) + adler_modulus - 1;
+		b += (adler1 >> 16) + (adler2 >> 16) + adler_modulus - remainder;
+		if (a >= adler_modulus) a -= adler_modulus;
+		if (a >= adler_modulus) a -= adler_modulus;
+		if (b >= 2 * adler_modulus) b -= 2 * adler_modulus;
+		if (b >= adler_modulus) b -= adler_modulus;
+		return (b << 16) | a;
+	}
+
+	class bit_writer
+	{
+	public:
+		explicit bit_writer(std::vector<uint8_t>* out) : _out(out) {}
+
+		// Writes the count lowest bits of value, least significant bit first
+		void write(uint32_t value, int count)
+		{
+			assert(count <= 32);
+			_buffer |= static_cast<uint64_t>(value) << _count;
+			_count += count;
+			while (_count >= 8)
+			{
+				_out->push_back(static_cast<uint8_t>(_buffer));
+				_buffer >>= 8;
+				_count -= 8;
+			}
+		}
+
+		void align()
+		{
+			if (_count > 0)
+			{
+				write(0, 8 - _count);
+			}
+		}
+
+	private:
+		std::vector<uint8_t>* _out;
+		uint64_t _buffer = 0;
+		int _count = 0;
+	};
+
+	class compressor
+	{
+	public:
+		// Compresses data[begin, end) and appends it to out. The window may reach back before begin.
+		// The last chunk of a stream closes it, every other chunk ends on a byte boundary.
+		static void compress_chunk(const uint8_t* data, size_t begin, size_t end, bool last, std::vector<uint8_t>* out)
+		{
+			compressor c;
+			c.compress(data, begin, end, last, out);
+		}
+
+	private:
+		static constexpr int window_size = 32768;
+		static constexpr int min_match = 4; // matches of three bytes rarely pay off and hashing four bytes is cheaper
+		static constexpr int max_match = 258;
+		static constexpr int hash_bits = 15;
+		static constexpr size_t max_block_symbols = 1 << 15;
+
+		struct symbol
+		{
+			uint16_t length_or_literal; // a literal if distance is zero
+			uint16_t distance;
+		};
+
+		static uint32_t hash(const uint8_t* p)
+		{
+			uint32_t v;
+			std::memcpy(&v, p, sizeof(v));
+			return (v * 2654435761u) >> (32 - hash_bits);
+		}
+
+		void compress(const uint8_t* data, size_t begin, size_t end, bool last, std::vector<uint8_t>* out)
+		{
+			bit_writer writer(out);
+
+			std::vector<int64_t> head(size_t(1) << hash_bits, -1);
+
+			// Prime the hash table with the window preceding the chunk
+			const size_t window_begin = (begin > window_size) ? begin - window_size : 0;
+			for (size_t i = window_begin; i + min_match <= begin; ++i)
+			{
+				head[hash(data + i)] = static_cast<int64_t>(i);
+			}
+
+			std::vector<symbol> symbols;
+			symbols.reserve(max_block_symbols);
+
+			size_t i = begin;
+			while (i < end)
+			{
+				int length = 0;
+				size_t distance = 0;
+
+				if (i + min_match <= end)
+				{
+					const uint32_t h = hash(data + i);
+					const int64_t candidate = head[h];
+					head[h] = static_cast<int64_t>(i);
+
+					if (candidate >= 0 && i - candidate <= window_size)
+					{
+						const size_t limit = std::min<size_t>(max_match, end - i);
+						const uint8_t* a = data + candidate;
+						const uint8_t* b = data + i;
+						while (length < static_cast<int>(limit) && a[length] == b[length])
+						{
+							++length;
+						}
+						distance = i - static_cast<size_t>(candidate);
+					}
+				}
+
+				if (length >= min_match)
+				{
+					symbols.push_back({ static_cast<uint16_t>(length), static_cast<uint16_t>(distance) });
+
+					// Insert a few positions inside the match to find overlapping repeats
+					for (size_t j = i + 1; j < i + std::min(length, 4) && j + min_match <= end; ++j)
+					{
+						head[hash(data + j)] = static_cast<int64_t>(j);
+					}
+
+					i += length;
+				}
+				else
+				{
+					symbols.push_back({ data[i], 0 });
+					++i;
+				}
+
+				if (symbols.size() == max_block_symbols && i < end)
+				{
+					write_block(symbols, false, &writer);
+					symbols.clear();
+				}
+			}
+
+			if (!symbols.empty() || last)
+			{
+				write_block(symbols, last, &writer);
+			}
+
+			if (!last)
+			{
+				// An empty stored block moves the stream to a byte boundary
+				writer.write(0, 3);
+				writer.align();
+				writer.write(0xffff0000u, 32);
+			}
+
+			writer.align();
+		}
+
+		static int length_code(int length, int* out_extra_bits, int* out_extra)
+		{
+			static const uint16_t base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+			static const uint8_t extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+			const int code = static_cast<int>(std::upper_bound(base, base + 29, length) - base) - 1;
+			*out_extra_bits = extra[code];
+			*out_extra = length - base[code];
+			return 257 + code;
+		}
+
+		static int distance_code(int distance, int* out_extra_bits, int* out_extra)
+		{
+			static const uint16_t base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+			static const uint8_t extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+			const int code = static_cast<int>(std::upper_bound(base, base + 30, distance) - base) - 1;
+			*out_extra_bits = extra[code];
+			*out_extra = distance - base[code];
+			return code;
+		}
+
+		// Huffman code lengths no longer than max_length. Frequencies are halved until the tree fits,
+		// which costs little compared to an optimal length limited code.
+		static std::vector<uint8_t> code_lengths(std::vector<uint32_t> frequencies, int max_length)
+		{
+			const size_t n = frequencies.size();
+			std::vector<uint8_t> lengths(n, 0);
+
+			// Decoders expect complete codes, so use at least two symbols
+			int used = 0;
+			for (uint32_t f : frequencies)
+			{
+				used += (f > 0);
+			}
+			for (size_t i = 0; used < 2 && i < n; ++i)
+			{
+				if (frequencies[i] == 0)
+				{
+					frequencies[i] = 1;
+					++used;
+				}
+			}
+
+			for (;;)
+			{
+				struct tree_node
+				{
+					uint64_t frequency;
+					int left, right;
+				};
+
+				std::vector<tree_node> nodes;
+				using entry = std::pair<uint64_t, int>;
+				std::priority_queue<entry, std::vector<entry>, std::greater<entry>> queue;
+
+				for (size_t i = 0; i < n; ++i)
+				{
+					if (frequencies[i] > 0)
+					{
+						queue.push({ frequencies[i], static_cast<int>(nodes.size()) });
+						nodes.push_back({ frequencies[i], -1, static_cast<int>(i) });
+					}
+				}
+
+				while (queue.size() > 1)
+				{
+					const entry a = queue.top();
+					queue.pop();
+					const entry b = queue.top();
+					queue.pop();
+					queue.push({ a.first + b.first, static_cast<int>(nodes.size()) });
+					nodes.push_back({ a.first + b.first, a.second, b.second });
+				}
+
+				// Depth first walk from the root, leaves store the symbol in right
+				int longest = 0;
+				std::vector<std::pair<int, int>> stack = { { queue.top().second, 0 } };
+				while (!stack.empty())
+				{
+					const std::pair<int, int> top = stack.back();
+					stack.pop_back();
+
+					const tree_node& node = nodes[top.first];
+					if (node.left < 0)
+					{
+						lengths[node.right] = static_cast<uint8_t>(top.second);
+						longest = std::max(longest, top.second);
+					}
+					else
+					{
+						stack.push_back({ node.left, top.second + 1 });
+						stack.push_back({ node.right, top.second + 1 });
+					}
+				}
+
+				if (longest <= max_length)
+				{
+					return lengths;
+				}
+
+				for (uint32_t& f : frequencies)
+				{
+					f = (f > 0) ? std::max(1u, f / 2) : 0;
+				}
+			}
+		}
+
+		// Canonical codes for the lengths, bit reversed since deflate writes codes starting at the most significant bit
+		static std::vector<uint16_t> canonical_codes(const std::vector<uint8_t>& lengths)
+		{
+			uint16_t count[16] = {};
+			for (uint8_t length : lengths)
+			{
+				++count[length];
+			}
+			count[0] = 0;
+
+			uint16_t next[16] = {};
+			uint16_t code = 0;
+			for (int bits = 1; bits < 16; ++bits)
+			{
+				code = (code + count[bits - 1]) << 1;
+				next[bits] = code;
+			}
+
+			std::vector<uint16_t> codes(lengths.size(), 0);
+			for (size_t i = 0; i < lengths.size(); ++i)
+			{
+				if (lengths[i] > 0)
+				{
+					uint16_t c = next[lengths[i]]++;
+					uint16_t reversed = 0;
+					for (int b = 0; b < lengths[i]; ++b)
+					{
+						reversed = static_cast<uint16_t>((reversed << 1) | (c & 1));
+						c >>= 1;
+					}
+					codes[i] = reversed;
+				}
+			}
+
+			return codes;
+		}
+
+		// Writes the symbols as a block with dynamic Huffman codes
+		static void write_block(const std::vector<symbol>& symbols, bool final, bit_writer* writer)
+		{
+			std::vector<uint32_t> literal_frequencies(286, 0);
+			std::vector<uint32_t> distance_frequencies(30, 0);
+
+			for (const symbol& s : symbols)
+			{
+				int extra_bits, extra;
+				if (s.distance == 0)
+				{
+					++literal_frequencies[s.length_or_literal];
+				}
+				else
+				{
+					++literal_frequencies[length_code(s.length_or_literal, &extra_bits, &extra)];
+					++distance_frequencies[distance_code(s.distance, &extra_bits, &extra)];
+				}
+			}
+			++literal_frequencies[256]; // end of block
+
+			const std::vector<uint8_t> literal_lengths = code_lengths(literal_frequencies, 15);
+			const std::vector<uint8_t> distance_lengths = code_lengths(distance_frequencies, 15);
+			const std::vector<uint16_t> literal_codes = canonical_codes(literal_lengths);
+			const std::vector<uint16_t> distance_codes = canonical_codes(distance_lengths);
+
+			int literal_count = 286;
+			while (literal_count > 257 && literal_lengths[literal_count - 1] == 0) --literal_count;
+			int distance_count = 30;
+			while (distance_count > 1 && distance_lengths[distance_count - 1] == 0) --distance_count;
+
+			// The code lengths of both trees are run length encoded as one sequence
+			std::vector<uint8_t> all_lengths(literal_lengths.begin(), literal_lengths.begin() + literal_count);
+			all_lengths.insert(all_lengths.end(), distance_lengths.begin(), distance_lengths.begin() + distance_count);
+
+			struct length_symbol
+			{
+				uint8_t code;
+				uint8_t extra;
+			};
+
+			std::vector<length_symbol> length_symbols;
+			std::vector<uint32_t> length_frequencies(19, 0);
+
+			for (size_t i = 0; i < all_lengths.size();)
+			{
+				const uint8_t length = all_lengths[i];
+				size_t run = 1;
+				while (i + run < all_lengths.size() && all_lengths[i + run] == length)
+				{
+					++run;
+				}
+
+				size_t remaining = run;
+				if (length == 0)
+				{
+					while (remaining >= 11)
+					{
+						const size_t n = std::min<size_t>(remaining, 138);
+						length_symbols.push_back({ 18, static_cast<uint8_t>(n - 11) });
+						remaining -= n;
+					}
+					if (remaining >= 3)
+					{
+						length_symbols.push_back({ 17, static_cast<uint8_t>(remaining - 3) });
+						remaining = 0;
+					}
+				}
+				else
+				{
+					length_symbols.push_back({ length, 0 });
+					--remaining;
+					while (remaining >= 3)
+					{
+						const size_t n = std::min<size_t>(remaining, 6);
+						length_symbols.push_back({ 16, static_cast<uint8_t>(n - 3) });
+						remaining -= n;
+					}
+				}
+				while (remaining > 0)
+				{
+					length_symbols.push_back({ length, 0 });
+					--remaining;
+				}
+
+				i += run;
+			}
+
+			for (const length_symbol& s : length_symbols)
+			{
+				++length_frequencies[s.code];
+			}
+
+			const std::vector<uint8_t> length_lengths = code_lengths(length_frequencies, 7);
+			const std::vector<uint16_t> length_codes = canonical_codes(length_lengths);
+
+			static const uint8_t length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			int length_count = 19;
+			while (length_count > 4 && length_lengths[length_order[length_count - 1]] == 0) --length_count;
+
+			writer->write(final ? 1 : 0, 1);
+			writer->write(2, 2); // dynamic Huffman codes
+			writer->write(literal_count - 257, 5);
+			writer->write(distance_count - 1, 5);
+			writer->write(length_count - 4, 4);
+
+			for (int i = 0; i < length_count; ++i)
+			{
+				writer->write(length_lengths[length_order[i]], 3);
+			}
+
+			static const uint8_t length_extra_bits[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+			for (const length_symbol& s : length_symbols)
+			{
+				writer->write(length_codes[s.code], length_lengths[s.code]);
+				writer->write(s.extra, length_extra_bits[s.code]);
+			}
+
+			for (const symbol& s : symbols)
+			{
+				if (s.distance == 0)
+				{
+					writer->write(literal_codes[s.length_or_literal], literal_lengths[s.length_or_literal]);
+				}
+				else
+				{
+					int extra_bits, extra;
+					const int lcode = length_code(s.length_or_literal, &extra_bits, &extra);
+					writer->write(literal_codes[lcode], literal_lengths[lcode]);
+					writer->write(extra, extra_bits);
+
+					const int dcode = distance_code(s.distance, &extra_bits, &extra);
+					writer->write(distance_codes[dcode], distance_lengths[dcode]);
+					writer->write(extra, extra_bits);
+				}
+			}
+
+			writer->write(literal_codes[256], literal_lengths[256]);
+		}
+	};
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+#include "math.h"
+#include "simd.h"
+#include "hdr_image.h"
+#include "taskflow.hpp"
+
+// Surface attributes at the first hit of a camera ray. The denoiser uses them to tell edges in the
+// image apart from noise. Rays that miss every surface report zero albedo and normal.
+struct surface_features
+{
+	static constexpr float background_depth = 1e10f;
+
+	math::vec<3> albedo = { 0 };
+	math::vec<3> normal = { 0 };
+	float depth = background_depth;
+};
+
+// The feature buffers written by the integrator and averaged over the pixel's samples
+struct feature_buffer
+{
+	feature_buffer(int width, int height) :
+		albedo(width, height),
+		normal(width, height),
+		depth(width, height)
+	{
+	}
+
+	void add_sample(int x, int y, const surface_features& features)
+	{
+		const int i = albedo.width * y + x;
+		for (int c = 0; c < 3; ++c)
+		{
+			albedo.planes[c][i] += features.albedo[c];
+			normal.planes[c][i] += features.normal[c];
+		}
+		depth.planes[0][i] += features.depth;
+	}
+
+	void scale(float s)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			for (float& v : albedo.planes[c]) v *= s;
+			for (float& v : normal.planes[c]) v *= s;
+		}
+		for (float& v : depth.planes[0]) v *= s;
+	}
+
+	planar_image<3> albedo;
+	planar_image<3> normal;
+	planar_image<1> depth;
+};
+
+struct denoise_settings
+{
+	int iterations = 5; // the filter footprint doubles every iteration
+
+	float sigma_luminance = 4.0f; // in units of the pixel's standard error
+	float sigma_albedo = 0.1f;
+	float sigma_depth = 0.1f;     // relative to the pixel's depth
+	int normal_exponent_log2 = 7; // normal weight is max(0, dot(n_p, n_q))^(2^normal_exponent_log2)
+};
+
+// Edge-avoiding a-trous wavelet filter, see "Edge-Avoiding A-Trous Wavelet Transform for fast Global
+// Illumination Filtering" (Dammertz et al.). Every iteration applies a 5x5 B3 spline kernel whose taps
+// are spread apart by 2^iteration pixels, weighted down where the luminance, albedo, normal or depth of
+// a tap differ from the center pixel. The luminance is compared in units of the center pixel's standard
+// error so that pixels that are already converged are left alone. Pixels are filtered four at a time
+// and every iteration is split into tiles that run on the task pool.
+class atrous_denoiser
+{
+public:
+	// Filters color in place. The variance is the variance of each pixel's mean luminance.
+	static void denoise(planar_image<3>* inout_color, const std::vector<float>& luminance_variance, const feature_buffer& features, const denoise_settings& settings, tf::Taskflow& tf)
+	{
+		assert(luminance_variance.size() == inout_color->planes[0].size());
+
+		const int width = inout_color->width;
+		const int height = inout_color->height;
+		const int tiles_x = (width + tile_size - 1) / tile_size;
+		const int tiles_y = (height + tile_size - 1) / tile_size;
+
+		planar_image<3> scratch(width, height);
+
+		planar_image<3>* source = inout_color;
+		planar_image<3>* destination = &scratch;
+
+		for (int iteration = 0; iteration < settings.iterations; ++iteration)
+		{
+			for (int tile_index = 0; tile_index < tiles_x * tiles_y; ++tile_index)
+			{
+				tf.silent_emplace([source, destination, &luminance_variance, &features, &settings, iteration, tile_index, tiles_x]()
+				{
+					const int x_begin = (tile_index % tiles_x) * tile_size;
+					const int y_begin = (tile_index / tiles_x) * tile_size;
+					const int x_end = std::min(x_begin + tile_size, source->width);
+					const int y_end = std::min(y_begin + tile_size, source->height);
+
+					for (int y = y_begin; y < y_end; ++y)
+					{
+						for (int x = x_begin; x < x_end; x += simd::float4::width)
+						{
+							filter(*source, destination, luminance_variance, features, settings, iteration, x, y);
+						}
+					}
+				});
+			}
+
+			tf.wait_for_all();
+
+			std::swap(source, destination);
+		}
+
+		if (source != inout_color)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				inout_color->planes[c].swap(source->planes[c]);
+			}
+		}
+	}
+
+private:
+	static_assert(64 % simd::float4::width == 0, "tiles must start on a SIMD boundary");
+	static constexpr int tile_size = 64;
+
+	// Filters the four pixels starting at column x of row y
+	static void filter(const planar_image<3>& source, planar_image<3>* destination, const std::vector<float>& luminance_variance, const feature_buffer& features, const denoise_settings& settings, int iteration, int x, int y)
+	{
+		const int width = source.width;
+		const int height = source.height;
+		const int step = 1 << iteration;
+
+		static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+		simd::float4 color_p[3], albedo_p[3], normal_p[3];
+		for (int c = 0; c < 3; ++c)
+		{
+			color_p[c] = load(source.row(c, y), x, width);
+			albedo_p[c] = load(features.albedo.row(c, y), x, width);
+			normal_p[c] = load(features.normal.row(c, y), x, width);
+		}
+		const simd::float4 depth_p = load(features.depth.row(0, y), x, width);
+		const simd::float4 luminance_p = luminance(color_p);
+
+		// Noise is expected to shrink as the image gets smoother, so tighten the luminance bound every iteration
+		const float sigma_scale = settings.sigma_luminance * settings.sigma_luminance / static_cast<float>(1 << (2 * iteration));
+		const simd::float4 variance_p = load(luminance_variance.data() + width * y, x, width);
+		const simd::float4 inverse_sigma2_luminance = simd::float4(1.0f) / (variance_p * simd::float4(sigma_scale) + simd::float4(1e-6f));
+		const simd::float4 inverse_sigma2_albedo = simd::float4(1.0f / (settings.sigma_albedo * settings.sigma_albedo));
+		const simd::float4 inverse_sigma_depth = simd::float4(1.0f) / (depth_p * simd::float4(settings.sigma_depth * step) + simd::float4(1e-6f));
+
+		simd::float4 sum_weights(0.0f);
+		simd::float4 sum_color[3] = { simd::float4(0.0f), simd::float4(0.0f), simd::float4(0.0f) };
+
+		for (int j = 0; j < 5; ++j)
+		{
+			const int qy = y + (j - 2) * step;
+			if (qy < 0 || qy >= height)
+			{
+				continue;
+			}
+
+			for (int i = 0; i < 5; ++i)
+			{
+				const int qx = x + (i - 2) * step;
+				const simd::float4 k(kernel[i] * kernel[j]);
+
+				simd::float4 color_q[3];
+				for (int c = 0; c < 3; ++c)
+				{
+					color_q[c] = load(source.row(c, qy), qx, width);
+				}
+
+				simd::float4 weight;
+
+				if (i == 2 && j == 2)
+				{
+					weight = k;
+				}
+				else
+				{
+					simd::float4 albedo_distance2(0.0f);
+					simd::float4 normal_cos(0.0f);
+					for (int c = 0; c < 3; ++c)
+					{
+						const simd::float4 d = load(features.albedo.row(c, qy), qx, width) - albedo_p[c];
+						albedo_distance2 += d * d;
+						normal_cos += load(features.normal.row(c, qy), qx, width) * normal_p[c];
+					}
+
+					const simd::float4 luminance_distance = luminance(color_q) - luminance_p;
+					const simd::float4 depth_distance = simd::abs(load(features.depth.row(0, qy), qx, width) - depth_p);
+
+					const simd::float4 exponent =
+						luminance_distance * luminance_distance * inverse_sigma2_luminance +
+						albedo_distance2 * inverse_sigma2_albedo +
+						depth_distance * inverse_sigma_depth;
+
+					simd::float4 normal_weight = simd::max(normal_cos, simd::float4(0.0f));
+					for (int e = 0; e < settings.normal_exponent_log2; ++e)
+					{
+						normal_weight *= normal_weight;
+					}
+
+					weight = k * normal_weight * simd::exp(-exponent) & valid_lanes(qx, width);
+				}
+
+				sum_weights += weight;
+				for (int c = 0; c < 3; ++c)
+				{
+					sum_color[c] += weight * color_q[c];
+				}
+			}
+		}
+
+		const simd::float4 inverse_sum_weights = simd::float4(1.0f) / sum_weights;
+
+		for (int c = 0; c < 3; ++c)
+		{
+			store(sum_color[c] * inverse_sum_weights, destination->row(c, y), x, width);
+		}
+	}
+
+	static simd::float4 luminance(const simd::float4 color[3])
+	{
+		return color[0] * simd::float4(0.2126f) + color[1] * simd::float4(0.7152f) + color[2] * simd::float4(0.0722f);
+	}
+
+	// Loads the four pixels starting at column x, columns outside of the row are clamped to the edge
+	static simd::float4 load(const float* row, int x, int width)
+	{
+		if (x >= 0 && x + simd::float4::width <= width)
+		{
+			return simd::float4::loadu(row + x);
+		}
+
+		alignas(16) float values[simd::float4::width];
+		for (int i = 0; i < simd::float4::width; ++i)
+		{
+			values[i] = row[std::min(std::max(x + i, 0), width - 1)];
+		}
+
+		return simd::float4::load(values);
+	}
+
+	static void store(simd::float4 value, float* row, int x, int width)
+	{
+		if (x + simd::float4::width <= width)
+		{
+			value.storeu(row + x);
+			return;
+		}
+
+		alignas(16) float values[simd::float4::width];
+		value.store(values);
+		for (int i = 0; x + i < width; ++i)
+		{
+			row[x + i] = values[i];
+		}
+	}
+
+	// Mask of the lanes whose column lies inside the row
+	static simd::float4 valid_lanes(int x, int width)
+	{
+		const simd::float4 columns = simd::float4(static_cast<float>(x)) + simd::float4(0.0f, 1.0f, 2.0f, 3.0f);
+		return (columns >= simd::float4(0.0f)) & (columns < simd::float4(static_cast<float>(width)));
+	}
+};
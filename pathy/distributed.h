@@ -0,0 +1,596 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <future>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#undef min
+#undef max
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+#include "pathy.h"
+#include "net.h"
+
+// Renders an image on several processes. A coordinator listens on a port and hands out jobs of tiles to
+// the workers that connect to it. A worker renders every tile of a job through all passes until the
+// tile converges and sends back the accumulated samples, which the coordinator merges before resolving
+// the image exactly like a local render. The random numbers only depend on the tile and the pass, so
+// the image does not depend on how the tiles were distributed. Workers can run on the same machine or
+// anywhere else that can reach the coordinator, they are assumed to share its byte order.
+namespace distributed
+{
+	constexpr uint32_t protocol_version = 2;
+
+	// How long the coordinator goes without any connected worker before it renders jobs itself
+	constexpr double local_fallback_seconds = 10.0;
+
+	// How often a worker tells the coordinator that it is still rendering its job
+	constexpr double heartbeat_seconds = 2.0;
+
+	// A worker that owes its hello or the result of a job and sends nothing for this long is dropped.
+	// Sends and receives on its socket that stall for this long fail as well.
+	constexpr double worker_timeout_seconds = 30.0;
+
+	enum class message_type : uint32_t
+	{
+		hello = 1, // worker to coordinator: protocol version, thread count
+		scene,     // coordinator to worker: image size, sampling settings and the scene
+		job,       // coordinator to worker: first tile and tile count
+		result,    // worker to coordinator: per tile its index, ray count, pixels and features
+		done,      // coordinator to worker: no more jobs
+		heartbeat, // worker to coordinator: still rendering the job, no payload
+	};
+
+	using message = net::message<message_type>;
+
+	// A range of tiles in dispatch order, so that every job covers a compact part of the image
+	struct job
+	{
+		int first_tile;
+		int tile_count;
+	};
+
+	inline message make_scene_message(const scene& scene, const render_settings& settings, int width, int height)
+	{
+		message m(message_type::scene);
+		m.write(width);
+		m.write(height);
+		m.write(settings.min_samples_per_pixel);
+		m.write(settings.max_samples_per_pixel);
+		m.write(settings.samples_per_pass);
+		m.write(settings.max_relative_error);
+		m.write_vector(scene.point_lights);
+		m.write_vector(scene.sphere_area_lights);
+		m.write_vector(scene.spheres);
+		m.write_vector(scene.sphere_materials);
+		m.write(scene.constant_light);
+		return m;
+	}
+
+	inline bool read_scene_message(message* m, scene* out_scene, render_settings* out_settings, int* out_width, int* out_height)
+	{
+		return m->type == message_type::scene &&
+			m->read(out_width) &&
+			m->read(out_height) &&
+			m->read(&out_settings->min_samples_per_pixel) &&
+			m->read(&out_settings->max_samples_per_pixel) &&
+			m->read(&out_settings->samples_per_pass) &&
+			m->read(&out_settings->max_relative_error) &&
+			m->read_vector(&out_scene->point_lights) &&
+			m->read_vector(&out_scene->sphere_area_lights) &&
+			m->read_vector(&out_scene->spheres) &&
+			m->read_vector(&out_scene->sphere_materials) &&
+			m->read(&out_scene->constant_light);
+	}
+
+	// Renders every tile of the job through all passes or until it converges, adding the rays traced for
+	// each tile to out_ray_counts
+	inline void render_job(const scene& scene, const camera& camera, const render_settings& settings, const std::vector<int>& tile_order, const job& job,
+		accumulation_buffer* accumulation, feature_buffer* features, unsigned* out_ray_counts, tf::Taskflow& tf)
+	{
+		const int max_passes = max_render_passes(settings);
+
+		for (int i = 0; i < job.tile_count; ++i)
+		{
+			const int tile_index = tile_order[job.first_tile + i];
+
+			tf.silent_emplace([&scene, &camera, &settings, accumulation, features, out_ray_counts, tile_index, i, max_passes]()
+			{
+				for (int pass = 0; pass < max_passes; ++pass)
+				{
+					if (render_tile_pass(scene, camera, settings, tile_index, pass, accumulation, features, &out_ray_counts[i]))
+					{
+						break;
+					}
+				}
+			});
+		}
+
+		tf.wait_for_all();
+	}
+
+	// Connects to the coordinator and renders the jobs it hands out until it has no more.
+	// Returns false if the connection failed or was lost.
+	inline bool run_worker(const char* host, uint16_t port)
+	{
+		net::socket socket = net::socket::connect(host, port);
+		if (!socket.valid())
+		{
+			std::cerr << "failed to connect to " << host << ":" << port << std::endl;
+
+			return false;
+		}
+
+		const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+		message hello(message_type::hello);
+		hello.write(protocol_version);
+		hello.write(num_threads);
+
+		message m;
+		if (!hello.send(socket) || !m.receive(socket))
+		{
+			return false;
+		}
+
+		scene scene;
+		render_settings settings;
+		int width, height;
+		if (!read_scene_message(&m, &scene, &settings, &width, &height) || width <= 0 || height <= 0)
+		{
+			return false;
+		}
+
+		scene.build_acceleration_structure();
+
+		camera camera(static_cast<float>(width) / height);
+
+		tf::Taskflow tf(num_threads);
+
+		const int tile_count = tile_count_x(width) * tile_count_y(height);
+		const std::vector<int> tile_order = tile_dispatch_order(width, height);
+
+		accumulation_buffer accumulation(width, height);
+		feature_buffer features(width, height);
+
+		while (m.receive(socket) && m.type == message_type::job)
+		{
+			job job;
+			if (!m.read(&job) || job.first_tile < 0 || job.tile_count < 0 || job.first_tile + job.tile_count > tile_count)
+			{
+				return false;
+			}
+
+			// The job is rendered on another thread while this one sends the heartbeats
+			std::vector<unsigned> statistics(job.tile_count, 0);
+			std::future<void> rendering = std::async(std::launch::async, [&]()
+			{
+				render_job(scene, camera, settings, tile_order, job, &accumulation, &features, statistics.data(), tf);
+			});
+
+			bool connected = true;
+			while (rendering.wait_for(std::chrono::duration<double>(heartbeat_seconds)) != std::future_status::ready)
+			{
+				connected = connected && message(message_type::heartbeat).send(socket);
+			}
+
+			if (!connected)
+			{
+				return false;
+			}
+
+			message result(message_type::result);
+			result.write(job);
+
+			for (int i = 0; i < job.tile_count; ++i)
+			{
+				const tile_bounds bounds = get_tile_bounds(tile_order[job.first_tile + i], width, height);
+
+				result.write(statistics[i]);
+
+				for (int y = bounds.y_begin; y < bounds.y_end; ++y)
+				{
+					for (int x = bounds.x_begin; x < bounds.x_end; ++x)
+					{
+						const int p = width * y + x;
+						result.write(accumulation.data[p]);
+						for (int c = 0; c < 3; ++c)
+						{
+							result.write(features.albedo.planes[c][p]);
+							result.write(features.normal.planes[c][p]);
+						}
+						result.write(features.depth.planes[0][p]);
+					}
+				}
+			}
+
+			if (!result.send(socket))
+			{
+				return false;
+			}
+		}
+
+		return m.type == message_type::done;
+	}
+
+#ifndef _WIN32
+	// Worker processes started by launch_local_workers that have not been reaped yet
+	std::vector<pid_t> g_local_workers;
+
+	// Reaps the local workers that have exited, waiting up to wait_seconds for the others
+	inline void reap_local_workers(double wait_seconds = 0.0)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(wait_seconds);
+
+		for (;;)
+		{
+			g_local_workers.erase(std::remove_if(g_local_workers.begin(), g_local_workers.end(), [](pid_t pid)
+			{
+				return waitpid(pid, nullptr, WNOHANG) != 0;
+			}), g_local_workers.end());
+
+			if (g_local_workers.empty() || std::chrono::steady_clock::now() >= deadline)
+			{
+				return;
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+#endif
+
+	// Starts count worker processes on this machine that connect to a coordinator on the given port.
+	// The executable must accept -worker host:port.
+	inline bool launch_local_workers(const char* executable, uint16_t port, int count)
+	{
+		const std::string address = "127.0.0.1:" + std::to_string(port);
+
+		for (int i = 0; i < count; ++i)
+		{
+#ifdef _WIN32
+			std::string command_line = "\"" + std::string(executable) + "\" -worker " + address;
+
+			STARTUPINFOA startup_info = {};
+			startup_info.cb = sizeof(startup_info);
+			PROCESS_INFORMATION process_info = {};
+
+			if (!CreateProcessA(executable, &command_line[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup_info, &process_info))
+			{
+				return false;
+			}
+
+			CloseHandle(process_info.hThread);
+			CloseHandle(process_info.hProcess);
+#else
+			std::string worker_flag = "-worker";
+			std::string address_argument = address;
+			std::string executable_argument = executable;
+			char* argv[] = { &executable_argument[0], &worker_flag[0], &address_argument[0], nullptr };
+
+			pid_t pid;
+			if (posix_spawn(&pid, executable, nullptr, nullptr, argv, environ) != 0)
+			{
+				return false;
+			}
+
+			g_local_workers.push_back(pid);
+#endif
+		}
+
+		return true;
+	}
+
+	// Renders the image on the workers that connect to the port, blocking until every tile has come
+	// back. Workers may connect at any time, the job of a worker that disconnects or stops sending
+	// heartbeats for worker_timeout_seconds goes to the next idle one. Each job holds a few tiles per
+	// worker thread so that fast workers take on more of the image. Connections only count as workers
+	// once they sent a valid hello. Once no worker has been connected for local_fallback_seconds, e.g.
+	// because none could be started or all of them went away, the coordinator renders the jobs itself
+	// until a worker connects again. Checkpoints are not written in this mode.
+	inline bool render(net::socket& listener, const scene& scene, image* image, unsigned* inout_ray_count, const render_settings& settings = {}, const tile_callback& on_tile_finished = nullptr)
+	{
+		if (!listener.valid())
+		{
+			return false;
+		}
+
+		const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+		tf::Taskflow tf(num_threads);
+
+		const int width = image->width;
+		const int height = image->height;
+		const int tile_count = tile_count_x(width) * tile_count_y(height);
+		const std::vector<int> tile_order = tile_dispatch_order(width, height);
+
+		accumulation_buffer accumulation(width, height);
+		feature_buffer features(width, height);
+
+		const bool stream_tiles = on_tile_finished && settings.denoise.iterations == 0;
+
+		const message scene_message = make_scene_message(scene, settings, width, height);
+
+		struct worker
+		{
+			net::socket socket;
+			unsigned num_threads = 0; // zero until the hello arrived
+			bool has_job = false;
+			job current_job = {};
+
+			// When the worker is dropped unless it sends a message, while it owes one
+			std::chrono::steady_clock::time_point deadline;
+		};
+
+		std::vector<std::unique_ptr<worker>> workers;
+
+		// Jobs of disconnected workers are handed out again before any new tiles
+		std::deque<job> returned_jobs;
+		int next_tile = 0;
+		int tiles_received = 0;
+
+		auto assign_job = [&](worker* w)
+		{
+			job job;
+			if (!returned_jobs.empty())
+			{
+				job = returned_jobs.front();
+				returned_jobs.pop_front();
+			}
+			else if (next_tile < tile_count)
+			{
+				job = { next_tile, std::min(4 * static_cast<int>(w->num_threads), tile_count - next_tile) };
+				next_tile += job.tile_count;
+			}
+			else
+			{
+				return true;
+			}
+
+			w->has_job = true;
+			w->current_job = job;
+
+			message m(message_type::job);
+			m.write(job);
+			return m.send(w->socket);
+		};
+
+		auto extend_deadline = [](worker* w)
+		{
+			w->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int64_t>(worker_timeout_seconds * 1000));
+		};
+
+		auto drop_worker = [&](worker* w)
+		{
+			if (w->has_job)
+			{
+				returned_jobs.push_back(w->current_job);
+				w->has_job = false;
+			}
+			w->socket.close();
+		};
+
+		auto merge_result = [&](message* m, const job& job)
+		{
+			struct job result_job;
+			if (!m->read(&result_job) || result_job.first_tile != job.first_tile || result_job.tile_count != job.tile_count)
+			{
+				return false;
+			}
+
+			for (int i = 0; i < job.tile_count; ++i)
+			{
+				const int tile_index = tile_order[job.first_tile + i];
+				const tile_bounds bounds = get_tile_bounds(tile_index, width, height);
+
+				unsigned ray_count;
+				if (!m->read(&ray_count))
+				{
+					return false;
+				}
+				*inout_ray_count += ray_count;
+
+				for (int y = bounds.y_begin; y < bounds.y_end; ++y)
+				{
+					for (int x = bounds.x_begin; x < bounds.x_end; ++x)
+					{
+						const int p = width * y + x;
+						bool valid = m->read(&accumulation.data[p]);
+						for (int c = 0; c < 3; ++c)
+						{
+							valid &= m->read(&features.albedo.planes[c][p]);
+							valid &= m->read(&features.normal.planes[c][p]);
+						}
+						valid &= m->read(&features.depth.planes[0][p]);
+
+						if (!valid)
+						{
+							return false;
+						}
+					}
+				}
+
+				if (stream_tiles)
+				{
+					hand_over_tile(accumulation, tile_index, on_tile_finished);
+				}
+			}
+
+			return true;
+		};
+
+		// Workers only send their hello, heartbeats and the result of their current job, larger messages are
+		// refused
+		auto max_message_size = [](const worker* w)
+		{
+			if (!w->has_job)
+			{
+				return static_cast<uint32_t>(1024);
+			}
+
+			const size_t pixel_size = sizeof(accumulation_buffer::pixel) + 7 * sizeof(float);
+			const size_t tile_size = sizeof(unsigned) + render_tile_size * render_tile_size * pixel_size;
+			return static_cast<uint32_t>(sizeof(job) + w->current_job.tile_count * tile_size);
+		};
+
+		auto has_workers = [&workers]()
+		{
+			return std::any_of(workers.begin(), workers.end(), [](const std::unique_ptr<worker>& w) { return w->num_threads > 0; });
+		};
+
+		const camera camera(static_cast<float>(width) / height);
+		auto last_worker_time = std::chrono::steady_clock::now();
+
+		while (tiles_received < tile_count)
+		{
+			const auto now = std::chrono::steady_clock::now();
+			if (has_workers())
+			{
+				last_worker_time = now;
+			}
+
+			const bool render_locally = std::chrono::duration<double>(now - last_worker_time).count() >= local_fallback_seconds;
+
+			std::vector<const net::socket*> sockets = { &listener };
+			for (const std::unique_ptr<worker>& w : workers)
+			{
+				sockets.push_back(&w->socket);
+			}
+
+			// Only look for new workers in between the jobs rendered locally
+			for (int ready : net::wait_readable(sockets, render_locally ? 0 : 1000))
+			{
+				if (ready == 0)
+				{
+					net::socket socket = listener.accept();
+					if (socket.valid())
+					{
+						socket.set_timeouts(static_cast<int>(worker_timeout_seconds * 1000));
+						workers.emplace_back(new worker());
+						workers.back()->socket = std::move(socket);
+						extend_deadline(workers.back().get());
+					}
+					continue;
+				}
+
+				worker* w = workers[ready - 1].get();
+
+				message m;
+				bool connected = m.receive(w->socket, max_message_size(w));
+				extend_deadline(w);
+
+				if (connected && m.type == message_type::heartbeat && w->has_job)
+				{
+					connected = m.payload.empty();
+				}
+				else if (connected && m.type == message_type::hello && w->num_threads == 0)
+				{
+					uint32_t version;
+					connected = m.read(&version) && version == protocol_version && m.read(&w->num_threads) && w->num_threads > 0 &&
+						scene_message.send(w->socket) && assign_job(w);
+				}
+				else if (connected && m.type == message_type::result && w->has_job)
+				{
+					connected = merge_result(&m, w->current_job);
+					if (connected)
+					{
+						tiles_received += w->current_job.tile_count;
+						w->has_job = false;
+						connected = assign_job(w);
+					}
+				}
+				else
+				{
+					connected = false;
+				}
+
+				if (!connected)
+				{
+					drop_worker(w);
+				}
+			}
+
+			// Hung workers and connections that never said hello are dropped, their jobs handed out again
+			for (const std::unique_ptr<worker>& w : workers)
+			{
+				if (w->socket.valid() && (w->num_threads == 0 || w->has_job) && std::chrono::steady_clock::now() >= w->deadline)
+				{
+					drop_worker(w.get());
+				}
+			}
+
+			// Idle workers pick up the jobs of workers that went away
+			for (const std::unique_ptr<worker>& w : workers)
+			{
+				if (!returned_jobs.empty() && w->socket.valid() && w->num_threads > 0 && !w->has_job && !assign_job(w.get()))
+				{
+					drop_worker(w.get());
+				}
+			}
+
+			workers.erase(std::remove_if(workers.begin(), workers.end(), [](const std::unique_ptr<worker>& w) { return !w->socket.valid(); }), workers.end());
+
+			if (render_locally && !has_workers())
+			{
+				job job;
+				if (!returned_jobs.empty())
+				{
+					job = returned_jobs.front();
+					returned_jobs.pop_front();
+				}
+				else
+				{
+					job = { next_tile, std::min(4 * static_cast<int>(num_threads), tile_count - next_tile) };
+					next_tile += job.tile_count;
+				}
+
+				std::vector<unsigned> statistics(job.tile_count, 0);
+				render_job(scene, camera, settings, tile_order, job, &accumulation, &features, statistics.data(), tf);
+
+				for (int i = 0; i < job.tile_count; ++i)
+				{
+					*inout_ray_count += statistics[i];
+
+					if (stream_tiles)
+					{
+						hand_over_tile(accumulation, tile_order[job.first_tile + i], on_tile_finished);
+					}
+				}
+
+				tiles_received += job.tile_count;
+			}
+
+#ifndef _WIN32
+			reap_local_workers();
+#endif
+		}
+
+		for (const std::unique_ptr<worker>& w : workers)
+		{
+			message(message_type::done).send(w->socket);
+		}
+
+#ifndef _WIN32
+		// The local workers exit once they are told that there are no more jobs
+		reap_local_workers(1.0);
+#endif
+
+		resolve_image(accumulation, &features, settings, image, tf, on_tile_finished);
+
+		return true;
+	}
+}
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <algorithm>
+#include <cassert>
+
+// A planar float image, one plane per channel so that neighbouring pixels of a channel can be loaded
+// four at a time. Rows are stored bottom to top like the renderer's 8 bit image.
+template <int C>
+struct planar_image
+{
+	planar_image(int width, int height) :
+		width(width),
+		height(height)
+	{
+		for (std::vector<float>& plane : planes)
+		{
+			plane.assign(width * height, 0.0f);
+		}
+	}
+
+	float* row(int channel, int y) { return planes[channel].data() + width * y; }
+
+	const float* row(int channel, int y) const { return planes[channel].data() + width * y; }
+
+	const int width;
+	const int height;
+
+	std::vector<float> planes[C];
+};
+
+// Linear RGB radiance
+using hdr_image = planar_image<3>;
+
+// A finished rectangle of linear RGB pixels handed to the image writers. Row y of the tile starts at
+// channels[c] + y * stride, rows run bottom to top.
+struct image_tile
+{
+	int x, y;
+	int width, height;
+	const float* channels[3];
+	int stride;
+
+	float at(int channel, int tile_x, int tile_y) const { return channels[channel][stride * tile_y + tile_x]; }
+};
+
+inline image_tile make_tile(const hdr_image& image, int x, int y, int width, int height)
+{
+	return { x, y, width, height, { image.row(0, y) + x, image.row(1, y) + x, image.row(2, y) + x }, image.width };
+}
+
+// IEEE half precision from single precision with round to nearest even, see
+// https://gist.github.com/rygorous/2156668
+inline uint16_t float_to_half(float value)
+{
+	uint32_t f;
+	std::memcpy(&f, &value, sizeof(f));
+
+	const uint32_t sign = f & 0x80000000u;
+	f ^= sign;
+
+	uint16_t half;
+
+	if (f >= (127 + 16) << 23)
+	{
+		// Too large for a half, becomes infinity. NaN stays NaN.
+		half = (f > 255u << 23) ? 0x7e00 : 0x7c00;
+	}
+	else if (f < (127 - 14) << 23)
+	{
+		// Denormal half, let the float addition do the rounding
+		const uint32_t denormal_magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+		float denormal_magic;
+		std::memcpy(&denormal_magic, &denormal_magic_bits, sizeof(denormal_magic));
+
+		float shifted;
+		std::memcpy(&shifted, &f, sizeof(shifted));
+		shifted += denormal_magic;
+
+		uint32_t bits;
+		std::memcpy(&bits, &shifted, sizeof(bits));
+		half = static_cast<uint16_t>(bits - denormal_magic_bits);
+	}
+	else
+	{
+		const uint32_t mantissa_odd = (f >> 13) & 1;
+		f += (uint32_t(15 - 127) << 23) + 0xfff;
+		f += mantissa_odd;
+		half = static_cast<uint16_t>(f >> 13);
+	}
+
+	return half | static_cast<uint16_t>(sign >> 16);
+}
+
+// Portable float map, see http://www.pauldebevec.com/Research/HDR/PFM/. The format has a fixed size
+// and stores rows bottom to top, so tiles are written straight to their place in the file in any order
+// without keeping the frame in memory. write_tile may be called from several threads.
+class pfm_writer
+{
+public:
+	bool open(const char* filepath, int width, int height)
+	{
+		_file.open(filepath, std::ios::binary | std::ios::trunc);
+		if (!_file)
+		{
+			return false;
+		}
+
+		_width = width;
+		_height = height;
+
+		// A negative scale marks little endian data
+		const std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+		_file.write(header.data(), header.size());
+		_data_offset = static_cast<std::streamoff>(header.size());
+
+		return static_cast<bool>(_file);
+	}
+
+	void write_tile(const image_tile& tile)
+	{
+		assert(tile.x + tile.width <= _width && tile.y + tile.height <= _height);
+
+		std::vector<float> row(3 * tile.width);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		for (int y = 0; y < tile.height; ++y)
+		{
+			for (int x = 0; x < tile.width; ++x)
+			{
+				for (int c = 0; c < 3; ++c)
+				{
+					row[3 * x + c] = tile.at(c, x, y);
+				}
+			}
+
+			_file.seekp(_data_offset + (static_cast<std::streamoff>(tile.y + y) * _width + tile.x) * 3 * sizeof(float));
+			_file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+		}
+	}
+
+	bool close()
+	{
+		_file.close();
+		return !_file.fail();
+	}
+
+private:
+	std::ofstream _file;
+	std::mutex _mutex;
+	std::streamoff _data_offset = 0;
+	int _width = 0;
+	int _height = 0;
+};
+
+// Tiled OpenEXR file with B, G and R channels, see "The OpenEXR File Layout". Tiles are compressed and
+// appended as they are handed in, in any order, so only the table of tile offsets is kept until the
+// file is closed. The writer's tiles must line up with the tiles of the renderer. write_tile may be
+// called from several threads.
+class exr_writer
+{
+public:
+	enum class pixel_type : int32_t
+	{
+		half = 1,
+		single = 2,
+	};
+
+	enum class compression : uint8_t
+	{
+		none = 0,
+		rle = 1,
+	};
+
+	bool open(const char* filepath, int width, int height, int tile_size, pixel_type type = pixel_type::half, compression codec = compression::rle)
+	{
+		_file.open(filepath, std::ios::binary | std::ios::trunc);
+		if (!_file)
+		{
+			return false;
+		}
+
+		_width = width;
+		_height = height;
+		_tile_size = tile_size;
+		_tiles_x = (width + tile_size - 1) / tile_size;
+		_tiles_y = (height + tile_size - 1) / tile_size;
+		_pixel_type = type;
+		_compression = codec;
+
+		// EXR rows run top to bottom and tiles are aligned to the top of the data window, while the
+		// renderer's tiles are aligned to the bottom row. Extending the data window above the display
+		// window by the partial tile keeps both grids aligned, the extra rows are written as black.
+		const int32_t data_window[4] = { 0, height - _tiles_y * tile_size, width - 1, height - 1 };
+		const int32_t display_window[4] = { 0, 0, width - 1, height - 1 };
+
+		std::vector<char> header;
+
+		const uint32_t magic = 20000630;
+		const uint32_t version = 2 | 0x200; // single part, tiled
+		append(&header, &magic, sizeof(magic));
+		append(&header, &version, sizeof(version));
+
+		std::vector<char> channels;
+		for (const char* name : { "B", "G", "R" })
+		{
+			const int32_t sampling[2] = { 1, 1 };
+			const uint8_t linear_and_reserved[4] = { 0, 0, 0, 0 };
+			append(&channels, name, std::strlen(name) + 1);
+			append(&channels, &type, sizeof(type));
+			append(&channels, linear_and_reserved, sizeof(linear_and_reserved));
+			append(&channels, sampling, sizeof(sampling));
+		}
+		channels.push_back(0);
+
+		const uint8_t line_order = 2; // random y, tiles are stored in the order they finish
+		const float pixel_aspect_ratio = 1.0f;
+		const float screen_window_center[2] = { 0.0f, 0.0f };
+		const float screen_window_width = 1.0f;
+
+		// Tile sizes and a single resolution level
+		char tiles[9];
+		const uint32_t tile_dimensions[2] = { static_cast<uint32_t>(tile_size), static_cast<uint32_t>(tile_size) };
+		std::memcpy(tiles, tile_dimensions, sizeof(tile_dimensions));
+		tiles[8] = 0;
+
+		append_attribute(&header, "channels", "chlist", channels.data(), channels.size());
+		append_attribute(&header, "compression", "compression", &codec, sizeof(codec));
+		append_attribute(&header, "dataWindow", "box2i", data_window, sizeof(data_window));
+		append_attribute(&header, "displayWindow", "box2i", display_window, sizeof(display_window));
+		append_attribute(&header, "lineOrder", "lineOrder", &line_order, sizeof(line_order));
+		append_attribute(&header, "pixelAspectRatio", "float", &pixel_aspect_ratio, sizeof(pixel_aspect_ratio));
+		append_attribute(&header, "screenWindowCenter", "v2f", screen_window_center, sizeof(screen_window_center));
+		append_attribute(&header, "screenWindowWidth", "float", &screen_window_width, sizeof(screen_window_width));
+		append_attribute(&header, "tiles", "tiledesc", tiles, sizeof(tiles));
+		header.push_back(0);
+
+		_file.write(header.data(), header.size());
+
+		// The offset table is filled in when the file is closed
+		_offset_table_position = static_cast<std::streamoff>(header.size());
+		_offsets.assign(_tiles_x * _tiles_y, 0);
+		_file.write(reinterpret_cast<const char*>(_offsets.data()), _offsets.size() * sizeof(uint64_t));
+		_end = _offset_table_position + static_cast<std::streamoff>(_offsets.size() * sizeof(uint64_t));
+
+		return static_cast<bool>(_file);
+	}
+
+	void write_tile(const image_tile& tile)
+	{
+		assert(tile.x % _tile_size == 0 && tile.y % _tile_size == 0);
+
+		const int tile_x = tile.x / _tile_size;
+		const int tile_y = _tiles_y - 1 - tile.y / _tile_size;
+		const int width = std::min(_tile_size, _width - tile.x);
+		const int height = _tile_size;
+
+		// Scanlines top to bottom, each holding the channels in alphabetical order
+		const size_t value_size = (_pixel_type == pixel_type::half) ? sizeof(uint16_t) : sizeof(float);
+		std::vector<char> pixels(3 * width * height * value_size);
+		char* write = pixels.data();
+
+		for (int row = 0; row < height; ++row)
+		{
+			const int y = _tile_size - 1 - row;
+
+			for (int c = 2; c >= 0; --c)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					const float value = (y < tile.height) ? tile.at(c, x, y) : 0.0f;
+
+					if (_pixel_type == pixel_type::half)
+					{
+						const uint16_t half = float_to_half(value);
+						std::memcpy(write, &half, sizeof(half));
+					}
+					else
+					{
+						std::memcpy(write, &value, sizeof(value));
+					}
+
+					write += value_size;
+				}
+			}
+		}
+
+		std::vector<char> compressed;
+		if (_compression == compression::rle)
+		{
+			compress_rle(pixels, &compressed);
+		}
+
+		// Chunks that do not get smaller are stored uncompressed, readers tell them apart by their size
+		const std::vector<char>& data = (!compressed.empty() && compressed.size() < pixels.size()) ? compressed : pixels;
+
+		const int32_t chunk_header[5] = { tile_x, tile_y, 0, 0, static_cast<int32_t>(data.size()) };
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_offsets[_tiles_x * tile_y + tile_x] = static_cast<uint64_t>(_end);
+
+		_file.seekp(_end);
+		_file.write(reinterpret_cast<const char*>(chunk_header), sizeof(chunk_header));
+		_file.write(data.data(), data.size());
+		_end += static_cast<std::streamoff>(sizeof(chunk_header) + data.size());
+	}
+
+	bool close()
+	{
+		assert(std::find(_offsets.begin(), _offsets.end(), 0) == _offsets.end() && "every tile must be written");
+
+		_file.seekp(_offset_table_position);
+		_file.write(reinterpret_cast<const char*>(_offsets.data()), _offsets.size() * sizeof(uint64_t));
+		_file.close();
+
+		return !_file.fail();
+	}
+
+private:
+	static void append(std::vector<char>* out, const void* data, size_t size)
+	{
+		out->insert(out->end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+	}
+
+	static void append_attribute(std::vector<char>* out, const char* name, const char* type, const void* value, size_t size)
+	{
+		const int32_t value_size = static_cast<int32_t>(size);
+		append(out, name, std::strlen(name) + 1);
+		append(out, type, std::strlen(type) + 1);
+		append(out, &value_size, sizeof(value_size));
+		append(out, value, size);
+	}
+
+	// OpenEXR's RLE compression: the bytes are split into even and odd halves, delta encoded and then
+	// run length encoded
+	static void compress_rle(const std::vector<char>& in, std::vector<char>* out)
+	{
+		const size_t size = in.size();
+
+		std::vector<uint8_t> reordered(size);
+		const size_t half = (size + 1) / 2;
+		for (size_t i = 0; i < size; ++i)
+		{
+			reordered[(i & 1) ? half + i / 2 : i / 2] = static_cast<uint8_t>(in[i]);
+		}
+
+		for (size_t i = size - 1; i > 0; --i)
+		{
+			reordered[i] = static_cast<uint8_t>(reordered[i] - reordered[i - 1] + 128);
+		}
+
+		const int min_run_length = 3;
+		const int max_run_length = 127;
+
+		out->clear();
+		out->reserve(size + size / 128 + 1);
+
+		size_t run_start = 0;
+		size_t run_end = 1;
+
+		while (run_start < size)
+		{
+			while (run_end < size && reordered[run_start] == reordered[run_end] && run_end - run_start - 1 < max_run_length)
+			{
+				++run_end;
+			}
+
+			if (run_end - run_start >= min_run_length)
+			{
+				// A run of repeated bytes
+				out->push_back(static_cast<char>(run_end - run_start - 1));
+				out->push_back(static_cast<char>(reordered[run_start]));
+				run_start = run_end;
+			}
+			else
+			{
+				// Literal bytes up to the next run of three
+				while (run_end < size &&
+					((run_end + 1 >= size || reordered[run_end] != reordered[run_end + 1]) ||
+					(run_end + 2 >= size || reordered[run_end + 1] != reordered[run_end + 2])) &&
+					run_end - run_start < max_run_length)
+				{
+					++run_end;
+				}
+
+				out->push_back(static_cast<char>(-static_cast<int>(run_end - run_start)));
+				while (run_start < run_end)
+				{
+					out->push_back(static_cast<char>(reordered[run_start++]));
+				}
+			}
+
+			++run_end;
+		}
+	}
+
+	std::ofstream _file;
+	std::mutex _mutex;
+	std::vector<uint64_t> _offsets;
+	std::streamoff _offset_table_position = 0;
+	std::streamoff _end = 0;
+	int _width = 0;
+	int _height = 0;
+	int _tile_size = 0;
+	int _tiles_x = 0;
+	int _tiles_y = 0;
+	pixel_type _pixel_type = pixel_type::half;
+	compression _compression = compression::rle;
+};
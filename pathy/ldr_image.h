@@ -0,0 +1,325 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include "deflate.h"
+#include "taskflow.hpp"
+
+// Lossless writers for 8 bit images given as packed BGR rows stored bottom to top, the layout of the
+// renderer's image.
+
+namespace detail
+{
+	inline void append_big_endian(std::vector<uint8_t>* out, uint32_t value)
+	{
+		out->push_back(static_cast<uint8_t>(value >> 24));
+		out->push_back(static_cast<uint8_t>(value >> 16));
+		out->push_back(static_cast<uint8_t>(value >> 8));
+		out->push_back(static_cast<uint8_t>(value));
+	}
+
+	inline void write_png_chunk(std::ofstream& file, const char type[4], const uint8_t* data, size_t size)
+	{
+		std::vector<uint8_t> header;
+		append_big_endian(&header, static_cast<uint32_t>(size));
+		header.insert(header.end(), type, type + 4);
+
+		std::vector<uint8_t> crc;
+		append_big_endian(&crc, deflate::crc32(data, size, deflate::crc32(header.data() + 4, 4)));
+
+		file.write(reinterpret_cast<const char*>(header.data()), header.size());
+		file.write(reinterpret_cast<const char*>(data), size);
+		file.write(reinterpret_cast<const char*>(crc.data()), crc.size());
+	}
+
+	// Filters one PNG row given the current and previous rows as RGB, the previous row is all zero for
+	// the first row. Tries every filter type and keeps the one with the smallest sum of absolute values,
+	// the heuristic suggested by the PNG specification. Each filter runs as its own simple loop over
+	// the row so that the compiler can vectorize it.
+	inline void filter_png_row(const uint8_t* row, const uint8_t* previous_row, int width, std::vector<uint8_t>* scratch, uint8_t* out)
+	{
+		const int size = 3 * width;
+
+		scratch->resize(5 * size);
+		uint8_t* filtered[5];
+		for (int f = 0; f < 5; ++f)
+		{
+			filtered[f] = scratch->data() + f * size;
+		}
+
+		const int bpp = 3;
+
+		uint8_t* none = filtered[0];
+		uint8_t* sub = filtered[1];
+		uint8_t* up = filtered[2];
+		uint8_t* average = filtered[3];
+		uint8_t* paeth = filtered[4];
+
+		for (int i = 0; i < bpp; ++i)
+		{
+			none[i] = row[i];
+			sub[i] = row[i];
+			up[i] = static_cast<uint8_t>(row[i] - previous_row[i]);
+			average[i] = static_cast<uint8_t>(row[i] - (previous_row[i] >> 1));
+			paeth[i] = static_cast<uint8_t>(row[i] - previous_row[i]);
+		}
+
+		for (int i = bpp; i < size; ++i)
+		{
+			none[i] = row[i];
+		}
+		for (int i = bpp; i < size; ++i)
+		{
+			sub[i] = static_cast<uint8_t>(row[i] - row[i - bpp]);
+		}
+		for (int i = bpp; i < size; ++i)
+		{
+			up[i] = static_cast<uint8_t>(row[i] - previous_row[i]);
+		}
+		for (int i = bpp; i < size; ++i)
+		{
+			average[i] = static_cast<uint8_t>(row[i] - ((row[i - bpp] + previous_row[i]) >> 1));
+		}
+		for (int i = bpp; i < size; ++i)
+		{
+			// Branch free predictor
+			const int a = row[i - bpp];
+			const int b = previous_row[i];
+			const int c = previous_row[i - bpp];
+			const int pa = std::abs(b - c);
+			const int pb = std::abs(a - c);
+			const int pc = std::abs(a + b - 2 * c);
+			const int predictor = (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c);
+			paeth[i] = static_cast<uint8_t>(row[i] - predictor);
+		}
+
+		uint32_t costs[5];
+		for (int f = 0; f < 5; ++f)
+		{
+			uint32_t cost = 0;
+			const uint8_t* values = filtered[f];
+			for (int i = 0; i < size; ++i)
+			{
+				cost += std::abs(static_cast<int8_t>(values[i]));
+			}
+			costs[f] = cost;
+		}
+
+		const int best = static_cast<int>(std::min_element(costs, costs + 5) - costs);
+
+		out[0] = static_cast<uint8_t>(best);
+		std::copy(filtered[best], filtered[best] + size, out + 1);
+	}
+
+	// The PNG row at top to bottom index y as RGB
+	inline void png_row(const uint8_t* bgr, int width, int height, int y, uint8_t* out_rgb)
+	{
+		const uint8_t* source = bgr + 3 * width * (height - 1 - y);
+		for (int x = 0; x < width; ++x)
+		{
+			out_rgb[3 * x + 0] = source[3 * x + 2];
+			out_rgb[3 * x + 1] = source[3 * x + 1];
+			out_rgb[3 * x + 2] = source[3 * x + 0];
+		}
+	}
+}
+
+// PNG with rows filtered in parallel and the deflate stream compressed in independent chunks on the
+// task pool. Each compressed chunk is stored as its own IDAT chunk.
+inline bool write_png(const char* filepath, const uint8_t* bgr, int width, int height, tf::Taskflow& tf)
+{
+	const size_t row_size = 1 + 3 * static_cast<size_t>(width);
+	std::vector<uint8_t> filtered(row_size * height);
+
+	const int band_height = 32;
+	for (int y_begin = 0; y_begin < height; y_begin += band_height)
+	{
+		tf.silent_emplace([&filtered, bgr, width, height, row_size, y_begin, band_height]()
+		{
+			std::vector<uint8_t> row(3 * width);
+			std::vector<uint8_t> previous_row(3 * width, 0);
+			std::vector<uint8_t> scratch;
+
+			if (y_begin > 0)
+			{
+				detail::png_row(bgr, width, height, y_begin - 1, previous_row.data());
+			}
+
+			const int y_end = std::min(y_begin + band_height, height);
+			for (int y = y_begin; y < y_end; ++y)
+			{
+				detail::png_row(bgr, width, height, y, row.data());
+				detail::filter_png_row(row.data(), previous_row.data(), width, &scratch, &filtered[row_size * y]);
+				row.swap(previous_row);
+			}
+		});
+	}
+
+	tf.wait_for_all();
+
+	const size_t chunk_size = 256 * 1024;
+	const size_t chunk_count = std::max<size_t>(1, (filtered.size() + chunk_size - 1) / chunk_size);
+
+	std::vector<std::vector<uint8_t>> compressed(chunk_count);
+	std::vector<uint32_t> checksums(chunk_count);
+
+	for (size_t chunk = 0; chunk < chunk_count; ++chunk)
+	{
+		tf.silent_emplace([&filtered, &compressed, &checksums, chunk, chunk_count, chunk_size]()
+		{
+			const size_t begin = chunk * chunk_size;
+			const size_t end = std::min(begin + chunk_size, filtered.size());
+
+			deflate::compressor::compress_chunk(filtered.data(), begin, end, chunk == chunk_count - 1, &compressed[chunk]);
+			checksums[chunk] = deflate::adler32(filtered.data() + begin, end - begin);
+		});
+	}
+
+	tf.wait_for_all();
+
+	uint32_t adler = checksums[0];
+	for (size_t chunk = 1; chunk < chunk_count; ++chunk)
+	{
+		const size_t size = std::min(chunk_size, filtered.size() - chunk * chunk_size);
+		adler = deflate::adler32_combine(adler, checksums[chunk], size);
+	}
+
+	std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		return false;
+	}
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+	std::vector<uint8_t> header;
+	detail::append_big_endian(&header, width);
+	detail::append_big_endian(&header, height);
+	header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bits per channel RGB, deflate, adaptive filtering, not interlaced
+	detail::write_png_chunk(file, "IHDR", header.data(), header.size());
+
+	// The zlib stream header for a 32KB window without a preset dictionary
+	static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+	detail::write_png_chunk(file, "IDAT", zlib_header, sizeof(zlib_header));
+
+	for (const std::vector<uint8_t>& chunk : compressed)
+	{
+		detail::write_png_chunk(file, "IDAT", chunk.data(), chunk.size());
+	}
+
+	std::vector<uint8_t> trailer;
+	detail::append_big_endian(&trailer, adler);
+	detail::write_png_chunk(file, "IDAT", trailer.data(), trailer.size());
+
+	detail::write_png_chunk(file, "IEND", nullptr, 0);
+
+	return !file.fail();
+}
+
+// The Quite OK Image format, see https://qoiformat.org/qoi-specification.pdf. The format is
+// sequential by design but encodes at several hundred megabytes per second on one thread.
+inline bool write_qoi(const char* filepath, const uint8_t* bgr, int width, int height)
+{
+	struct rgb
+	{
+		uint8_t r, g, b;
+
+		bool operator==(const rgb& other) const { return r == other.r && g == other.g && b == other.b; }
+	};
+
+	std::vector<uint8_t> out;
+	out.reserve(14 + 4 * static_cast<size_t>(width) * height + 8);
+
+	out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+	detail::append_big_endian(&out, width);
+	detail::append_big_endian(&out, height);
+	out.push_back(3); // RGB
+	out.push_back(0); // sRGB with linear alpha
+
+	// The index starts out as transparent black, which never matches an opaque pixel
+	rgb index[64] = {};
+	bool index_valid[64] = {};
+
+	rgb previous = { 0, 0, 0 };
+	int run = 0;
+
+	// The alpha of every pixel is 255, which enters the hash as 255 * 11
+	auto hash = [](const rgb& p) { return (p.r * 3 + p.g * 5 + p.b * 7 + 255 * 11) % 64; };
+
+	for (int y = height - 1; y >= 0; --y)
+	{
+		const uint8_t* row = bgr + 3 * static_cast<size_t>(width) * y;
+
+		for (int x = 0; x < width; ++x)
+		{
+			const rgb pixel = { row[3 * x + 2], row[3 * x + 1], row[3 * x + 0] };
+
+			if (pixel == previous)
+			{
+				if (++run == 62)
+				{
+					out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+					run = 0;
+				}
+				continue;
+			}
+
+			if (run > 0)
+			{
+				out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+				run = 0;
+			}
+
+			const int h = hash(pixel);
+
+			if (index_valid[h] && index[h] == pixel)
+			{
+				out.push_back(static_cast<uint8_t>(h));
+			}
+			else
+			{
+				index[h] = pixel;
+				index_valid[h] = true;
+
+				const int dr = static_cast<int8_t>(pixel.r - previous.r);
+				const int dg = static_cast<int8_t>(pixel.g - previous.g);
+				const int db = static_cast<int8_t>(pixel.b - previous.b);
+				const int dr_dg = dr - dg;
+				const int db_dg = db - dg;
+
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+				{
+					out.push_back(static_cast<uint8_t>(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2)));
+				}
+				else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+				{
+					out.push_back(static_cast<uint8_t>(0x80 | (dg + 32)));
+					out.push_back(static_cast<uint8_t>(((dr_dg + 8) << 4) | (db_dg + 8)));
+				}
+				else
+				{
+					out.insert(out.end(), { 0xfe, pixel.r, pixel.g, pixel.b });
+				}
+			}
+
+			previous = pixel;
+		}
+	}
+
+	if (run > 0)
+	{
+		out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+	}
+
+	out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+
+	std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(out.data()), out.size());
+
+	return !file.fail();
+}
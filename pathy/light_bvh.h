@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+#include "math.h"
+#include "bvh.h"
+
+// A bounding volume hierarchy over emitters used to pick a light in proportion to an estimate of its
+// contribution to a shading point, so that the cost of direct lighting does not grow with the number
+// of lights. Every node stores the total power of the emitters below it and a cone bounding their
+// emission directions. A light is sampled by walking from the root and choosing each child with a
+// probability proportional to its importance.
+class light_bvh
+{
+public:
+	struct emitter
+	{
+		aabb bounds;
+		float power;                     // scalar estimate of the emitted power
+		math::vec<3> axis = { 0, 0, 1 }; // emission cone around axis
+		float cos_theta_o = -1;          // cosine of the cone's half angle, -1 for lights emitting in every direction
+	};
+
+	struct node
+	{
+		aabb bounds;
+		float power;
+		math::vec<3> axis;
+		float cos_theta_o;
+		uint32_t first; // index of the first child for interior nodes, the emitter index for leaves
+		bool is_leaf;
+	};
+
+	void build(const std::vector<emitter>& emitters)
+	{
+		_nodes.clear();
+		_emitter_paths.assign(emitters.size(), 0);
+
+		if (emitters.empty())
+		{
+			return;
+		}
+
+		std::vector<uint32_t> indices(emitters.size());
+		for (uint32_t i = 0; i < indices.size(); ++i)
+		{
+			indices[i] = i;
+		}
+
+		_nodes.reserve(2 * emitters.size());
+		_nodes.push_back({});
+		build_recursive(0, indices.data(), static_cast<uint32_t>(indices.size()), emitters, 0, 0);
+	}
+
+	bool empty() const { return _nodes.empty(); }
+
+	// Picks an emitter for the shading point at position with the given surface normal. Returns false
+	// if no emitter can contribute, e.g. because they are all behind the surface.
+	bool sample(const math::vec<3>& position, const math::vec<3>& normal, float u, uint32_t* out_emitter, float* out_pdf) const
+	{
+		if (_nodes.empty())
+		{
+			return false;
+		}
+
+		uint32_t node_index = 0;
+		float pdf = 1.0f;
+
+		if (importance(_nodes[0], position, normal) <= 0)
+		{
+			return false;
+		}
+
+		while (!_nodes[node_index].is_leaf)
+		{
+			const node& n = _nodes[node_index];
+
+			float probability_left;
+			if (!left_probability(n, position, normal, &probability_left))
+			{
+				return false;
+			}
+
+			// Reuse the random number for the next level
+			if (u < probability_left)
+			{
+				u = std::min(u / probability_left, 0.99999994f);
+				pdf *= probability_left;
+				node_index = n.first;
+			}
+			else
+			{
+				u = std::min((u - probability_left) / (1 - probability_left), 0.99999994f);
+				pdf *= 1 - probability_left;
+				node_index = n.first + 1;
+			}
+		}
+
+		*out_emitter = _nodes[node_index].first;
+		*out_pdf = pdf;
+
+		return pdf > 0;
+	}
+
+	// The probability of sample returning the given emitter for the shading point
+	float pdf(uint32_t emitter, const math::vec<3>& position, const math::vec<3>& normal) const
+	{
+		assert(emitter < _emitter_paths.size());
+
+		if (importance(_nodes[0], position, normal) <= 0)
+		{
+			return 0.0f;
+		}
+
+		uint32_t node_index = 0;
+		uint64_t path = _emitter_paths[emitter];
+		float pdf = 1.0f;
+
+		while (!_nodes[node_index].is_leaf)
+		{
+			const node& n = _nodes[node_index];
+
+			float probability_left;
+			if (!left_probability(n, position, normal, &probability_left))
+			{
+				return 0.0f;
+			}
+
+			const bool go_right = (path & 1) != 0;
+			path >>= 1;
+
+			pdf *= go_right ? 1 - probability_left : probability_left;
+			node_index = go_right ? n.first + 1 : n.first;
+		}
+
+		assert(_nodes[node_index].first == emitter);
+
+		return pdf;
+	}
+
+private:
+	static constexpr int max_depth = 64;
+
+	// Probability of descending into the left child of an interior node, false if neither child contributes
+	bool left_probability(const node& n, const math::vec<3>& position, const math::vec<3>& normal, float* out_probability) const
+	{
+		const float importance_left = importance(_nodes[n.first], position, normal);
+		const float importance_right = importance(_nodes[n.first + 1], position, normal);
+
+		if (importance_left + importance_right <= 0)
+		{
+			return false;
+		}
+
+		*out_probability = importance_left / (importance_left + importance_right);
+
+		return true;
+	}
+
+	// Estimated contribution of everything below the node to a shading point, following
+	// "Importance Sampling of Many Lights with Adaptive Tree Splitting" (Conty Estevez and Kulla)
+	static float importance(const node& n, const math::vec<3>& position, const math::vec<3>& normal)
+	{
+		const math::vec<3> center = n.bounds.center();
+		const float radius = math::length(n.bounds.extent()) * 0.5f;
+
+		const math::vec<3> to_center = center - position;
+		const float distance2 = math::length2(to_center);
+		const float distance = std::sqrt(distance2);
+
+		// Clamp the distance so that shading points close to or inside the node do not blow up
+		const float clamped_distance2 = std::max(distance2, radius * radius * 0.25f);
+
+		if (distance <= radius)
+		{
+			return n.power / std::max(clamped_distance2, std::numeric_limits<float>::min());
+		}
+
+		const math::vec<3> direction = to_center / distance;
+
+		// Half angle of the cone from the shading point that bounds the node
+		const float sin_theta_u = radius / distance;
+		const float cos_theta_u = std::sqrt(std::max(0.0f, 1 - sin_theta_u * sin_theta_u));
+
+		// Incident angle bound at the receiver: angle to the node minus the node's angular size
+		const float cos_theta_i = math::dot(normal, direction);
+		const float cos_i = cos_subtract_clamped(cos_theta_i, cos_theta_u, sin_theta_u);
+		if (cos_i <= 0)
+		{
+			return 0.0f;
+		}
+
+		// Emission angle bound: angle between the emission axis and the shading point, minus the
+		// cone's half angle and the node's angular size
+		float cos_e = 1.0f;
+		if (n.cos_theta_o > -1)
+		{
+			const float cos_theta = math::dot(n.axis, -direction);
+			const float sin_theta_o = std::sqrt(std::max(0.0f, 1 - n.cos_theta_o * n.cos_theta_o));
+			const float cos_theta_minus_o = cos_subtract_clamped(cos_theta, n.cos_theta_o, sin_theta_o);
+			cos_e = cos_subtract_clamped(cos_theta_minus_o, cos_theta_u, sin_theta_u);
+			if (cos_e <= 0)
+			{
+				return 0.0f;
+			}
+		}
+
+		return n.power * cos_i * cos_e / clamped_distance2;
+	}
+
+	// cos(max(0, a - b)) given cos(a), cos(b) and sin(b)
+	static float cos_subtract_clamped(float cos_a, float cos_b, float sin_b)
+	{
+		if (cos_a >= cos_b)
+		{
+			return 1.0f;
+		}
+
+		const float sin_a = std::sqrt(std::max(0.0f, 1 - cos_a * cos_a));
+
+		return cos_a * cos_b + sin_a * sin_b;
+	}
+
+	void build_recursive(uint32_t node_index, uint32_t* indices, uint32_t count, const std::vector<emitter>& emitters, uint64_t path, int depth)
+	{
+		assert(depth < max_depth);
+
+		node& n = _nodes[node_index];
+		n.bounds = {};
+		n.power = 0.0f;
+
+		aabb centroid_bounds;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const emitter& e = emitters[indices[i]];
+			n.bounds.grow(e.bounds);
+			n.power += e.power;
+			centroid_bounds.grow(e.bounds.center());
+		}
+
+		merge_cones(indices, count, emitters, &n.axis, &n.cos_theta_o);
+
+		if (count == 1)
+		{
+			n.first = indices[0];
+			n.is_leaf = true;
+			_emitter_paths[indices[0]] = path;
+			return;
+		}
+
+		// Median split along the axis with the largest centroid extent
+		const math::vec<3> extent = centroid_bounds.extent();
+		const int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+		const uint32_t mid = count / 2;
+
+		std::nth_element(indices, indices + mid, indices + count, [&](uint32_t a, uint32_t b)
+		{
+			return emitters[a].bounds.center()[axis] < emitters[b].bounds.center()[axis];
+		});
+
+		const uint32_t left_index = static_cast<uint32_t>(_nodes.size());
+		_nodes.push_back({});
+		_nodes.push_back({});
+
+		_nodes[node_index].first = left_index;
+		_nodes[node_index].is_leaf = false;
+
+		build_recursive(left_index, indices, mid, emitters, path, depth + 1);
+		build_recursive(left_index + 1, indices + mid, count - mid, emitters, path | (uint64_t(1) << depth), depth + 1);
+	}
+
+	// A cone bounding the emission cones of all emitters. Uses the average axis, which is not the
+	// tightest bound but is conservative.
+	static void merge_cones(const uint32_t* indices, uint32_t count, const std::vector<emitter>& emitters, math::vec<3>* out_axis, float* out_cos_theta_o)
+	{
+		math::vec<3> axis = { 0 };
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const emitter& e = emitters[indices[i]];
+			if (e.cos_theta_o <= -1)
+			{
+				*out_axis = { 0, 0, 1 };
+				*out_cos_theta_o = -1;
+				return;
+			}
+			axis += e.axis;
+		}
+
+		if (math::length(axis) < 0.0001f)
+		{
+			*out_axis = { 0, 0, 1 };
+			*out_cos_theta_o = -1;
+			return;
+		}
+
+		axis = math::normalize(axis);
+
+		// Widen the cone until it contains every emitter's cone
+		float theta_o = 0.0f;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const emitter& e = emitters[indices[i]];
+			const float angle_to_axis = std::acos(std::min(1.0f, std::max(-1.0f, math::dot(axis, e.axis))));
+			theta_o = std::max(theta_o, angle_to_axis + std::acos(e.cos_theta_o));
+		}
+
+		*out_axis = axis;
+		*out_cos_theta_o = (theta_o >= math::pi) ? -1.0f : std::cos(theta_o);
+	}
+
+	std::vector<node> _nodes;
+	std::vector<uint64_t> _emitter_paths; // the left/right decisions from the root to each emitter, one bit per level
+};
@@ -10,12 +10,140 @@ using namespace Gdiplus;
 #pragma comment (lib, "gdiplus.lib")
 
 #include "pathy.h"
+#include "distributed.h"
+#include "server.h"
+#include "watch.h"
+#include "scene_parser.h"
+#include "ldr_image.h"
 #include "benchmark.h"
-#include "tinyxml2.h"
 
 image g_image(640, 480);
 scene g_scene;
 
+// The image is also written to this file when set, the extension picks the format. Linear radiance is
+// streamed to .exr and .pfm files while rendering, the final 8 bit image is saved to .png and .qoi files.
+const char* g_output_filepath = nullptr;
+
+render_settings g_render_settings;
+
+// With -time-limit the render stops after this many seconds and shows what it sampled so far
+double g_time_limit_seconds = 0.0;
+
+// With -heatmap the work spent on every pixel is measured and written as false color images to
+// <prefix>_rays.png, <prefix>_traversal_steps.png, <prefix>_primitive_tests.png and <prefix>_cycles.png
+const char* g_heatmap_prefix = nullptr;
+
+// With -trace the task timeline of the render is written to this file in the Chrome trace format
+const char* g_trace_filepath = nullptr;
+
+// With -coordinator the tiles are rendered by worker processes that connect to this socket
+net::socket g_coordinator_listener;
+
+// With -interactive the image is refined on a background thread, starting with coarse previews, and the
+// left and right arrow keys orbit the camera. Every change cancels the render in flight and starts over.
+bool g_interactive = false;
+float g_camera_yaw = 0.0f;
+std::thread g_render_thread;
+cancellation_token g_cancel_render;
+std::mutex g_display_mutex;
+image g_display_image(640, 480);
+
+// With -watch the scene file is watched while in interactive mode and edits are applied to the loaded
+// scene as they are saved
+const char* g_scene_filepath = "aras.xml";
+bool g_watch_scene = false;
+std::mutex g_edited_scene_mutex;
+std::unique_ptr<scene> g_edited_scene;
+
+// Posted by the watcher thread once the edited scene is loaded
+const UINT WM_SCENE_CHANGED = WM_APP + 1;
+
+void stop_render()
+{
+	g_cancel_render.cancel();
+	if (g_render_thread.joinable())
+	{
+		g_render_thread.join();
+	}
+	g_cancel_render.reset();
+}
+
+void restart_render(HWND hWnd)
+{
+	stop_render();
+
+	// Orbits around the origin at the height and distance of the default camera
+	const math::vec<3> eye = { 3.0f * std::sin(g_camera_yaw), 2.0f, 3.0f * std::cos(g_camera_yaw) };
+	const camera camera(static_cast<float>(g_image.width) / g_image.height, eye);
+
+	g_render_thread = std::thread([hWnd, camera]()
+	{
+		image frame(g_image.width, g_image.height);
+		unsigned ray_count = 0;
+
+		auto present = [&frame, hWnd]()
+		{
+			{
+				std::lock_guard<std::mutex> lock(g_display_mutex);
+				g_display_image.data = frame.data;
+			}
+			InvalidateRect(hWnd, NULL, FALSE);
+		};
+
+		// One ray per 8x8, 4x4 and 2x2 pixels before the full render
+		for (int block_size : { 8, 4, 2 })
+		{
+			if (!render_preview(g_scene, camera, &frame, block_size, &ray_count, &g_cancel_render))
+			{
+				return;
+			}
+			present();
+		}
+
+		render_settings settings = g_render_settings;
+		settings.cancel = &g_cancel_render;
+
+		if (render(g_scene, camera, &frame, &ray_count, settings))
+		{
+			present();
+		}
+	});
+}
+
+void draw_image(HDC hdc, image* image)
+{
+	Bitmap bmp(image->width, image->height, image->pitch, PixelFormat24bppRGB, reinterpret_cast<BYTE*>(&image->data[0]));
+	bmp.RotateFlip(RotateFlipType::Rotate180FlipX);
+
+	Graphics graphics(hdc);
+	graphics.DrawImage(&bmp, 0, 0);
+}
+
+bool has_extension(const char* filepath, const char* extension)
+{
+	const size_t length = strlen(filepath);
+	const size_t extension_length = strlen(extension);
+	return length >= extension_length && _stricmp(filepath + length - extension_length, extension) == 0;
+}
+
+void write_heatmaps(const cost_buffer& costs, const char* prefix)
+{
+	tf::Taskflow tf(std::max(1u, std::thread::hardware_concurrency()));
+
+	image heatmap(costs.costs.width, costs.costs.height);
+
+	for (int metric = 0; metric < cost_buffer::metric_count; ++metric)
+	{
+		false_color(costs, static_cast<cost_buffer::metric>(metric), &heatmap);
+
+		const std::string filepath = std::string(prefix) + "_" + cost_buffer::metric_names[metric] + ".png";
+		if (!write_png(filepath.c_str(), reinterpret_cast<const uint8_t*>(heatmap.data.data()), heatmap.width, heatmap.height, tf))
+		{
+			std::cerr << "failed to write " << filepath << std::endl;
+		}
+	}
+}
+
 VOID OnPaint(HDC hdc)
 {
 	{
@@ -24,18 +152,104 @@ VOID OnPaint(HDC hdc)
 		benchmark::timer timer;
 		timer.start();
 
-		render(g_scene, &g_image, &ray_count);
+		exr_writer exr;
+		pfm_writer pfm;
+		tile_callback on_tile_finished;
+
+		if (g_output_filepath)
+		{
+			if (has_extension(g_output_filepath, ".exr") && exr.open(g_output_filepath, g_image.width, g_image.height, render_tile_size))
+			{
+				on_tile_finished = [&exr](const image_tile& tile) { exr.write_tile(tile); };
+			}
+			else if (has_extension(g_output_filepath, ".pfm") && pfm.open(g_output_filepath, g_image.width, g_image.height))
+			{
+				on_tile_finished = [&pfm](const image_tile& tile) { pfm.write_tile(tile); };
+			}
+			else if (!has_extension(g_output_filepath, ".png") && !has_extension(g_output_filepath, ".qoi"))
+			{
+				std::cerr << "failed to open " << g_output_filepath << " for writing, only .exr, .pfm, .png and .qoi are supported" << std::endl;
+			}
+		}
+
+		if (g_coordinator_listener.valid())
+		{
+			distributed::render(g_coordinator_listener, g_scene, &g_image, &ray_count, g_render_settings, on_tile_finished);
+		}
+		else
+		{
+			cancellation_token deadline;
+			render_settings settings = g_render_settings;
+			if (g_time_limit_seconds > 0.0)
+			{
+				deadline.set_time_limit(g_time_limit_seconds);
+				settings.cancel = &deadline;
+			}
+
+			std::unique_ptr<cost_buffer> costs;
+			if (g_heatmap_prefix)
+			{
+				costs.reset(new cost_buffer(g_image.width, g_image.height));
+				settings.costs = costs.get();
+			}
+
+			if (g_trace_filepath)
+			{
+				trace::start();
+			}
+
+			if (!render(g_scene, &g_image, &ray_count, settings, on_tile_finished))
+			{
+				std::cerr << "the time limit was reached before the image converged" << std::endl;
+			}
+
+			if (g_trace_filepath)
+			{
+				trace::stop();
+				if (!trace::write_chrome_trace(g_trace_filepath))
+				{
+					std::cerr << "failed to write " << g_trace_filepath << std::endl;
+				}
+			}
+
+			if (costs)
+			{
+				write_heatmaps(*costs, g_heatmap_prefix);
+			}
+		}
+
+		if (on_tile_finished && !(has_extension(g_output_filepath, ".exr") ? exr.close() : pfm.close()))
+		{
+			std::cerr << "failed to write " << g_output_filepath << std::endl;
+		}
 
 		const double time_seconds = timer.stop() * 0.001;
 
 		printf("completed in %.2f seconds. %u rays cast (%.2f million rays/second).", time_seconds, ray_count, (ray_count * 0.000001) / time_seconds);
 	}
 
-	Bitmap bmp(g_image.width, g_image.height, g_image.pitch, PixelFormat24bppRGB, reinterpret_cast<BYTE*>(&g_image.data[0]));
-	bmp.RotateFlip(RotateFlipType::Rotate180FlipX);
+	if (g_output_filepath && (has_extension(g_output_filepath, ".png") || has_extension(g_output_filepath, ".qoi")))
+	{
+		const uint8_t* bgr = reinterpret_cast<const uint8_t*>(g_image.data.data());
 
-	Graphics graphics(hdc);
-	graphics.DrawImage(&bmp, 0, 0);
+		bool written;
+		if (has_extension(g_output_filepath, ".png"))
+		{
+			tf::Taskflow tf(std::max(1u, std::thread::hardware_concurrency()));
+			written = write_png(g_output_filepath, bgr, g_image.width, g_image.height, tf);
+		}
+		else
+		{
+			written = write_qoi(g_output_filepath, bgr, g_image.width, g_image.height);
+		}
+
+		if (!written)
+		{
+			std::cerr << "failed to write " << g_output_filepath << std::endl;
+		}
+	}
+
+	draw_image(hdc, &g_image);
 }
 
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
@@ -46,13 +260,52 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 	{
 		PAINTSTRUCT ps;
 		HDC hdc = BeginPaint(hWnd, &ps);
-		OnPaint(hdc);
+		if (g_interactive)
+		{
+			std::lock_guard<std::mutex> lock(g_display_mutex);
+			draw_image(hdc, &g_display_image);
+		}
+		else
+		{
+			OnPaint(hdc);
+		}
 		EndPaint(hWnd, &ps);
 
 		return 0;
 	}
+	case WM_KEYDOWN:
+	{
+		if (g_interactive && (wParam == VK_LEFT || wParam == VK_RIGHT))
+		{
+			g_camera_yaw += (wParam == VK_LEFT) ? -0.1f : 0.1f;
+			restart_render(hWnd);
+		}
+
+		return 0;
+	}
+	case WM_SCENE_CHANGED:
+	{
+		std::unique_ptr<scene> edited;
+		{
+			std::lock_guard<std::mutex> lock(g_edited_scene_mutex);
+			edited = std::move(g_edited_scene);
+		}
+
+		// Saving the file without changing anything keeps the render going. Otherwise the render thread
+		// has to stop before the scene is touched.
+		if (edited && g_scene.compare(*edited).any())
+		{
+			stop_render();
+			g_scene.apply_changes(*edited);
+			restart_render(hWnd);
+		}
+
+		return 0;
+	}
 	case WM_DESTROY:
 	{
+		stop_render();
+
 		PostQuitMessage(0);
 
 		return 0;
@@ -62,255 +315,168 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 	return DefWindowProc(hWnd, message, wParam, lParam);
 }
 
-scene load_scene(const char* filepath)
+// Reads the scene without building its acceleration structures. Leaves out_scene as it was when the
+// file can't be opened or parsed.
+bool parse_scene_file(const char* filepath, scene* out_scene)
 {
-	scene scene;
-
-	tinyxml2::XMLDocument scene_xml;
-	tinyxml2::XMLError err = scene_xml.LoadFile(filepath);
-	if (err != tinyxml2::XML_SUCCESS)
+	std::ifstream file(filepath, std::ios::binary);
+	if (!file)
 	{
 		std::cerr << "failed to open " << filepath << std::endl;
 
-		return scene;
+		return false;
 	}
 
-	tinyxml2::XMLElement* scene_element = scene_xml.FirstChildElement("scene");
-	if (!scene_element)
+	scene scene;
+	if (!parse_scene(file, &scene, filepath))
 	{
 		std::cerr << "the scene " << filepath << " is invalid." << std::endl;
 
-		return scene;
+		return false;
 	}
 
-	for (const tinyxml2::XMLElement* scene_child_element = scene_element->FirstChildElement();
-		scene_child_element;
-		scene_child_element = scene_child_element->NextSiblingElement())
-	{
-		if (strcmp(scene_child_element->Name(), "emitter") == 0)
-		{
-			if (strcmp(scene_child_element->Attribute("type"), "point") == 0)
-			{
-				math::vec<3> position = { 0.0f, 0.0f, 0.0f };
-				// The radiant intensity in units of power per unit steradian
-				math::vec<3> intensity = { 1.0f, 1.0f, 1.0f };
+	*out_scene = std::move(scene);
 
-				for (const tinyxml2::XMLElement* emitter_child_element = scene_child_element->FirstChildElement();
-					emitter_child_element;
-					emitter_child_element = emitter_child_element->NextSiblingElement())
-				{
-					if (strcmp(emitter_child_element->Name(), "point") == 0)
-					{
-						if (strcmp(emitter_child_element->Attribute("name"), "position") == 0)
-						{
-							position.x = emitter_child_element->FloatAttribute("x");
-							position.y = emitter_child_element->FloatAttribute("y");
-							position.z = emitter_child_element->FloatAttribute("z");
-						}
-						else
-						{
-							assert(false);
-						}
-					}
-					else if (strcmp(emitter_child_element->Name(), "rgb") == 0)
-					{
-						if (strcmp(emitter_child_element->Attribute("name"), "intensity") == 0)
-						{
-							const char* value = emitter_child_element->Attribute("value");
-							if (sscanf_s(value, "%f, %f, %f", &intensity[0], &intensity[1], &intensity[2]) != 3)
-							{
-								assert(false);
-							}
-						}
-						else
-						{
-							assert(false);
-						}
-					}
-					else
-					{
-						assert(false);
-					}
-				}
+	return true;
+}
 
-				scene.point_lights.push_back({ position, intensity });
-			}
-			else if (strcmp(scene_child_element->Attribute("type"), "constant") == 0)
-			{
-				// The emitted radiance in units of power per unit area per unit steradian
-				math::vec<3> radiance = { 0 };
+bool load_scene(const char* filepath, scene* out_scene)
+{
+	if (!parse_scene_file(filepath, out_scene))
+	{
+		return false;
+	}
 
-				for (const tinyxml2::XMLElement* emitter_child_element = scene_child_element->FirstChildElement();
-					emitter_child_element;
-					emitter_child_element = emitter_child_element->NextSiblingElement())
-				{
-					if (strcmp(emitter_child_element->Name(), "rgb") == 0)
-					{
-						if (strcmp(emitter_child_element->Attribute("name"), "radiance") == 0)
-						{
-							const char* value = emitter_child_element->Attribute("value");
-							if (sscanf_s(value, "%f, %f, %f", &radiance[0], &radiance[1], &radiance[2]) != 3)
-							{
-								assert(false);
-							}
-						}
-						else
-						{
-							assert(false);
-						}
-					}
-					else
-					{
-						assert(false);
-					}
-				}
+	out_scene->build_acceleration_structure();
 
-				scene.constant_light.radiance = radiance;
-			}
-			else
-			{
-				std::cerr << "emitter has unsupported type: " << scene_child_element->Attribute("type") << std::endl;
+	return true;
+}
 
-				continue;
-			}
-		}
-	}
+int main(int argc, char* argv[])
+{
+	int coordinator_port = 0;
+	int local_worker_count = 0;
 
-	for (tinyxml2::XMLElement* shape_element = scene_element->FirstChildElement("shape");
-		shape_element;
-		shape_element = shape_element->NextSiblingElement("shape"))
+	for (int i = 1; i < argc; ++i)
 	{
-		if (strcmp(shape_element->Attribute("type"), "sphere") != 0)
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
 		{
-			std::cerr << "shape has unsupported type: " << shape_element->Attribute("type") << std::endl;
-
-			continue;
+			g_output_filepath = argv[++i];
 		}
-
-		math::vec<3> translate = { 0.0f, 0.0f, 0.0f };
-
-		if (tinyxml2::XMLElement* transform_element = shape_element->FirstChildElement("transform"))
+		else if (strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
 		{
-			if (tinyxml2::XMLElement* translation_element = transform_element->FirstChildElement("translate"))
-			{
-				translate.x = translation_element->FloatAttribute("x");
-				translate.y = translation_element->FloatAttribute("y");
-				translate.z = translation_element->FloatAttribute("z");
-			}
+			g_render_settings.checkpoint.filepath = argv[++i];
 		}
-
-		float radius = 1.0f;
-
-		for (tinyxml2::XMLElement* float_element = shape_element->FirstChildElement("float");
-			float_element;
-			float_element = float_element->NextSiblingElement("float"))
+		else if (strcmp(argv[i], "-time-limit") == 0 && i + 1 < argc)
 		{
-			if (strcmp(float_element->Attribute("name"), "radius") == 0)
-			{
-				radius = float_element->FloatAttribute("value");
-				break;
-			}
+			g_time_limit_seconds = atof(argv[++i]);
 		}
-
-		if (tinyxml2::XMLElement* emitter_element = shape_element->FirstChildElement("emitter"))
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+		{
+			g_trace_filepath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-heatmap") == 0 && i + 1 < argc)
 		{
-			if (strcmp(emitter_element->Attribute("type"), "area") != 0)
+			g_heatmap_prefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "-isa") == 0 && i + 1 < argc)
+		{
+			// Runs the kernels compiled for a lower instruction set level, e.g. to compare the levels
+			isa_level level;
+			if (!parse_isa_level(argv[++i], &level))
 			{
-				std::cerr << "emitter has unsupported type: " << emitter_element->Attribute("type") << std::endl;
+				std::cerr << "expected sse2, sse4.2, avx2 or avx512 after -isa" << std::endl;
 
-				continue;
+				return 1;
 			}
 
-			// The radiant intensity in units of power per unit steradian
-			math::vec<3> intensity = { 1.0f, 1.0f, 1.0f };
-
-			for (tinyxml2::XMLElement* rgb_element = emitter_element->FirstChildElement("rgb");
-				rgb_element;
-				rgb_element = rgb_element->NextSiblingElement("rgb"))
+			if (force_isa_level(level) != level)
 			{
-				if (strcmp(rgb_element->Attribute("name"), "intensity") == 0)
-				{
-					if (sscanf_s(rgb_element->Attribute("value"), "%f, %f, %f", &intensity.x, &intensity.y, &intensity.z) != 3)
-					{
-						std::cerr << "failed to parse intensity: " << rgb_element->Attribute("value") << std::endl;
-
-						continue;
-					}
-					break;
-				}
+				std::cerr << isa_level_name(level) << " is not supported, using " << isa_level_name(g_isa_level) << std::endl;
 			}
-
-			sphere_area_light sphere_area_light{ translate, radius, intensity };
-			scene.sphere_area_lights.push_back(sphere_area_light);
 		}
-		else if (tinyxml2::XMLElement* bsdf_element = shape_element->FirstChildElement("bsdf"))
+		else if (strcmp(argv[i], "-resume") == 0)
 		{
-			material material;
-
-			if (strcmp(bsdf_element->Attribute("type"), "diffuse") == 0)
+			g_render_settings.checkpoint.resume = true;
+		}
+		else if (strcmp(argv[i], "-worker") == 0 && i + 1 < argc)
+		{
+			// Renders for the coordinator at host:port, the scene and settings come from the coordinator
+			const char* separator = strrchr(argv[++i], ':');
+			if (!separator)
 			{
-				math::vec<3> reflectance = { 1.0f, 1.0f, 1.0f };
+				std::cerr << "expected host:port after -worker" << std::endl;
 
-				for (tinyxml2::XMLElement* rgb_element = bsdf_element->FirstChildElement("rgb");
-					rgb_element;
-					rgb_element = rgb_element->NextSiblingElement("rgb"))
-				{
-					if (strcmp(rgb_element->Attribute("name"), "reflectance") == 0)
-					{
-						if (sscanf_s(rgb_element->Attribute("value"), "%f, %f, %f", &reflectance.x, &reflectance.y, &reflectance.z) != 3)
-						{
-							std::cerr << "failed to parse reflectance: " << rgb_element->Attribute("value") << std::endl;
+				return 1;
+			}
 
-							continue;
-						}
-						break;
-					}
-				}
+			const std::string host(argv[i], separator - argv[i]);
+			return distributed::run_worker(host.c_str(), static_cast<uint16_t>(atoi(separator + 1))) ? 0 : 1;
+		}
+		else if (strcmp(argv[i], "-server") == 0 && i + 1 < argc)
+		{
+			// Serves render requests on [address:]port until the process is stopped. The server opens the
+			// scene files clients name, so it only accepts local clients unless an address is given.
+			const char* separator = strrchr(argv[++i], ':');
+			const std::string address = separator ? std::string(argv[i], separator - argv[i]) : "127.0.0.1";
+			const char* port = separator ? separator + 1 : argv[i];
+
+			net::socket listener = net::socket::listen(static_cast<uint16_t>(atoi(port)), address.c_str());
+			if (!listener.valid())
+			{
+				std::cerr << "failed to listen on " << address << ":" << port << std::endl;
 
-				material.base_color = reflectance;
+				return 1;
 			}
-			else if (strcmp(bsdf_element->Attribute("type"), "conductor") == 0)
-			{
-				math::vec<3> specular_reflectance = { 1.0f, 1.0f, 1.0f };
 
-				for (tinyxml2::XMLElement* rgb_element = bsdf_element->FirstChildElement("rgb");
-					rgb_element;
-					rgb_element = rgb_element->NextSiblingElement("rgb"))
-				{
-					if (strcmp(rgb_element->Attribute("name"), "specularReflectance") == 0)
-					{
-						if (sscanf_s(rgb_element->Attribute("value"), "%f, %f, %f", &specular_reflectance.x, &specular_reflectance.y, &specular_reflectance.z) != 3)
-						{
-							std::cerr << "failed to parse specularReflectance: " << rgb_element->Attribute("value") << std::endl;
+			server::render_server server(load_scene);
+			server.run(listener);
 
-							continue;
-						}
-						break;
-					}
-				}
+			return 0;
+		}
+		else if (strcmp(argv[i], "-coordinator") == 0 && i + 1 < argc)
+		{
+			coordinator_port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+		{
+			local_worker_count = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-interactive") == 0)
+		{
+			g_interactive = true;
+		}
+		else if (strcmp(argv[i], "-watch") == 0)
+		{
+			g_interactive = true;
+			g_watch_scene = true;
+		}
+	}
 
-				material.base_color = specular_reflectance;
-				material.is_mirror = true;
-			}
-			else
-			{
-				std::cerr << "bsdf has unsupported type: " << bsdf_element->Attribute("type") << std::endl;
+	if (coordinator_port > 0)
+	{
+		g_coordinator_listener = net::socket::listen(static_cast<uint16_t>(coordinator_port));
+		if (!g_coordinator_listener.valid())
+		{
+			std::cerr << "failed to listen on port " << coordinator_port << std::endl;
 
-				continue;
-			}
+			return 1;
+		}
+
+		char executable[MAX_PATH];
+		GetModuleFileNameA(NULL, executable, MAX_PATH);
 
-			sphere sphere{ translate, radius };
-			scene.spheres.push_back(sphere);
-			scene.sphere_materials.push_back(material);
+		if (!distributed::launch_local_workers(executable, static_cast<uint16_t>(coordinator_port), local_worker_count))
+		{
+			std::cerr << "failed to start the local workers" << std::endl;
 		}
 	}
 
-	return scene;
-}
-
-int main()
-{
-	g_scene = load_scene("aras.xml");
+	// Without a scene the window shows the empty one, and with -watch the first edit that parses
+	if (!load_scene(g_scene_filepath, &g_scene))
+	{
+		g_scene.build_acceleration_structure();
+	}
 
 	GdiplusStartupInput gdiplus_startup_input;
 	ULONG_PTR gdiplus_token;
@@ -352,6 +518,41 @@ int main()
 	ShowWindow(hWnd, SW_SHOWNORMAL);
 	UpdateWindow(hWnd);
 
+	if (g_interactive)
+	{
+		restart_render(hWnd);
+	}
+
+	std::atomic<bool> quit(false);
+	std::thread watcher_thread;
+
+	if (g_watch_scene)
+	{
+		watcher_thread = std::thread([hWnd, &quit]()
+		{
+			file_watcher watcher(g_scene_filepath);
+			while (!quit)
+			{
+				if (watcher.wait_for_change(250))
+				{
+					// An edit that doesn't parse, like a file saved halfway, keeps the current scene. The edited
+					// scene is only compared against the current one, which refits or rebuilds what changed.
+					std::unique_ptr<scene> edited(new scene());
+					if (!parse_scene_file(g_scene_filepath, edited.get()))
+					{
+						continue;
+					}
+
+					{
+						std::lock_guard<std::mutex> lock(g_edited_scene_mutex);
+						g_edited_scene = std::move(edited);
+					}
+					PostMessage(hWnd, WM_SCENE_CHANGED, 0, 0);
+				}
+			}
+		});
+	}
+
 	MSG msg;
 	while (GetMessage(&msg, NULL, 0, 0))
 	{
@@ -359,6 +560,12 @@ int main()
 		DispatchMessage(&msg);
 	}
 
+	quit = true;
+	if (watcher_thread.joinable())
+	{
+		watcher_thread.join();
+	}
+
 	GdiplusShutdown(gdiplus_token);
 
 	return static_cast<int>(msg.wParam);
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#undef min
+#undef max
+
+#pragma comment (lib, "ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+// Blocking TCP sockets over Winsock and BSD sockets, just enough for the distributed renderer
+namespace net
+{
+#ifdef _WIN32
+	using native_socket = SOCKET;
+	const native_socket invalid_socket = INVALID_SOCKET;
+#else
+	using native_socket = int;
+	const native_socket invalid_socket = -1;
+#endif
+
+	// Larger messages are refused unless the receiver allows them, so that a peer can not make the
+	// receiver allocate arbitrary amounts of memory
+	constexpr uint32_t default_max_payload_size = 64u << 20;
+
+	inline bool startup()
+	{
+#ifdef _WIN32
+		static const bool started = []()
+		{
+			WSADATA data;
+			return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}();
+		return started;
+#else
+		// A peer closing its end must fail the send instead of terminating the process
+		static const bool started = []()
+		{
+			signal(SIGPIPE, SIG_IGN);
+			return true;
+		}();
+		return started;
+#endif
+	}
+
+	class socket
+	{
+	public:
+		socket() = default;
+
+		explicit socket(native_socket handle) :
+			_handle(handle)
+		{
+		}
+
+		socket(socket&& other) :
+			_handle(other._handle)
+		{
+			other._handle = invalid_socket;
+		}
+
+		socket& operator=(socket&& other)
+		{
+			if (this != &other)
+			{
+				close();
+				_handle = other._handle;
+				other._handle = invalid_socket;
+			}
+			return *this;
+		}
+
+		socket(const socket&) = delete;
+		socket& operator=(const socket&) = delete;
+
+		~socket()
+		{
+			close();
+		}
+
+		static socket connect(const char* host, uint16_t port)
+		{
+			if (!startup())
+			{
+				return socket();
+			}
+
+			addrinfo hints = {};
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+
+			char service[8];
+			snprintf(service, sizeof(service), "%u", port);
+
+			addrinfo* addresses = nullptr;
+			if (getaddrinfo(host, service, &hints, &addresses) != 0)
+			{
+				return socket();
+			}
+
+			socket result;
+			for (addrinfo* address = addresses; address; address = address->ai_next)
+			{
+				socket candidate(::socket(address->ai_family, address->ai_socktype, address->ai_protocol));
+				if (candidate.valid() && ::connect(candidate._handle, address->ai_addr, static_cast<int>(address->ai_addrlen)) == 0)
+				{
+					candidate.set_no_delay();
+					result = std::move(candidate);
+					break;
+				}
+			}
+
+			freeaddrinfo(addresses);
+
+			return result;
+		}
+
+		// Listens on the interface with the given IPv4 address. The default of every interface lets
+		// workers on other machines connect, 127.0.0.1 only accepts connections from this machine.
+		static socket listen(uint16_t port, const char* address = "0.0.0.0")
+		{
+			if (!startup())
+			{
+				return socket();
+			}
+
+			in_addr bind_address;
+			if (inet_pton(AF_INET, address, &bind_address) != 1)
+			{
+				return socket();
+			}
+
+			socket result(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+			if (!result.valid())
+			{
+				return socket();
+			}
+
+			const int reuse = 1;
+			setsockopt(result._handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+			sockaddr_in socket_address = {};
+			socket_address.sin_family = AF_INET;
+			socket_address.sin_addr = bind_address;
+			socket_address.sin_port = htons(port);
+
+			if (::bind(result._handle, reinterpret_cast<const sockaddr*>(&socket_address), sizeof(socket_address)) != 0 ||
+				::listen(result._handle, SOMAXCONN) != 0)
+			{
+				return socket();
+			}
+
+			return result;
+		}
+
+		socket accept()
+		{
+			socket result(::accept(_handle, nullptr, nullptr));
+			if (result.valid())
+			{
+				result.set_no_delay();
+			}
+			return result;
+		}
+
+		bool send_all(const void* data, size_t size)
+		{
+			const char* bytes = static_cast<const char*>(data);
+			while (size > 0)
+			{
+				const int sent = ::send(_handle, bytes, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+				if (sent <= 0)
+				{
+					return false;
+				}
+				bytes += sent;
+				size -= sent;
+			}
+			return true;
+		}
+
+		bool receive_all(void* data, size_t size)
+		{
+			char* bytes = static_cast<char*>(data);
+			while (size > 0)
+			{
+				const int received = ::recv(_handle, bytes, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+				if (received <= 0)
+				{
+					return false;
+				}
+				bytes += received;
+				size -= received;
+			}
+			return true;
+		}
+
+		// Fails sends and receives that make no progress for the given time instead of blocking forever
+		void set_timeouts(int milliseconds)
+		{
+#ifdef _WIN32
+			const DWORD timeout = static_cast<DWORD>(milliseconds);
+#else
+			timeval timeout;
+			timeout.tv_sec = milliseconds / 1000;
+			timeout.tv_usec = (milliseconds % 1000) * 1000;
+#endif
+			setsockopt(_handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+			setsockopt(_handle, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+		}
+
+		// Ends the connection in both directions, which wakes up other threads blocked on the socket.
+		// The handle stays open until close.
+		void shutdown()
+		{
+			if (_handle != invalid_socket)
+			{
+#ifdef _WIN32
+				::shutdown(_handle, SD_BOTH);
+#else
+				::shutdown(_handle, SHUT_RDWR);
+#endif
+			}
+		}
+
+		void close()
+		{
+			if (_handle != invalid_socket)
+			{
+#ifdef _WIN32
+				closesocket(_handle);
+#else
+				::close(_handle);
+#endif
+				_handle = invalid_socket;
+			}
+		}
+
+		bool valid() const { return _handle != invalid_socket; }
+
+		native_socket handle() const { return _handle; }
+
+	private:
+		// Messages are small and sent whole, waiting to coalesce them only adds latency
+		void set_no_delay()
+		{
+			const int no_delay = 1;
+			setsockopt(_handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+		}
+
+		native_socket _handle = invalid_socket;
+	};
+
+	// Waits until at least one of the sockets can be read without blocking or the timeout expires.
+	// Returns the indices of the readable sockets.
+	inline std::vector<int> wait_readable(const std::vector<const socket*>& sockets, int timeout_milliseconds)
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+
+		native_socket max_handle = 0;
+		for (const socket* s : sockets)
+		{
+			FD_SET(s->handle(), &readable);
+			max_handle = std::max(max_handle, s->handle());
+		}
+
+		timeval timeout;
+		timeout.tv_sec = timeout_milliseconds / 1000;
+		timeout.tv_usec = (timeout_milliseconds % 1000) * 1000;
+
+		std::vector<int> ready;
+		if (select(static_cast<int>(max_handle + 1), &readable, nullptr, nullptr, &timeout) > 0)
+		{
+			for (int i = 0; i < static_cast<int>(sockets.size()); ++i)
+			{
+				if (FD_ISSET(sockets[i]->handle(), &readable))
+				{
+					ready.push_back(i);
+				}
+			}
+		}
+
+		return ready;
+	}
+
+	// Messages are sent as their type and payload size followed by the payload. Values are copied as
+	// they are, both ends must share the byte order.
+	template<typename Type>
+	class message
+	{
+	public:
+		message() = default;
+
+		explicit message(Type type) :
+			type(type)
+		{
+		}
+
+		template<typename T>
+		void write(const T& value)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "only plain values can be sent");
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+			payload.insert(payload.end(), bytes, bytes + sizeof(T));
+		}
+
+		template<typename T>
+		void write_vector(const std::vector<T>& values)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "only plain values can be sent");
+			write(static_cast<uint64_t>(values.size()));
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values.data());
+			payload.insert(payload.end(), bytes, bytes + values.size() * sizeof(T));
+		}
+
+		template<typename T>
+		bool read(T* out_value)
+		{
+			if (_read_offset + sizeof(T) > payload.size())
+			{
+				return false;
+			}
+			memcpy(out_value, payload.data() + _read_offset, sizeof(T));
+			_read_offset += sizeof(T);
+			return true;
+		}
+
+		template<typename T>
+		bool read_vector(std::vector<T>* out_values)
+		{
+			uint64_t size;
+			if (!read(&size) || size > (payload.size() - _read_offset) / sizeof(T))
+			{
+				return false;
+			}
+			out_values->resize(static_cast<size_t>(size));
+			memcpy(out_values->data(), payload.data() + _read_offset, out_values->size() * sizeof(T));
+			_read_offset += out_values->size() * sizeof(T);
+			return true;
+		}
+
+		bool send(socket& connection) const
+		{
+			const uint32_t header[2] = { static_cast<uint32_t>(type), static_cast<uint32_t>(payload.size()) };
+			return connection.send_all(header, sizeof(header)) && connection.send_all(payload.data(), payload.size());
+		}
+
+		// Fails for messages with a payload larger than max_payload_size
+		bool receive(socket& connection, uint32_t max_payload_size = default_max_payload_size)
+		{
+			uint32_t header[2];
+			if (!connection.receive_all(header, sizeof(header)) || header[1] > max_payload_size)
+			{
+				return false;
+			}
+
+			type = static_cast<Type>(header[0]);
+			payload.resize(header[1]);
+			_read_offset = 0;
+
+			return connection.receive_all(payload.data(), payload.size());
+		}
+
+		Type type = {};
+		std::vector<uint8_t> payload;
+
+	private:
+		size_t _read_offset = 0;
+	};
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+
+#include "math.h"
+#include "simd.h"
+
+// A group of coherent rays stored as structure of arrays so that they can be tested against boxes and
+// primitives four, eight or sixteen at a time. Lanes that are not part of the active mask carry a copy of an active ray
+// and a negative t_max, which makes them miss everything without special casing the kernels.
+template <int N>
+struct ray_packet
+{
+	static_assert(N % simd::float4::width == 0, "packet size must be a multiple of the SIMD width");
+	static_assert(N <= 32, "active lanes are tracked in a 32 bit mask");
+
+	static constexpr int size = N;
+
+	void set(int lane, const math::vec<3>& ray_origin, const math::vec<3>& ray_direction, float ray_t_min = 0.001f, float ray_t_max = std::numeric_limits<float>::infinity())
+	{
+		assert(lane < N);
+		for (int i = 0; i < 3; ++i)
+		{
+			origin[i][lane] = ray_origin[i];
+			direction[i][lane] = ray_direction[i];
+		}
+		t_min[lane] = ray_t_min;
+		t_max[lane] = ray_t_max;
+		active_mask |= 1u << lane;
+	}
+
+	// Must be called once all lanes are set and before tracing the packet
+	void finalize()
+	{
+		assert(active_mask != 0);
+
+		int first_active = 0;
+		while (!(active_mask & (1u << first_active)))
+		{
+			++first_active;
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			origin_min[i] = inverse_direction_min[i] = std::numeric_limits<float>::infinity();
+			origin_max[i] = inverse_direction_max[i] = -std::numeric_limits<float>::infinity();
+		}
+
+		for (int lane = 0; lane < N; ++lane)
+		{
+			if (!(active_mask & (1u << lane)))
+			{
+				for (int i = 0; i < 3; ++i)
+				{
+					origin[i][lane] = origin[i][first_active];
+					direction[i][lane] = direction[i][first_active];
+				}
+				t_min[lane] = 0.0f;
+				t_max[lane] = -1.0f;
+			}
+
+			for (int i = 0; i < 3; ++i)
+			{
+				inverse_direction[i][lane] = 1.0f / direction[i][lane];
+				origin_min[i] = std::min(origin_min[i], origin[i][lane]);
+				origin_max[i] = std::max(origin_max[i], origin[i][lane]);
+				inverse_direction_min[i] = std::min(inverse_direction_min[i], inverse_direction[i][lane]);
+				inverse_direction_max[i] = std::max(inverse_direction_max[i], inverse_direction[i][lane]);
+			}
+		}
+
+		// Interval culling is only valid when every ray travels in the same octant
+		has_common_signs = true;
+		for (int i = 0; i < 3; ++i)
+		{
+			has_common_signs &= (inverse_direction_min[i] > 0) || (inverse_direction_max[i] < 0);
+		}
+	}
+
+	math::vec<3> lane_origin(int lane) const { return { origin[0][lane], origin[1][lane], origin[2][lane] }; }
+
+	math::vec<3> lane_direction(int lane) const { return { direction[0][lane], direction[1][lane], direction[2][lane] }; }
+
+	bool is_active(int lane) const { return (active_mask & (1u << lane)) != 0; }
+
+	// Aligned for loads of the widest vectors
+	alignas(64) float origin[3][N];
+	alignas(64) float direction[3][N];
+	alignas(64) float inverse_direction[3][N];
+	alignas(64) float t_min[N];
+	alignas(64) float t_max[N]; // shortened as closer hits are found
+
+	uint32_t active_mask = 0;
+
+	// Bounds of the packet's origins and inverse directions, i.e. an interval arithmetic frustum
+	bool has_common_signs = false;
+	math::vec<3> origin_min, origin_max;
+	math::vec<3> inverse_direction_min, inverse_direction_max;
+};
+
+// Conservative test whether any ray of the packet can hit the box. Only valid for packets whose
+// rays share direction signs, rejects the box for the whole packet with a handful of scalar operations.
+template <int N>
+bool packet_may_hit_aabb(const ray_packet<N>& packet, const math::vec<3>& box_min, const math::vec<3>& box_max, float packet_t_max)
+{
+	assert(packet.has_common_signs);
+
+	float t_near = 0.0f;
+	float t_far = packet_t_max;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		// With a positive direction the ray enters through the min plane and leaves through the max plane
+		const bool positive = packet.inverse_direction_min[i] > 0;
+		const float entry_plane = positive ? box_min[i] : box_max[i];
+		const float exit_plane = positive ? box_max[i] : box_min[i];
+
+		// Smallest possible entry and largest possible exit over all rays of the packet
+		const float entry_lo = entry_plane - (positive ? packet.origin_max[i] : packet.origin_min[i]);
+		const float exit_hi = exit_plane - (positive ? packet.origin_min[i] : packet.origin_max[i]);
+
+		const float entry = std::min(entry_lo * packet.inverse_direction_min[i], entry_lo * packet.inverse_direction_max[i]);
+		const float exit = std::max(exit_hi * packet.inverse_direction_min[i], exit_hi * packet.inverse_direction_max[i]);
+
+		t_near = std::max(t_near, entry);
+		t_far = std::min(t_far, exit);
+	}
+
+	return t_near <= t_far;
+}
+
+// Slab test of every lane against a box, V lanes at a time. Returns a bit per lane that hits and the
+// nearest entry distance.
+template <typename V, int N>
+uint32_t intersect_packet_aabb(const ray_packet<N>& packet, const math::vec<3>& box_min, const math::vec<3>& box_max, float* out_t_near)
+{
+	uint32_t hit_mask = 0;
+	V nearest(std::numeric_limits<float>::infinity());
+
+	for (int lane = 0; lane < N; lane += V::width)
+	{
+		V t_near(0.0f);
+		V t_far = V::load(&packet.t_max[lane]);
+
+		for (int i = 0; i < 3; ++i)
+		{
+			const V o = V::load(&packet.origin[i][lane]);
+			const V inv = V::load(&packet.inverse_direction[i][lane]);
+			const V t0 = (V(box_min[i]) - o) * inv;
+			const V t1 = (V(box_max[i]) - o) * inv;
+			t_near = simd::max(t_near, simd::min(t0, t1));
+			t_far = simd::min(t_far, simd::max(t0, t1));
+		}
+
+		const V hit = t_near <= t_far;
+		hit_mask |= static_cast<uint32_t>(simd::movemask(hit)) << lane;
+		nearest = simd::min(nearest, simd::select(hit, V(std::numeric_limits<float>::infinity()), t_near));
+	}
+
+	*out_t_near = simd::horizontal_min(nearest);
+
+	return hit_mask;
+}
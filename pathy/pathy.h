@@ -4,8 +4,40 @@
 #include <vector>
 #include <array>
 #include <cassert>
+#include <functional>
+#include <string>
+#include <fstream>
+#include <future>
+#include <chrono>
+#include <cstdio>
+#include <atomic>
+#include <filesystem>
+#include <system_error>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#undef min
+#undef max
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
 
 #include "math.h"
+#include "bvh.h"
+#include "cpu.h"
+#include "arena.h"
+#include "light_bvh.h"
+#include "packet.h"
+#include "denoise.h"
+#include "srgb.h"
+#include "trace.h"
 #include "taskflow.hpp"
 
 struct image
@@ -15,6 +47,8 @@ struct image
 		uint8_t b, g, r;
 	};
 
+	static_assert(sizeof(pixel) == 3, "rows are written as packed BGR bytes");
+
 	static constexpr pixel white = { 255, 255, 255 };
 	static constexpr pixel black = { 0, 0, 0 };
 
@@ -33,14 +67,154 @@ struct image
 	std::vector<pixel> data;
 };
 
-math::vec<3> linear_to_srgb(const math::vec<3>& color)
+// Running per pixel statistics of the radiance estimates. Besides the mean this tracks the variance of
+// the pixel's luminance so that the error of the estimate can be judged while rendering.
+struct accumulation_buffer
+{
+	struct pixel
+	{
+		math::vec<3> sum = { 0 };
+		float luminance_sum = 0;
+		float luminance_sum2 = 0;
+		uint32_t sample_count = 0;
+
+		math::vec<3> mean() const
+		{
+			return (sample_count > 0) ? sum / static_cast<float>(sample_count) : math::vec<3>(0);
+		}
+
+		// Standard error of the mean luminance relative to the mean itself. Dark pixels are judged
+		// against a floor so that the estimate does not explode for values close to black.
+		float relative_error() const
+		{
+			if (sample_count < 2)
+			{
+				return std::numeric_limits<float>::infinity();
+			}
+
+			const float n = static_cast<float>(sample_count);
+			const float mean = luminance_sum / n;
+			const float variance = std::max(0.0f, (luminance_sum2 - n * mean * mean) / (n - 1));
+
+			return std::sqrt(variance / n) / std::max(mean, 0.01f);
+		}
+	};
+
+	accumulation_buffer(int width, int height) :
+		width(width),
+		height(height),
+		data(width * height)
+	{
+	}
+
+	void add_sample(int x, int y, const math::vec<3>& radiance);
+
+	const int width;
+	const int height;
+
+	std::vector<pixel> data;
+};
+
+// A reading of the work counters of the calling thread. The difference of two readings is the work
+// done in between.
+struct work_reading
+{
+	uint64_t cycles;
+	uint64_t traversal_steps;
+	uint64_t primitive_tests;
+	unsigned rays;
+
+	static work_reading take(unsigned ray_count)
+	{
+		return { __rdtsc(), g_traversal_counters.steps, g_traversal_counters.primitive_tests, ray_count };
+	}
+};
+
+// The work spent on tracing the samples of a pixel
+struct pixel_cost
 {
-	math::vec<3> result;
-	for (int i = 0; i < 3; ++i)
+	float rays = 0;
+	float traversal_steps = 0;
+	float primitive_tests = 0;
+	float cycles = 0;
+
+	// Adds a share of the work done between two readings
+	void add(const work_reading& begin, const work_reading& end, float share)
+	{
+		rays += (end.rays - begin.rays) * share;
+		traversal_steps += (end.traversal_steps - begin.traversal_steps) * share;
+		primitive_tests += (end.primitive_tests - begin.primitive_tests) * share;
+		cycles += (end.cycles - begin.cycles) * share;
+	}
+};
+
+// The work spent on every pixel, summed over all of its samples
+struct cost_buffer
+{
+	enum metric
+	{
+		rays,
+		traversal_steps,
+		primitive_tests,
+		cycles,
+		metric_count
+	};
+
+	static constexpr const char* metric_names[metric_count] = { "rays", "traversal_steps", "primitive_tests", "cycles" };
+
+	cost_buffer(int width, int height) :
+		costs(width, height)
+	{
+	}
+
+	void add(int x, int y, const pixel_cost& cost)
+	{
+		const int i = costs.width * y + x;
+		costs.planes[rays][i] += cost.rays;
+		costs.planes[traversal_steps][i] += cost.traversal_steps;
+		costs.planes[primitive_tests][i] += cost.primitive_tests;
+		costs.planes[cycles][i] += cost.cycles;
+	}
+
+	planar_image<metric_count> costs;
+};
+
+// Shows one metric of the cost buffer as a heatmap running from dark blue for the cheapest pixels over
+// green and yellow to red. The scale ends at the 99th percentile so that a handful of outliers does not
+// leave the rest of the image dark, pixels above it are drawn white.
+void false_color(const cost_buffer& costs, cost_buffer::metric metric, image* out_image)
+{
+	assert(out_image->width == costs.costs.width && out_image->height == costs.costs.height);
+
+	const std::vector<float>& values = costs.costs.planes[metric];
+	if (values.empty())
+	{
+		return;
+	}
+
+	std::vector<float> sorted = values;
+	const size_t percentile = (sorted.size() - 1) * 99 / 100;
+	std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+	const float scale = (sorted[percentile] > 0) ? 1.0f / sorted[percentile] : 0.0f;
+
+	static const math::vec<3> stops[] = { { 0.05f, 0.03f, 0.3f }, { 0.1f, 0.4f, 0.95f }, { 0.1f, 0.85f, 0.6f }, { 0.95f, 0.9f, 0.15f }, { 0.9f, 0.1f, 0.05f } };
+	const int stop_count = sizeof(stops) / sizeof(stops[0]);
+
+	for (size_t i = 0; i < values.size(); ++i)
 	{
-		result[i] = 1.055f * std::pow(color[i], 0.416666667f) - 0.055f;
+		const float v = values[i] * scale;
+
+		math::vec<3> color = { 1 };
+		if (v <= 1.0f)
+		{
+			const float position = v * (stop_count - 1);
+			const int stop = std::min(static_cast<int>(position), stop_count - 2);
+			const float t = position - stop;
+			color = stops[stop] * (1 - t) + stops[stop + 1] * t;
+		}
+
+		out_image->data[i] = { static_cast<uint8_t>(color.z * 255), static_cast<uint8_t>(color.y * 255), static_cast<uint8_t>(color.x * 255) };
 	}
-	return result;
 }
 
 struct ray
@@ -104,16 +278,76 @@ bool intersect_ray_sphere(const ray& r, float t_min, float t_max, const sphere&
 	return false;
 }
 
+// The unit normal at a point on the sphere. Dividing by the radius alone is off by the rounding of the
+// hit point, which grows with the distance the ray travelled.
+inline math::vec<3> surface_normal(const math::vec<3>& point, const sphere& sphere)
+{
+	return math::normalize(point - sphere.position);
+}
+
+// Packet version of intersect_ray_sphere, V lanes at a time. Shortens t_max and records the sphere index
+// for every lane that hits the sphere closer than its current t_max.
+template <typename V, int N>
+void intersect_packet_sphere(ray_packet<N>& packet, const sphere& sphere, uint32_t sphere_index, uint32_t* inout_sphere_indices)
+{
+	const V center_x(sphere.position.x);
+	const V center_y(sphere.position.y);
+	const V center_z(sphere.position.z);
+	const V radius2(sphere.radius * sphere.radius);
+	const V zero(0.0f);
+
+	for (int lane = 0; lane < N; lane += V::width)
+	{
+		const V oc_x = V::load(&packet.origin[0][lane]) - center_x;
+		const V oc_y = V::load(&packet.origin[1][lane]) - center_y;
+		const V oc_z = V::load(&packet.origin[2][lane]) - center_z;
+		const V d_x = V::load(&packet.direction[0][lane]);
+		const V d_y = V::load(&packet.direction[1][lane]);
+		const V d_z = V::load(&packet.direction[2][lane]);
+
+		const V b = oc_x * d_x + oc_y * d_y + oc_z * d_z;
+		const V c = oc_x * oc_x + oc_y * oc_y + oc_z * oc_z - radius2;
+		const V discriminant = b * b - c;
+		const V discriminant_sqrt = simd::sqrt(simd::max(discriminant, zero));
+
+		const V t_min = V::load(&packet.t_min[lane]);
+		const V t_max = V::load(&packet.t_max[lane]);
+
+		const V t_near = -b - discriminant_sqrt;
+		const V t_far = -b + discriminant_sqrt;
+		const V near_valid = (t_near < t_max) & (t_near > t_min);
+		const V far_valid = (t_far < t_max) & (t_far > t_min);
+
+		const V hit = (discriminant > zero) & (near_valid | far_valid);
+
+		int hit_bits = simd::movemask(hit);
+		if (hit_bits == 0)
+		{
+			continue;
+		}
+
+		const V t = simd::select(near_valid, t_far, t_near);
+		simd::select(hit, t_max, t).store(&packet.t_max[lane]);
+
+		for (int i = 0; hit_bits != 0; ++i, hit_bits >>= 1)
+		{
+			if (hit_bits & 1)
+			{
+				inout_sphere_indices[lane + i] = sphere_index;
+			}
+		}
+	}
+}
+
 struct camera
 {
-	camera(float aspect_ratio) : aspect_ratio(aspect_ratio)
+	camera(float aspect_ratio, const math::vec<3>& eye = { 0, 2, 3 }, const math::vec<3>& at = { 0, 0, 0 }, float fovy = math::pi / 3) :
+		aspect_ratio(aspect_ratio),
+		eye(eye)
 	{
-		const float fovy = math::pi / 3;
 		const float near_plane_distance = 0.1f;
 		const float far_plane_distance = 128.0f;
 
-		math::vec<3> at = { 0, 0, 0 };
-		eye = { 0, 2, 3 };
 		math::vec<3> up = { 0, 1, 0 };
 
 		math::vec<3> forward = math::normalize(eye - at);
@@ -146,6 +380,11 @@ struct material
 	bool is_mirror = false;
 };
 
+inline float luminance(const math::vec<3>& color)
+{
+	return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
 struct point_light
 {
 	math::vec<3> position;
@@ -164,6 +403,17 @@ struct constant_light
 	math::vec<3> radiance;
 };
 
+// What a scene contains that the integrator has to handle. The integrator is compiled once for every
+// combination, so that e.g. a scene without area lights or mirrors does not pay for them.
+enum scene_feature : uint32_t
+{
+	scene_feature_point_lights = 1 << 0,
+	scene_feature_area_lights = 1 << 1,
+	scene_feature_environment = 1 << 2,
+	scene_feature_mirrors = 1 << 3,
+	scene_feature_all = (1 << 4) - 1
+};
+
 struct scene
 {
 	std::vector<point_light> point_lights;
@@ -172,49 +422,288 @@ struct scene
 	std::vector<material> sphere_materials; 
 	constant_light constant_light;
 
-	bool intersect(const ray& ray, intersection* out_intersection) const
+	bvh sphere_bvh;
+
+	// Emitters are indexed with the point lights first, followed by the sphere area lights
+	light_bvh light_hierarchy;
+
+	// The scene_feature bits of what the scene contains, picks the integrator that renders it
+	uint32_t features = scene_feature_all;
+
+	// Must be called again whenever spheres or lights are added or removed, or materials turn into mirrors.
+	void build_acceleration_structure(bvh::layout layout = bvh::layout::standard)
 	{
-		const float k_min_t = 0.001f; // std::numeric_limits<float>::epsilon();
-		const float k_max_t = std::numeric_limits<float>::infinity();
+		sphere_bvh.build(compute_sphere_bounds(), layout);
+		build_light_hierarchy();
+		update_features();
+	}
 
-		bool intersection_found = false;
+	void update_features()
+	{
+		features = 0;
+		if (!point_lights.empty())
+		{
+			features |= scene_feature_point_lights;
+		}
+		if (!sphere_area_lights.empty())
+		{
+			features |= scene_feature_area_lights;
+		}
+		if (has_environment_light())
+		{
+			features |= scene_feature_environment;
+		}
+		if (std::any_of(sphere_materials.begin(), sphere_materials.end(), [](const material& m) { return m.is_mirror; }))
+		{
+			features |= scene_feature_mirrors;
+		}
+	}
+
+	void build_light_hierarchy()
+	{
+		std::vector<light_bvh::emitter> emitters;
+		emitters.reserve(point_lights.size() + sphere_area_lights.size());
+
+		for (const point_light& point_light : point_lights)
+		{
+			light_bvh::emitter emitter;
+			emitter.bounds.grow(point_light.position);
+			emitter.power = 4 * math::pi * luminance(point_light.intensity);
+			emitters.push_back(emitter);
+		}
+
+		for (const sphere_area_light& area_light : sphere_area_lights)
+		{
+			light_bvh::emitter emitter;
+			emitter.bounds.grow(area_light.position - area_light.radius);
+			emitter.bounds.grow(area_light.position + area_light.radius);
+			emitter.power = math::pi * 4 * math::pi * math::square(area_light.radius) * luminance(area_light.intensity);
+			emitters.push_back(emitter);
+		}
+
+		light_hierarchy.build(emitters);
+	}
+
+	// Call after mutating sphere positions or radii. The hierarchy is refitted in place and only
+	// rebuilt from scratch once refitting has made it more than max_degradation times as costly
+	// to traverse as a freshly built one. Large hierarchies refit on the pool when one is given.
+	void update_acceleration_structure(float max_degradation = 1.5f, tf::Taskflow* tf = nullptr)
+	{
+		const std::vector<aabb> sphere_bounds = compute_sphere_bounds();
+
+		if (sphere_bounds.size() != sphere_bvh.primitive_indices().size())
+		{
+			sphere_bvh.build(sphere_bounds, sphere_bvh.node_layout());
+			return;
+		}
+
+		if (sphere_bvh.refit(sphere_bounds, tf) > max_degradation)
+		{
+			sphere_bvh.build(sphere_bounds, sphere_bvh.node_layout());
+		}
+	}
+
+	// What differs between a scene and an edited version of it
+	struct changes
+	{
+		bool geometry = false;
+		bool materials = false;
+		bool lights = false;
+
+		bool any() const { return geometry || materials || lights; }
+	};
+
+	changes compare(const scene& edited) const
+	{
+		auto same_vec = [](const math::vec<3>& a, const math::vec<3>& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+		auto same_spheres = [&](const sphere& a, const sphere& b) { return same_vec(a.position, b.position) && a.radius == b.radius; };
+		auto same_materials = [&](const material& a, const material& b) { return same_vec(a.base_color, b.base_color) && a.is_mirror == b.is_mirror; };
+		auto same_point_lights = [&](const point_light& a, const point_light& b) { return same_vec(a.position, b.position) && same_vec(a.intensity, b.intensity); };
+		auto same_area_lights = [&](const sphere_area_light& a, const sphere_area_light& b) { return same_vec(a.position, b.position) && a.radius == b.radius && same_vec(a.intensity, b.intensity); };
+
+		auto same = [](const auto& a, const auto& b, const auto& equal) { return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), equal); };
+
+		changes result;
+		result.geometry = !same(spheres, edited.spheres, same_spheres);
+		result.materials = !same(sphere_materials, edited.sphere_materials, same_materials);
+		result.lights = !same(point_lights, edited.point_lights, same_point_lights) ||
+			!same(sphere_area_lights, edited.sphere_area_lights, same_area_lights) ||
+			!same_vec(constant_light.radiance, edited.constant_light.radiance);
 
-		float t_closest = k_max_t;
+		return result;
+	}
+
+	// Brings the scene in line with an edited version of it and only updates what differs. Spheres
+	// that moved or changed size refit the hierarchy, adding or removing spheres rebuilds it and the
+	// light hierarchy is only rebuilt when a light changed.
+	changes apply_changes(const scene& edited)
+	{
+		const changes result = compare(edited);
+
+		if (result.geometry)
+		{
+			spheres = edited.spheres;
+			update_acceleration_structure();
+		}
+
+		if (result.materials)
+		{
+			sphere_materials = edited.sphere_materials;
+		}
+
+		if (result.lights)
+		{
+			point_lights = edited.point_lights;
+			sphere_area_lights = edited.sphere_area_lights;
+			constant_light = edited.constant_light;
+			build_light_hierarchy();
+		}
+
+		if (result.materials || result.lights)
+		{
+			update_features();
+		}
+
+		return result;
+	}
 
+	std::vector<aabb> compute_sphere_bounds() const
+	{
+		std::vector<aabb> sphere_bounds(spheres.size());
 		for (size_t i = 0; i < spheres.size(); ++i)
 		{
-			float t;
-			if (intersect_ray_sphere(ray, k_min_t, t_closest, spheres[i], &t))
+			sphere_bounds[i].grow(spheres[i].position - spheres[i].radius);
+			sphere_bounds[i].grow(spheres[i].position + spheres[i].radius);
+		}
+		return sphere_bounds;
+	}
+
+	bool intersect(const ray& ray, intersection* out_intersection) const
+	{
+		return dispatch_isa([&]()
+		{
+			const float k_min_t = 0.001f; // std::numeric_limits<float>::epsilon();
+			const float k_max_t = std::numeric_limits<float>::infinity();
+
+			assert(!sphere_bvh.empty() || spheres.empty());
+
+			bool intersection_found = false;
+
+			float t_closest = k_max_t;
+			uint32_t closest_index = 0;
+
+			sphere_bvh.traverse(ray.origin, ray.direction, &t_closest, [&](uint32_t i)
 			{
-				intersection_found = true;
+				float t;
+				if (intersect_ray_sphere(ray, k_min_t, t_closest, spheres[i], &t))
+				{
+					intersection_found = true;
+					closest_index = i;
+					t_closest = t;
+				}
 
-				out_intersection->position = ray.point_at(t);
-				out_intersection->normal = (out_intersection->position - spheres[i].position) / spheres[i].radius;
-				out_intersection->t = t;
-				out_intersection->material_index = i;
+				return false;
+			});
 
-				t_closest = t;
+			if (intersection_found)
+			{
+				out_intersection->position = ray.point_at(t_closest);
+				out_intersection->normal = surface_normal(out_intersection->position, spheres[closest_index]);
+				out_intersection->t = t_closest;
+				out_intersection->material_index = closest_index;
 			}
-		}
 
-		return intersection_found;
+			return intersection_found;
+		});
 	}
 
-	bool intersect(const ray& ray) const
+	// Finds the closest hit for every active lane of the packet. Returns a bit per lane that hit something.
+	template <int N>
+	uint32_t intersect(ray_packet<N>& packet, intersection out_intersections[N]) const
 	{
-		const float k_min_t = 0.001f; // std::numeric_limits<float>::epsilon();
-		const float k_max_t = std::numeric_limits<float>::infinity();
+		return dispatch_isa_wide([&](auto lanes)
+		{
+			using V = simd::fitting_t<typename decltype(lanes)::type, N>;
 
-		for (size_t i = 0; i < spheres.size(); ++i)
+			assert(!sphere_bvh.empty() || spheres.empty());
+
+			uint32_t sphere_indices[N];
+
+			sphere_bvh.traverse_packet<V>(packet, [&](uint32_t i)
+			{
+				intersect_packet_sphere<V>(packet, spheres[i], i, sphere_indices);
+			});
+
+			uint32_t hit_mask = 0;
+
+			for (int lane = 0; lane < N; ++lane)
+			{
+				if (packet.is_active(lane) && packet.t_max[lane] != std::numeric_limits<float>::infinity())
+				{
+					const float t = packet.t_max[lane];
+					const sphere& sphere = spheres[sphere_indices[lane]];
+
+					intersection& its = out_intersections[lane];
+					its.position = packet.lane_origin(lane) + packet.lane_direction(lane) * t;
+					its.normal = surface_normal(its.position, sphere);
+					its.t = t;
+					its.material_index = sphere_indices[lane];
+
+					hit_mask |= 1u << lane;
+				}
+			}
+
+			return hit_mask;
+		});
+	}
+
+	// Occlusion query, true if any sphere is hit closer than t_max
+	bool intersect(const ray& ray, float t_max = std::numeric_limits<float>::infinity()) const
+	{
+		return dispatch_isa([&]()
+		{
+			const float k_min_t = 0.001f; // std::numeric_limits<float>::epsilon();
+
+			assert(!sphere_bvh.empty() || spheres.empty());
+
+			bool intersection_found = false;
+
+			sphere_bvh.traverse(ray.origin, ray.direction, &t_max, [&](uint32_t i)
+			{
+				float t;
+				intersection_found = intersect_ray_sphere(ray, k_min_t, t_max, spheres[i], &t);
+				return intersection_found;
+			});
+
+			return intersection_found;
+		});
+	}
+
+	// Finds the closest sphere area light closer than t_max. The lights are not part of the geometry and
+	// are only ever hit by rays looking for emitters.
+	bool intersect_area_lights(const ray& ray, float t_max, size_t* out_light_index, float* out_t) const
+	{
+		bool intersection_found = false;
+
+		for (size_t i = 0; i < sphere_area_lights.size(); ++i)
 		{
 			float t;
-			if (intersect_ray_sphere(ray, k_min_t, k_max_t, spheres[i], &t))
+			if (intersect_ray_sphere(ray, 0.0f, t_max, { sphere_area_lights[i].position, sphere_area_lights[i].radius }, &t))
 			{
-				return true;
+				intersection_found = true;
+				*out_light_index = i;
+				*out_t = t;
+				t_max = t;
 			}
 		}
 
-		return false;
+		return intersection_found;
+	}
+
+	bool has_environment_light() const
+	{
+		return constant_light.radiance.r > 0 || constant_light.radiance.g > 0 || constant_light.radiance.b > 0;
 	}
 };
 
@@ -234,9 +723,44 @@ struct normal_renderer
 	}
 };
 
+// PCG32 random number generator, see http://www.pcg-random.org
+struct pcg32
+{
+	void seed(uint64_t initial_state, uint64_t sequence)
+	{
+		state = 0;
+		increment = (sequence << 1) | 1;
+		next();
+		state += initial_state;
+		next();
+	}
+
+	uint32_t next()
+	{
+		const uint64_t old_state = state;
+		state = old_state * 6364136223846793005ull + increment;
+		const uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+		const uint32_t rotation = static_cast<uint32_t>(old_state >> 59);
+		return (xorshifted >> rotation) | (xorshifted << ((~rotation + 1) & 31));
+	}
+
+	uint64_t state = 0x853c49e6748fea9bull;
+	uint64_t increment = 0xda3e39cb94b95bdbull;
+};
+
+// Each render thread draws from its own generator. The renderer reseeds it for every unit of work so
+// that the image does not depend on which thread picks up which work.
+thread_local pcg32 g_random;
+
+void seed_random(uint64_t initial_state, uint64_t sequence)
+{
+	g_random.seed(initial_state, sequence);
+}
+
 float random_01()
 {
-	return rand() / (RAND_MAX + 1.0f);
+	// 24 random bits so that the result is strictly less than one
+	return (g_random.next() >> 8) * (1.0f / 16777216.0f);
 }
 
 math::vec<3> random_point_on_sphere()
@@ -253,9 +777,35 @@ math::vec<3> random_point_on_sphere()
 	return { x, y, z };
 }
 
+// Uniformly distributed direction on the hemisphere around +Z, pdf = 1 / (2 * pi)
 math::vec<3> random_point_on_hemisphere()
 {
-	return { 0, 0, 1 };
+	const float cos_theta = random_01();
+	const float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+	const float phi = 2 * math::pi * random_01();
+
+	return { sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta };
+}
+
+// Cosine weighted direction on the hemisphere around +Z, pdf = cos(theta) / pi
+math::vec<3> random_cosine_weighted_point_on_hemisphere()
+{
+	// Malley's method: project uniformly distributed points on the unit disk up to the hemisphere
+	const float r = std::sqrt(random_01());
+	const float phi = 2 * math::pi * random_01();
+	const float x = r * std::cos(phi);
+	const float y = r * std::sin(phi);
+
+	return { x, y, std::sqrt(std::max(0.0f, 1 - x * x - y * y)) };
+}
+
+// Transforms a direction given relative to +Z into the frame around the normal
+inline math::vec<3> to_world(const math::vec<3>& local_direction, const math::vec<3>& normal)
+{
+	math::vec<3> v, u;
+	math::orthonormal_basis(normal, &v, &u);
+
+	return v * local_direction.x + u * local_direction.y + normal * local_direction.z;
 }
 
 inline math::vec<3> spherical_to_cartesian(float sin_theta, float cos_theta, float phi) 
@@ -263,6 +813,15 @@ inline math::vec<3> spherical_to_cartesian(float sin_theta, float cos_theta, flo
 	return math::vec<3>(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
 }
 
+// Solid angle pdf of random_point_on_visible_sphere, i.e. one over the solid angle subtended by the sphere
+float visible_sphere_pdf(const math::vec<3>& reference_point, const sphere& sphere)
+{
+	const float sin_theta_max2 = math::square(sphere.radius) / math::distance2(sphere.position, reference_point);
+	const float cos_theta_max = std::sqrt(std::max(0.0f, 1 - sin_theta_max2));
+
+	return 1 / (2 * math::pi * (1 - cos_theta_max));
+}
+
 math::vec<3> random_point_on_visible_sphere(const math::vec<3>& reference_point, const sphere& sphere, float* pdf)
 {
 	// https://www.akalin.com/sampling-visible-sphere
@@ -270,179 +829,1220 @@ math::vec<3> random_point_on_visible_sphere(const math::vec<3>& reference_point,
 	const float distance_to_sphere_center = math::distance(sphere.position, reference_point);
 	const math::vec<3> direction_to_sphere = (sphere.position - reference_point) / distance_to_sphere_center;
 
-	const float theta_max = asin(sphere.radius / distance_to_sphere_center);
+	const float sin_theta_max = sphere.radius / distance_to_sphere_center;
+	const float sin_theta_max2 = sin_theta_max * sin_theta_max;
+	const float cos_theta_max = std::sqrt(std::max(0.0f, 1 - sin_theta_max2));
 
-	const float theta = random_01() * theta_max;
+	// Uniform in solid angle over the cone subtended by the sphere
+	const float cos_theta = 1 - random_01() * (1 - cos_theta_max);
 	const float phi = random_01() * 2 * math::pi;
 
 	// Theta is the angle between the sample point on the sphere and the center of the sphere when measured from the reference point
-	const float sin_theta = sin(theta);
-	const float sin_theta2 = sin_theta * sin_theta;
-	const float sin_theta_max = sin(theta_max);
-	const float sin_theta_max2 = sin_theta_max * sin_theta_max;
+	const float sin_theta2 = std::max(0.0f, 1 - cos_theta * cos_theta);
 
 	// Alpha is the angle between the sample point and the reference point when measure from the center of the sphere
-	const float cos_alpha = sin_theta2 / sin_theta_max + cos(theta) * sqrt(1 - sin_theta2 / sin_theta_max2);
+	const float cos_alpha = sin_theta2 / sin_theta_max + cos_theta * std::sqrt(std::max(0.0f, 1 - sin_theta2 / sin_theta_max2));
 	const float sin_alpha = std::sqrt(std::max(0.0f, 1.0f - cos_alpha * cos_alpha));
 
-	// A point on the sphere as if observing from along the positive Z direction
+	// A point on the sphere as if observing from along the positive Z direction, i.e. on the hemisphere facing the reference point
 	math::vec<3> point_on_sphere_os = math::vec<3>(sin_alpha * std::cos(phi), sin_alpha * std::sin(phi), cos_alpha) * sphere.radius;
 
 	math::vec<3> v, u;
 	math::orthonormal_basis(direction_to_sphere, &v, &u);
 
-	*pdf = 1 / (2 * math::pi * (1 - std::cos(theta_max)));
+	*pdf = 1 / (2 * math::pi * (1 - cos_theta_max));
+
+	return sphere.position + v * point_on_sphere_os.x + u * point_on_sphere_os.y - direction_to_sphere * point_on_sphere_os.z;
+}
+
+// Weight for combining two sampling strategies with multiple importance sampling, one sample each
+inline float power_heuristic(float pdf, float other_pdf)
+{
+	const float pdf2 = pdf * pdf;
+	const float other_pdf2 = other_pdf * other_pdf;
 
-	return sphere.position + v * point_on_sphere_os.x + u * point_on_sphere_os.y + direction_to_sphere * point_on_sphere_os.z;
+	return (pdf2 + other_pdf2 > 0) ? pdf2 / (pdf2 + other_pdf2) : 0.0f;
 }
 
+// Renders scenes with the given scene_feature bits, the branches and loops for everything else are
+// compiled out. Use with_whitted_renderer to pick the one that matches a scene.
+template <uint32_t Features>
 struct whitted_renderer
 {
+	static constexpr bool has_point_lights = (Features & scene_feature_point_lights) != 0;
+	static constexpr bool has_area_lights = (Features & scene_feature_area_lights) != 0;
+	static constexpr bool has_environment = (Features & scene_feature_environment) != 0;
+	static constexpr bool has_mirrors = (Features & scene_feature_mirrors) != 0;
+
 	math::vec<3> radiance(const scene& scene, const ray& incident_ray, unsigned* inout_ray_count)
 	{
 		++(*inout_ray_count);
 
-		math::vec<3> L = { 0 };
-
 		intersection its;
 		if (scene.intersect(incident_ray, &its))
 		{
-			if (scene.sphere_materials[its.material_index].is_mirror)
+			if (has_mirrors && scene.sphere_materials[its.material_index].is_mirror)
 			{
+				math::vec<3> L = { 0 };
+
 				if (++_depth < _depth_max)
 				{
 					const math::vec<3> reflection_direction = math::reflect(incident_ray.direction, its.normal);
 					const math::vec<3> f = scene.sphere_materials[its.material_index].base_color;
 					L += f * radiance(scene, { its.position, reflection_direction }, inout_ray_count);
 				}
+
+				return L;
 			}
-			else
-			{
-				for (const point_light& point_light : scene.point_lights)
-				{
-					const float distance_to_light = math::distance(point_light.position, its.position);
-					const math::vec<3> direction_to_light = (point_light.position - its.position) / distance_to_light;
 
-					++(*inout_ray_count);
+			return shade_diffuse(scene, its, inout_ray_count);
+		}
 
-					if (!scene.intersect({ its.position, direction_to_light }))
-					{
-						const math::vec<3> f = scene.sphere_materials[its.material_index].base_color / math::pi; // lambert
-						const float n_dot_l = std::max(0.0f, math::dot(its.normal, direction_to_light));
-						const float attentuation = 1 / (distance_to_light * distance_to_light);
-						L += f * n_dot_l * point_light.intensity * attentuation;
-					}
-				}
+		return scene.constant_light.radiance;
+	}
 
-				for (const sphere_area_light& area_light : scene.sphere_area_lights)
-				{
-					const int light_samples = 32;
-					for (int i = 0; i < light_samples; ++i)
-					{
-						float pdf = 0.0f;
-						const math::vec<3> point_on_sphere = random_point_on_visible_sphere(its.position, { area_light.position, area_light.radius }, &pdf);
+	// Packet version of radiance for coherent rays, writes the radiance of every active lane to out_L.
+	// Rays reflected off mirrors are traced as packets again when the mirror is flat enough across the
+	// packet to keep the reflected rays coherent, otherwise they continue as individual rays. When
+	// out_features is given it receives the surface attributes of each lane's first hit for the denoiser.
+	// When out_costs is given the work of tracing is added to the lane that caused it, work shared by
+	// several lanes like the traversal of a packet is split evenly between them.
+	template <int N>
+	void radiance(const scene& scene, ray_packet<N>& packet, math::vec<3> out_L[N], unsigned* inout_ray_count, surface_features out_features[N] = nullptr, pixel_cost out_costs[N] = nullptr)
+	{
+		work_reading reading = {};
+		if (out_costs)
+		{
+			reading = work_reading::take(*inout_ray_count);
+		}
 
-						const float distance_to_light = math::distance(point_on_sphere, its.position);
-						const math::vec<3> direction_to_light = (point_on_sphere - its.position) / distance_to_light;
+		auto charge = [&](uint32_t lane_mask)
+		{
+			if (!out_costs)
+			{
+				return;
+			}
 
-						++(*inout_ray_count);
+			int lane_count = 0;
+			for (int lane = 0; lane < N; ++lane)
+			{
+				lane_count += (lane_mask >> lane) & 1;
+			}
 
-						if (!scene.intersect({ its.position, direction_to_light }))
-						{
-							const math::vec<3> f = scene.sphere_materials[its.material_index].base_color / math::pi; // lambert
-							const float n_dot_l = std::max(0.0f, math::dot(its.normal, direction_to_light));
-							const float attentuation = 1 / (distance_to_light * distance_to_light);
-							L += f * n_dot_l * (area_light.intensity / pdf) * (1.0f / light_samples);
-						}
-					}
+			const work_reading now = work_reading::take(*inout_ray_count);
+			for (int lane = 0; lane < N; ++lane)
+			{
+				if (lane_mask & (1u << lane))
+				{
+					out_costs[lane].add(reading, now, 1.0f / lane_count);
+				}
+			}
+			reading = now;
+		};
+
+		intersection its[N];
+		const uint32_t hit_mask = scene.intersect(packet, its);
+
+		charge(packet.active_mask);
+
+		if (out_features)
+		{
+			for (int lane = 0; lane < N; ++lane)
+			{
+				if (hit_mask & (1u << lane))
+				{
+					out_features[lane].albedo = scene.sphere_materials[its[lane].material_index].base_color;
+					out_features[lane].normal = its[lane].normal;
+					out_features[lane].depth = its[lane].t;
+				}
+				else
+				{
+					out_features[lane] = {};
+				}
+			}
+		}
+
+		uint32_t mirror_mask = 0;
+
+		for (int lane = 0; lane < N; ++lane)
+		{
+			if (!packet.is_active(lane))
+			{
+				continue;
+			}
+
+			++(*inout_ray_count);
+
+			if (!(hit_mask & (1u << lane)))
+			{
+				out_L[lane] = scene.constant_light.radiance;
+			}
+			else if (has_mirrors && scene.sphere_materials[its[lane].material_index].is_mirror)
+			{
+				out_L[lane] = { 0 };
+				mirror_mask |= 1u << lane;
+			}
+			else
+			{
+				out_L[lane] = shade_diffuse(scene, its[lane], inout_ray_count);
+			}
+
+			charge(1u << lane);
+		}
+
+		if (!has_mirrors || mirror_mask == 0 || _depth + 1 >= _depth_max)
+		{
+			return;
+		}
+
+		whitted_renderer reflection_renderer = *this;
+		++reflection_renderer._depth;
+
+		if (is_flat(its, mirror_mask, N))
+		{
+			// Gather the reflected rays into packets of eight
+			const int reflection_packet_size = 8;
+
+			int lanes[reflection_packet_size];
+			int lane_count = 0;
+
+			for (int lane = 0; lane < N; ++lane)
+			{
+				if (mirror_mask & (1u << lane))
+				{
+					lanes[lane_count++] = lane;
 				}
 
-				// constant environment light
+				if (lane_count == reflection_packet_size || (lane_count > 0 && lane == N - 1))
 				{
-					const int light_samples = 32;
-					for (int i = 0; i < light_samples; ++i)
+					ray_packet<reflection_packet_size> reflection_packet;
+					for (int i = 0; i < lane_count; ++i)
 					{
-						const math::vec<3> direction_to_light = random_point_on_sphere();
-
-						++(*inout_ray_count);
-
-						if (!scene.intersect({ its.position, direction_to_light }))
-						{
-							const math::vec<3> f = scene.sphere_materials[its.material_index].base_color / math::pi; // lambert
-							const float n_dot_l = std::max(0.0f, math::dot(its.normal, direction_to_light));
-							// http://corysimon.github.io/articles/uniformdistn-on-sphere/
-							const float sphere_pdf = 1 / (4 * math::pi);
-							L += f * n_dot_l * (scene.constant_light.radiance / sphere_pdf) * (1.0f / light_samples);
-						}
+						reflection_packet.set(i, its[lanes[i]].position, math::reflect(packet.lane_direction(lanes[i]), its[lanes[i]].normal));
 					}
+					reflection_packet.finalize();
+
+					math::vec<3> reflected_L[reflection_packet_size];
+					reflection_renderer.radiance(scene, reflection_packet, reflected_L, inout_ray_count);
+
+					uint32_t reflection_mask = 0;
+					for (int i = 0; i < lane_count; ++i)
+					{
+						out_L[lanes[i]] = scene.sphere_materials[its[lanes[i]].material_index].base_color * reflected_L[i];
+						reflection_mask |= 1u << lanes[i];
+					}
+
+					charge(reflection_mask);
+
+					lane_count = 0;
 				}
 			}
 		}
 		else
 		{
-			L += scene.constant_light.radiance;
+			for (int lane = 0; lane < N; ++lane)
+			{
+				if (mirror_mask & (1u << lane))
+				{
+					whitted_renderer lane_renderer = reflection_renderer;
+					const math::vec<3> reflection_direction = math::reflect(packet.lane_direction(lane), its[lane].normal);
+					const math::vec<3> f = scene.sphere_materials[its[lane].material_index].base_color;
+					out_L[lane] = f * lane_renderer.radiance(scene, { its[lane].position, reflection_direction }, inout_ray_count);
+
+					charge(1u << lane);
+				}
+			}
+		}
+	}
+
+	math::vec<3> shade_diffuse(const scene& scene, const intersection& its, unsigned* inout_ray_count)
+	{
+		const math::vec<3> f = scene.sphere_materials[its.material_index].base_color / math::pi; // lambert
+
+		math::vec<3> L = { 0 };
+
+		// Point and sphere area lights are picked from the light hierarchy in proportion to their estimated
+		// contribution, the environment is picked separately. Area lights and the environment are then
+		// estimated with one light sample and one BSDF sample, combined with multiple importance sampling.
+		const bool has_emitters = has_point_lights || has_area_lights;
+		if (!has_emitters && !has_environment)
+		{
+			return L;
+		}
+
+		const float environment_selection_pdf = has_environment ? (has_emitters ? 0.5f : 1.0f) : 0.0f;
+		const float environment_pdf = 1 / (2 * math::pi); // uniform over the hemisphere above the surface
+		const uint32_t point_light_count = static_cast<uint32_t>(scene.point_lights.size());
+
+		// light sample
+		{
+			math::vec<3> direction_to_light;
+			float distance_to_light;
+			float light_pdf = 0.0f;
+			math::vec<3> Le;
+			bool is_delta_light = false;
+			int area_light_index = -1;
+
+			uint32_t emitter;
+			float emitter_pdf;
+
+			if (random_01() < environment_selection_pdf)
+			{
+				direction_to_light = to_world(random_point_on_hemisphere(), its.normal);
+				distance_to_light = std::numeric_limits<float>::infinity();
+				light_pdf = environment_selection_pdf * environment_pdf;
+				Le = scene.constant_light.radiance;
+			}
+			else if (scene.light_hierarchy.sample(its.position, its.normal, random_01(), &emitter, &emitter_pdf))
+			{
+				const float selection_pdf = (1 - environment_selection_pdf) * emitter_pdf;
+
+				if (!has_area_lights || (has_point_lights && emitter < point_light_count))
+				{
+					const point_light& point_light = scene.point_lights[emitter];
+
+					distance_to_light = math::distance(point_light.position, its.position);
+					direction_to_light = (point_light.position - its.position) / distance_to_light;
+					light_pdf = selection_pdf;
+					Le = point_light.intensity / (distance_to_light * distance_to_light);
+					is_delta_light = true;
+				}
+				else
+				{
+					area_light_index = emitter - point_light_count;
+
+					const sphere_area_light& area_light = scene.sphere_area_lights[area_light_index];
+
+					float pdf;
+					const math::vec<3> point_on_sphere = random_point_on_visible_sphere(its.position, { area_light.position, area_light.radius }, &pdf);
+
+					distance_to_light = math::distance(point_on_sphere, its.position);
+					direction_to_light = (point_on_sphere - its.position) / distance_to_light;
+					light_pdf = selection_pdf * pdf;
+					Le = area_light.intensity;
+				}
+			}
+
+			const float n_dot_l = (light_pdf > 0) ? math::dot(its.normal, direction_to_light) : 0.0f;
+
+			if (n_dot_l > 0)
+			{
+				++(*inout_ray_count);
+
+				const ray shadow_ray = { its.position, direction_to_light };
+
+				// Emitters block each other as well, consistent with what the BSDF sample sees
+				size_t blocking_light_index;
+				float t_blocking_light;
+				const bool is_blocked_by_light =
+					has_area_lights && !is_delta_light &&
+					scene.intersect_area_lights(shadow_ray, distance_to_light, &blocking_light_index, &t_blocking_light) &&
+					static_cast<int>(blocking_light_index) != area_light_index;
+
+				if (!is_blocked_by_light && !scene.intersect(shadow_ray, distance_to_light))
+				{
+					// Delta lights cannot be hit by the BSDF sample so they get the full weight
+					const float bsdf_pdf = n_dot_l / math::pi;
+					const float weight = is_delta_light ? 1.0f : power_heuristic(light_pdf, bsdf_pdf);
+					L += f * Le * n_dot_l * (weight / light_pdf);
+				}
+			}
+		}
+
+		// BSDF sample, only useful if there is something it can hit
+		if (has_area_lights || has_environment)
+		{
+			const math::vec<3> direction = to_world(random_cosine_weighted_point_on_hemisphere(), its.normal);
+			const float n_dot_l = math::dot(its.normal, direction);
+
+			if (n_dot_l > 0)
+			{
+				++(*inout_ray_count);
+
+				const ray bsdf_ray = { its.position, direction };
+
+				intersection occluder;
+				const float t_occluder = scene.intersect(bsdf_ray, &occluder) ? occluder.t : std::numeric_limits<float>::infinity();
+
+				size_t area_light_index;
+				float t_light;
+
+				float light_pdf = 0.0f;
+				math::vec<3> Le = { 0 };
+
+				if (has_area_lights && scene.intersect_area_lights(bsdf_ray, t_occluder, &area_light_index, &t_light))
+				{
+					const sphere_area_light& area_light = scene.sphere_area_lights[area_light_index];
+					const float emitter_pdf = scene.light_hierarchy.pdf(point_light_count + static_cast<uint32_t>(area_light_index), its.position, its.normal);
+					light_pdf = (1 - environment_selection_pdf) * emitter_pdf * visible_sphere_pdf(its.position, { area_light.position, area_light.radius });
+					Le = area_light.intensity;
+				}
+				else if (t_occluder == std::numeric_limits<float>::infinity() && has_environment)
+				{
+					light_pdf = environment_selection_pdf * environment_pdf;
+					Le = scene.constant_light.radiance;
+				}
+
+				// f * cos / pdf reduces to the reflectance for cosine weighted sampling
+				const float bsdf_pdf = n_dot_l / math::pi;
+				L += f * Le * n_dot_l * (power_heuristic(bsdf_pdf, light_pdf) / bsdf_pdf);
+			}
 		}
 
 		return L;
 	}
 
+	// Whether the surface normals at the selected hits are close enough for reflected rays to stay coherent
+	static bool is_flat(const intersection its[], uint32_t mask, int count)
+	{
+		const float min_cos_angle = 0.95f;
+
+		int reference = -1;
+
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (!(mask & (1u << lane)))
+			{
+				continue;
+			}
+
+			if (reference < 0)
+			{
+				reference = lane;
+			}
+			else if (math::dot(its[lane].normal, its[reference].normal) < min_cos_angle)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
 	int _depth_max = 2;
 	int _depth = 0;
 };
 
-void render(const scene& scene, image* image, unsigned* inout_ray_count)
+namespace detail
 {
-	camera camera(static_cast<float>(image->width) / image->height);
+	template <uint32_t Features, typename F>
+	void with_whitted_renderer(uint32_t features, F& f)
+	{
+		if constexpr (Features == 0)
+		{
+			f(whitted_renderer<0>());
+		}
+		else if (features == Features)
+		{
+			f(whitted_renderer<Features>());
+		}
+		else
+		{
+			with_whitted_renderer<Features - 1>(features, f);
+		}
+	}
+}
 
-	const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
-	tf::Taskflow tf(num_threads);
+// Calls f with the whitted_renderer compiled for the scene_feature bits in features
+template <typename F>
+void with_whitted_renderer(uint32_t features, F&& f)
+{
+	detail::with_whitted_renderer<scene_feature_all>(features & scene_feature_all, f);
+}
+
+void accumulation_buffer::add_sample(int x, int y, const math::vec<3>& radiance)
+{
+	pixel& p = data[width * y + x];
+	const float l = luminance(radiance);
+	p.sum += radiance;
+	p.luminance_sum += l;
+	p.luminance_sum2 += l * l;
+	++p.sample_count;
+}
+
+// Stops a render from another thread, or once a deadline has passed. Tiles check it between samples,
+// so the threads are released within about one sample of a tile after the token fires.
+class cancellation_token
+{
+public:
+	void cancel() { _cancelled.store(true, std::memory_order_relaxed); }
+
+	// Clears the cancellation and the deadline so that the token can be used for the next render
+	void reset()
+	{
+		_cancelled.store(false, std::memory_order_relaxed);
+		_deadline.store(no_deadline, std::memory_order_relaxed);
+	}
+
+	void set_deadline(std::chrono::steady_clock::time_point deadline)
+	{
+		_deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+	}
 
+	void set_time_limit(double seconds)
+	{
+		set_deadline(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds)));
+	}
+
+	bool is_cancelled() const
+	{
+		if (_cancelled.load(std::memory_order_relaxed))
+		{
+			return true;
+		}
+
+		const std::chrono::steady_clock::rep deadline = _deadline.load(std::memory_order_relaxed);
+		return deadline != no_deadline && std::chrono::steady_clock::now().time_since_epoch().count() >= deadline;
+	}
+
+private:
+	static constexpr std::chrono::steady_clock::rep no_deadline = std::numeric_limits<std::chrono::steady_clock::rep>::max();
+
+	std::atomic<bool> _cancelled = { false };
+	std::atomic<std::chrono::steady_clock::rep> _deadline = { no_deadline };
+};
+
+struct render_settings
+{
+	int min_samples_per_pixel = 4;
+	int max_samples_per_pixel = 64;
+	int samples_per_pass = 4;
+
+	// Pixels stop receiving samples once the standard error of their mean drops below this fraction of the mean
+	float max_relative_error = 0.02f;
+
+	// Set the number of iterations to zero to skip denoising
+	denoise_settings denoise;
+
+	// Ordered dithering when quantizing to 8 bits hides banding in smooth gradients
+	bool dither = true;
+
+	// When a checkpoint file is given the render state is saved to it in the background whenever a pass
+	// completes and the interval has passed. With resume set a render continues from the file if it
+	// exists and was written for the same scene, camera, image size and sampling settings.
+	struct
+	{
+		std::string filepath;
+		double interval_seconds = 60.0;
+		bool resume = false;
+	} checkpoint;
+
+	// When set, the render stops early once the token is cancelled or its deadline passes
+	const cancellation_token* cancel = nullptr;
+
+	// When set, the work spent on each pixel is added to the buffer, which must match the image size.
+	// Measuring slows the render down a little, and a resumed render only counts the passes it renders.
+	cost_buffer* costs = nullptr;
+
+	bool cancelled() const { return cancel && cancel->is_cancelled(); }
+};
+
+// The state of a render between two passes. The random numbers of a tile only depend on the tile and
+// the pass, so continuing from a checkpoint gives bit identical results to an uninterrupted render.
+struct render_checkpoint
+{
+	static constexpr uint32_t magic = 0x504b4350; // "PCKP"
+	static constexpr uint32_t version = 1;
+
+	// Identifies what the checkpoint was rendered from: the scene, the camera, the image size and the
+	// sampling settings. A checkpoint of any other render is not resumed.
+	static uint64_t fingerprint(const scene& scene, const camera& camera, const render_settings& settings, int width, int height)
+	{
+		// FNV-1a over the values that change the accumulated samples
+		uint64_t hash = 0xcbf29ce484222325ull;
+		auto mix = [&hash](const void* data, size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 0x100000001b3ull;
+			}
+		};
+
+		mix(&width, sizeof(width));
+		mix(&height, sizeof(height));
+		mix(&settings.min_samples_per_pixel, sizeof(settings.min_samples_per_pixel));
+		mix(&settings.max_samples_per_pixel, sizeof(settings.max_samples_per_pixel));
+		mix(&settings.samples_per_pass, sizeof(settings.samples_per_pass));
+		mix(&settings.max_relative_error, sizeof(settings.max_relative_error));
+
+		mix(&camera.eye, sizeof(camera.eye));
+		mix(&camera.view_proj, sizeof(camera.view_proj));
+
+		// Field by field, the structs may contain padding
+		for (const sphere& s : scene.spheres)
+		{
+			mix(&s.position, sizeof(s.position));
+			mix(&s.radius, sizeof(s.radius));
+		}
+		for (const material& m : scene.sphere_materials)
+		{
+			mix(&m.base_color, sizeof(m.base_color));
+			mix(&m.is_mirror, sizeof(m.is_mirror));
+		}
+		for (const point_light& light : scene.point_lights)
+		{
+			mix(&light.position, sizeof(light.position));
+			mix(&light.intensity, sizeof(light.intensity));
+		}
+		for (const sphere_area_light& light : scene.sphere_area_lights)
+		{
+			mix(&light.position, sizeof(light.position));
+			mix(&light.radius, sizeof(light.radius));
+			mix(&light.intensity, sizeof(light.intensity));
+		}
+		mix(&scene.constant_light.radiance, sizeof(scene.constant_light.radiance));
+
+		// The counts keep e.g. a sphere moving to the lights from hashing the same bytes
+		const uint64_t counts[4] = { scene.spheres.size(), scene.sphere_materials.size(), scene.point_lights.size(), scene.sphere_area_lights.size() };
+		mix(counts, sizeof(counts));
+
+		return hash;
+	}
+
+	bool save(const char* filepath) const
+	{
+		// Write to a temporary file first so that a preempted write never replaces a good checkpoint
+		const std::string temporary_filepath = std::string(filepath) + ".tmp";
+
+		{
+			std::ofstream file(temporary_filepath, std::ios::binary | std::ios::trunc);
+			if (!file)
+			{
+				return false;
+			}
+
+			const uint32_t header[2] = { magic, version };
+			file.write(reinterpret_cast<const char*>(header), sizeof(header));
+			file.write(reinterpret_cast<const char*>(&render_fingerprint), sizeof(render_fingerprint));
+			file.write(reinterpret_cast<const char*>(&next_pass), sizeof(next_pass));
+
+			write_vector(file, pixels);
+			for (const std::vector<float>& plane : features)
+			{
+				write_vector(file, plane);
+			}
+			write_vector(file, tile_converged);
+			write_vector(file, statistics);
+
+			if (!file)
+			{
+				return false;
+			}
+		}
+
+		// Replace the previous checkpoint in one step, removing it first would leave no checkpoint
+		// behind if the process is stopped in between
+#ifdef _WIN32
+		return MoveFileExA(temporary_filepath.c_str(), filepath, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		std::error_code error;
+		std::filesystem::rename(temporary_filepath, filepath, error);
+		return !error;
+#endif
+	}
+
+	bool load(const char* filepath)
+	{
+		std::ifstream file(filepath, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+
+		uint32_t header[2];
+		file.read(reinterpret_cast<char*>(header), sizeof(header));
+		if (!file || header[0] != magic || header[1] != version)
+		{
+			return false;
+		}
+
+		file.read(reinterpret_cast<char*>(&render_fingerprint), sizeof(render_fingerprint));
+		file.read(reinterpret_cast<char*>(&next_pass), sizeof(next_pass));
+
+		bool valid = read_vector(file, &pixels);
+		for (std::vector<float>& plane : features)
+		{
+			valid = valid && read_vector(file, &plane);
+		}
+		valid = valid && read_vector(file, &tile_converged);
+		valid = valid && read_vector(file, &statistics);
+
+		return valid && static_cast<bool>(file);
+	}
+
+	uint64_t render_fingerprint = 0;
+	int32_t next_pass = 0;
+
+	std::vector<accumulation_buffer::pixel> pixels;
+	std::vector<float> features[7]; // albedo, normal and depth planes
+	std::vector<uint8_t> tile_converged;
 	std::vector<unsigned> statistics;
-	statistics.resize(image->height);
 
-	for (int y = 0; y < image->height; ++y)
+private:
+	template <typename T>
+	static void write_vector(std::ofstream& file, const std::vector<T>& values)
 	{
-		unsigned& ray_count = statistics[y];
+		const uint64_t count = values.size();
+		file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		file.write(reinterpret_cast<const char*>(values.data()), count * sizeof(T));
+	}
 
-		tf::Taskflow::Task task = tf.silent_emplace([camera, scene, image, y, &ray_count]()
+	template <typename T>
+	static bool read_vector(std::ifstream& file, std::vector<T>* values)
+	{
+		uint64_t count = 0;
+		file.read(reinterpret_cast<char*>(&count), sizeof(count));
+		if (!file || count > (uint64_t(1) << 32))
 		{
-			for (int x = 0; x < image->width; ++x)
+			return false;
+		}
+
+		values->resize(static_cast<size_t>(count));
+		file.read(reinterpret_cast<char*>(values->data()), count * sizeof(T));
+		return static_cast<bool>(file);
+	}
+};
+
+// Camera rays of neighbouring pixels are coherent, rows of a tile are traced as one packet
+constexpr int render_tile_size = 16;
+
+// Receives the linear radiance of every tile once it is final. Called from the render threads.
+using tile_callback = std::function<void(const image_tile&)>;
+
+struct tile_bounds
+{
+	int x_begin, y_begin;
+	int x_end, y_end;
+};
+
+inline int tile_count_x(int width) { return (width + render_tile_size - 1) / render_tile_size; }
+
+inline int tile_count_y(int height) { return (height + render_tile_size - 1) / render_tile_size; }
+
+inline tile_bounds get_tile_bounds(int tile_index, int width, int height)
+{
+	const int x_begin = (tile_index % tile_count_x(width)) * render_tile_size;
+	const int y_begin = (tile_index / tile_count_x(width)) * render_tile_size;
+	return { x_begin, y_begin, std::min(x_begin + render_tile_size, width), std::min(y_begin + render_tile_size, height) };
+}
+
+// Distance of cell (x, y) along the Hilbert curve that fills an n by n grid, n a power of two
+inline uint32_t hilbert_index(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for (uint32_t s = n / 2; s > 0; s /= 2)
+	{
+		const uint32_t rx = (x & s) ? 1 : 0;
+		const uint32_t ry = (y & s) ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant so that the curve inside it starts and ends next to its neighbours
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+// The order tiles are dispatched in. Consecutive tiles along a Hilbert curve are mostly adjacent, so
+// the threads that pick up the next tiles work on neighbouring parts of the image at the same time and
+// share the BVH nodes and geometry in the cache instead of evicting each other's. The curve covers the
+// smallest power of two square around the tile grid, where it leaves the grid the next tile in range
+// may be further away.
+inline std::vector<int> tile_dispatch_order(int width, int height)
+{
+	const int tiles_x = tile_count_x(width);
+	const int tiles_y = tile_count_y(height);
+
+	uint32_t n = 1;
+	while (n < static_cast<uint32_t>(std::max(tiles_x, tiles_y)))
+	{
+		n *= 2;
+	}
+
+	std::vector<std::pair<uint32_t, int>> keyed(tiles_x * tiles_y);
+	for (int tile_index = 0; tile_index < tiles_x * tiles_y; ++tile_index)
+	{
+		keyed[tile_index] = { hilbert_index(n, tile_index % tiles_x, tile_index / tiles_x), tile_index };
+	}
+
+	std::sort(keyed.begin(), keyed.end());
+
+	std::vector<int> order(keyed.size());
+	for (size_t i = 0; i < keyed.size(); ++i)
+	{
+		order[i] = keyed[i].second;
+	}
+	return order;
+}
+
+inline int max_render_passes(const render_settings& settings)
+{
+	return 1 + (settings.max_samples_per_pixel - settings.min_samples_per_pixel + settings.samples_per_pass - 1) / settings.samples_per_pass;
+}
+
+// Adds one pass of samples to the pixels of a tile whose estimated error is still above the threshold.
+// Returns true once no pixel of the tile needs more samples. The random numbers only depend on the tile
+// and the pass, so a tile comes out the same no matter which thread or process renders it.
+bool render_tile_pass(const scene& scene, const camera& camera, const render_settings& settings, int tile_index, int pass,
+	accumulation_buffer* accumulation, feature_buffer* features, unsigned* inout_ray_count)
+{
+	const int tile_size = render_tile_size;
+	const int width = accumulation->width;
+	const int height = accumulation->height;
+	const tile_bounds bounds = get_tile_bounds(tile_index, width, height);
+
+	const int pass_samples = (pass == 0) ? settings.min_samples_per_pixel : settings.samples_per_pass;
+
+	seed_random(tile_index, pass);
+
+	bool any_pixel_active = false;
+
+	for (int y = bounds.y_begin; y < bounds.y_end; ++y)
+	{
+		auto is_pixel_active = [&](int x)
+		{
+			const accumulation_buffer::pixel& p = accumulation->data[width * y + x];
+			return p.sample_count < static_cast<uint32_t>(settings.max_samples_per_pixel) &&
+				(pass == 0 || p.relative_error() > settings.max_relative_error);
+		};
+
+		for (int sample = 0; sample < pass_samples; ++sample)
+		{
+			ray_packet<tile_size> packet;
+			for (int x = bounds.x_begin; x < bounds.x_end; ++x)
 			{
-				//static const int bounds[4] = { 518, 519, 202, 203 };
+				if (is_pixel_active(x))
+				{
+					const ray ray = camera.create_ray(
+						(x + random_01()) / width,
+						(y + random_01()) / height);
 
-				//if (!(x >= (image->width - bounds[1]) && x < (image->width - bounds[0]) && (image->height - y) >= bounds[2] && (image->height - y) < bounds[3]))
-				//{
-				//		static int i = 0; 
-				//		++i;
-				//		continue;
-				//}
+					packet.set(x - bounds.x_begin, ray.origin, ray.direction);
+				}
+			}
 
-				const ray ray = camera.create_ray(
-					static_cast<float>(x) / image->width,
-					static_cast<float>(y) / image->height);
+			if (packet.active_mask == 0 || settings.cancelled())
+			{
+				break;
+			}
 
-				whitted_renderer renderer;
+			packet.finalize();
 
-				math::vec<3> color = renderer.radiance(scene, ray, &ray_count);
+			// Every pixel is active during the first pass, which is where the feature buffers are filled
+			math::vec<3> colors[tile_size];
+			surface_features pixel_features[tile_size];
+			pixel_cost pixel_costs[tile_size];
+			with_whitted_renderer(scene.features, [&](auto renderer)
+			{
+				renderer.radiance(scene, packet, colors, inout_ray_count, (pass == 0) ? pixel_features : nullptr, settings.costs ? pixel_costs : nullptr);
+			});
 
-				color = linear_to_srgb(color);
+			for (int x = bounds.x_begin; x < bounds.x_end; ++x)
+			{
+				if (packet.is_active(x - bounds.x_begin))
+				{
+					accumulation->add_sample(x, y, colors[x - bounds.x_begin]);
 
-				color = math::saturate(color);
+					if (pass == 0)
+					{
+						features->add_sample(x, y, pixel_features[x - bounds.x_begin]);
+					}
 
-				image->data[image->width * y + x] = {
-					static_cast<uint8_t>(255.0f * color.z),
-					static_cast<uint8_t>(255.0f * color.y),
-					static_cast<uint8_t>(255.0f * color.x),
-				};
+					if (settings.costs)
+					{
+						settings.costs->add(x, y, pixel_costs[x - bounds.x_begin]);
+					}
+				}
+			}
+		}
+
+		for (int x = bounds.x_begin; x < bounds.x_end; ++x)
+		{
+			any_pixel_active |= is_pixel_active(x);
+		}
+	}
+
+	return !any_pixel_active;
+}
+
+// Hands the accumulated radiance of a tile to on_tile_finished
+void hand_over_tile(const accumulation_buffer& accumulation, int tile_index, const tile_callback& on_tile_finished)
+{
+	const int tile_size = render_tile_size;
+	const tile_bounds bounds = get_tile_bounds(tile_index, accumulation.width, accumulation.height);
+
+	float tile_radiance[3][tile_size * tile_size];
+	for (int y = bounds.y_begin; y < bounds.y_end; ++y)
+	{
+		for (int x = bounds.x_begin; x < bounds.x_end; ++x)
+		{
+			const math::vec<3> mean = accumulation.data[accumulation.width * y + x].mean();
+			for (int c = 0; c < 3; ++c)
+			{
+				tile_radiance[c][tile_size * (y - bounds.y_begin) + (x - bounds.x_begin)] = mean[c];
+			}
+		}
+	}
+
+	on_tile_finished({ bounds.x_begin, bounds.y_begin, bounds.x_end - bounds.x_begin, bounds.y_end - bounds.y_begin,
+		{ tile_radiance[0], tile_radiance[1], tile_radiance[2] }, tile_size });
+}
+
+// Turns the accumulated samples into the final image. Denoises the radiance if enabled, in which case
+// the tiles are handed to on_tile_finished afterwards, and converts the result to 8 bit sRGB.
+void resolve_image(const accumulation_buffer& accumulation, feature_buffer* features, const render_settings& settings, image* image, tf::Taskflow& tf, const tile_callback& on_tile_finished)
+{
+	planar_image<3> radiance(image->width, image->height);
+	std::vector<float> luminance_variance(image->width * image->height);
+
+	for (int i = 0; i < image->width * image->height; ++i)
+	{
+		const accumulation_buffer::pixel& p = accumulation.data[i];
+		const math::vec<3> mean = p.mean();
+		for (int c = 0; c < 3; ++c)
+		{
+			radiance.planes[c][i] = mean[c];
+		}
+
+		const float relative_error = p.relative_error();
+		const float standard_error = (relative_error == std::numeric_limits<float>::infinity()) ? 0.0f : relative_error * std::max(luminance(mean), 0.01f);
+		luminance_variance[i] = standard_error * standard_error;
+	}
+
+	if (settings.denoise.iterations > 0)
+	{
+		features->scale(1.0f / std::max(1, std::min(settings.min_samples_per_pixel, settings.max_samples_per_pixel)));
+
+		atrous_denoiser::denoise(&radiance, luminance_variance, *features, settings.denoise, tf);
+
+		if (on_tile_finished)
+		{
+			const int tile_count = tile_count_x(image->width) * tile_count_y(image->height);
+			for (int tile_index = 0; tile_index < tile_count; ++tile_index)
+			{
+				tf.silent_emplace([&radiance, &on_tile_finished, tile_index]()
+				{
+					const tile_bounds bounds = get_tile_bounds(tile_index, radiance.width, radiance.height);
+
+					on_tile_finished(make_tile(radiance, bounds.x_begin, bounds.y_begin,
+						bounds.x_end - bounds.x_begin, bounds.y_end - bounds.y_begin));
+				});
+			}
+
+			tf.wait_for_all();
+		}
+	}
+
+	// The output conversion runs once over the final image, in bands of rows on the task pool
+	const int band_height = 16;
+	for (int y_begin = 0; y_begin < image->height; y_begin += band_height)
+	{
+		tf.silent_emplace([&radiance, &settings, image, y_begin, band_height]()
+		{
+			const int y_end = std::min(y_begin + band_height, image->height);
+			for (int y = y_begin; y < y_end; ++y)
+			{
+				encode_srgb8_row(radiance.row(0, y), radiance.row(1, y), radiance.row(2, y), image->width, y, settings.dither,
+					reinterpret_cast<uint8_t*>(image->data.data() + image->width * y));
 			}
 		});
 	}
 
-	tf.dispatch();
 	tf.wait_for_all();
+}
+
+// A quick first look at the image that traces one ray per block of block_size by block_size pixels
+// and fills the whole block with the result. Returns false if cancelled, the image is left partially
+// written in that case.
+bool render_preview(const scene& scene, const camera& camera, image* image, int block_size, unsigned* inout_ray_count, const cancellation_token* cancel = nullptr)
+{
+	const int packet_size = render_tile_size;
+
+	const int blocks_x = (image->width + block_size - 1) / block_size;
+	const int blocks_y = (image->height + block_size - 1) / block_size;
+
+	const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+	tf::Taskflow tf(num_threads);
+
+	std::vector<unsigned> statistics(blocks_y, 0);
+
+	for (int block_y = 0; block_y < blocks_y; ++block_y)
+	{
+		tf.silent_emplace([&scene, &camera, &statistics, image, block_size, blocks_x, block_y, cancel]()
+		{
+			if (cancel && cancel->is_cancelled())
+			{
+				return;
+			}
+
+			const int y_begin = block_y * block_size;
+			const int y_end = std::min(y_begin + block_size, image->height);
+
+			// The rows are scratch memory of the worker, released when the task finishes
+			arena& scratch = this_thread_arena();
+			arena_scope scratch_scope(scratch);
+
+			float* row[3];
+			for (int c = 0; c < 3; ++c)
+			{
+				row[c] = scratch.allocate_array<float>(blocks_x);
+			}
+
+			for (int block_x_begin = 0; block_x_begin < blocks_x; block_x_begin += packet_size)
+			{
+				const int block_x_end = std::min(block_x_begin + packet_size, blocks_x);
+
+				ray_packet<packet_size> packet;
+				for (int block_x = block_x_begin; block_x < block_x_end; ++block_x)
+				{
+					// Sample at the center of the block's pixels
+					const float x = std::min(block_x * block_size + 0.5f * block_size, static_cast<float>(image->width));
+					const float y = std::min(y_begin + 0.5f * block_size, static_cast<float>(image->height));
+
+					const ray ray = camera.create_ray(x / image->width, y / image->height);
+					packet.set(block_x - block_x_begin, ray.origin, ray.direction);
+				}
+				packet.finalize();
+
+				math::vec<3> colors[packet_size];
+				with_whitted_renderer(scene.features, [&](auto renderer)
+				{
+					renderer.radiance(scene, packet, colors, &statistics[block_y]);
+				});
+
+				for (int block_x = block_x_begin; block_x < block_x_end; ++block_x)
+				{
+					for (int c = 0; c < 3; ++c)
+					{
+						row[c][block_x] = colors[block_x - block_x_begin][c];
+					}
+				}
+			}
+
+			uint8_t* encoded = scratch.allocate_array<uint8_t>(3 * blocks_x);
+			encode_srgb8_row(row[0], row[1], row[2], blocks_x, block_y, false, encoded);
+
+			for (int y = y_begin; y < y_end; ++y)
+			{
+				image::pixel* out = image->data.data() + image->width * y;
+				for (int x = 0; x < image->width; ++x)
+				{
+					const uint8_t* bgr = &encoded[3 * (x / block_size)];
+					out[x] = { bgr[0], bgr[1], bgr[2] };
+				}
+			}
+		});
+	}
+
+	tf.wait_for_all();
+
+	for (const unsigned& ray_count : statistics)
+	{
+		*inout_ray_count += ray_count;
+	}
+
+	return !(cancel && cancel->is_cancelled());
+}
+
+// The image is rendered in tiles over a number of passes. The first pass gives every pixel the minimum
+// number of samples, every following pass only adds samples to pixels whose estimated error is still
+// above the threshold. Tiles without any such pixels are not scheduled again. Without denoising a tile
+// is handed to on_tile_finished as soon as it has converged, otherwise once the denoiser is done.
+// Returns false if the render was cancelled. The image then holds the samples taken so far, without
+// denoising, and pixels that did not receive any sample yet are black.
+bool render(const scene& scene, const camera& camera, image* image, unsigned* inout_ray_count, const render_settings& settings = {}, const tile_callback& on_tile_finished = nullptr)
+{
+	const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+	tf::Taskflow tf(num_threads);
+	trace::observe(tf);
+
+	const int tile_count = tile_count_x(image->width) * tile_count_y(image->height);
+	const std::vector<int> tile_order = tile_dispatch_order(image->width, image->height);
+
+	accumulation_buffer accumulation(image->width, image->height);
+	feature_buffer features(image->width, image->height);
+
+	std::vector<unsigned> statistics(tile_count);
+	std::vector<uint8_t> tile_converged(tile_count, false);
+
+	const int max_passes = max_render_passes(settings);
+
+	const bool stream_tiles = on_tile_finished && settings.denoise.iterations == 0;
+	std::vector<uint8_t> tile_handed_over(tile_count, false);
+
+	const uint64_t render_fingerprint = render_checkpoint::fingerprint(scene, camera, settings, image->width, image->height);
+
+	int first_pass = 0;
+
+	if (settings.checkpoint.resume && !settings.checkpoint.filepath.empty())
+	{
+		render_checkpoint checkpoint;
+		if (checkpoint.load(settings.checkpoint.filepath.c_str()) &&
+			checkpoint.render_fingerprint == render_fingerprint &&
+			checkpoint.pixels.size() == accumulation.data.size() &&
+			checkpoint.tile_converged.size() == tile_converged.size() &&
+			checkpoint.statistics.size() == statistics.size())
+		{
+			accumulation.data = std::move(checkpoint.pixels);
+			for (int c = 0; c < 3; ++c)
+			{
+				features.albedo.planes[c] = std::move(checkpoint.features[c]);
+				features.normal.planes[c] = std::move(checkpoint.features[3 + c]);
+			}
+			features.depth.planes[0] = std::move(checkpoint.features[6]);
+			tile_converged = std::move(checkpoint.tile_converged);
+			statistics = std::move(checkpoint.statistics);
+			first_pass = checkpoint.next_pass;
+
+			// Tiles that converged before the checkpoint are not rendered again
+			for (int tile_index = 0; stream_tiles && tile_index < tile_count; ++tile_index)
+			{
+				if (tile_converged[tile_index])
+				{
+					hand_over_tile(accumulation, tile_index, on_tile_finished);
+					tile_handed_over[tile_index] = true;
+				}
+			}
+		}
+	}
+
+	// Checkpoints are written by a background thread from a copy of the state, so rendering continues
+	// while the file is written
+	std::future<bool> checkpoint_written;
+
+	// A failed write is reported but does not stop the render, the next checkpoint may succeed
+	auto finish_checkpoint = [&checkpoint_written, &settings]()
+	{
+		if (checkpoint_written.valid() && !checkpoint_written.get())
+		{
+			fprintf(stderr, "failed to write the checkpoint %s\n", settings.checkpoint.filepath.c_str());
+		}
+	};
+	auto last_checkpoint_time = std::chrono::steady_clock::now();
+
+	bool completed = true;
+
+	for (int pass = first_pass; pass < max_passes; ++pass)
+	{
+		bool any_tile_scheduled = false;
+
+		for (int tile_index : tile_order)
+		{
+			if (tile_converged[tile_index])
+			{
+				continue;
+			}
+
+			any_tile_scheduled = true;
+
+			tf.silent_emplace([&camera, &scene, &accumulation, &features, &settings, &statistics, &tile_converged, &tile_handed_over, &on_tile_finished, tile_index, pass, max_passes, stream_tiles]()
+			{
+				if (settings.cancelled())
+				{
+					return;
+				}
+
+				const int tiles_x = tile_count_x(accumulation.width);
+				trace::scope trace_tile("tile", tile_index % tiles_x, tile_index / tiles_x, pass);
+
+				tile_converged[tile_index] = render_tile_pass(scene, camera, settings, tile_index, pass, &accumulation, &features, &statistics[tile_index]);
+
+				if (stream_tiles && (tile_converged[tile_index] || pass == max_passes - 1))
+				{
+					hand_over_tile(accumulation, tile_index, on_tile_finished);
+					tile_handed_over[tile_index] = true;
+				}
+			});
+		}
+
+		if (!any_tile_scheduled)
+		{
+			break;
+		}
+
+		{
+			trace::scope trace_wait("wait_for_all", -1, -1, pass);
+			tf.wait_for_all();
+		}
+
+		// The pass may be incomplete, so it must not end up in a checkpoint either
+		if (settings.cancelled())
+		{
+			completed = false;
+			break;
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		const bool checkpoint_due = std::chrono::duration<double>(now - last_checkpoint_time).count() >= settings.checkpoint.interval_seconds;
+
+		if (!settings.checkpoint.filepath.empty() && checkpoint_due && pass + 1 < max_passes)
+		{
+			// Only one checkpoint is written at a time
+			finish_checkpoint();
+
+			render_checkpoint checkpoint;
+			checkpoint.render_fingerprint = render_fingerprint;
+			checkpoint.next_pass = pass + 1;
+			checkpoint.pixels = accumulation.data;
+			for (int c = 0; c < 3; ++c)
+			{
+				checkpoint.features[c] = features.albedo.planes[c];
+				checkpoint.features[3 + c] = features.normal.planes[c];
+			}
+			checkpoint.features[6] = features.depth.planes[0];
+			checkpoint.tile_converged = tile_converged;
+			checkpoint.statistics = statistics;
+
+			checkpoint_written = std::async(std::launch::async, [checkpoint = std::move(checkpoint), filepath = settings.checkpoint.filepath]()
+			{
+				return checkpoint.save(filepath.c_str());
+			});
+
+			last_checkpoint_time = now;
+		}
+	}
+
+	finish_checkpoint();
+
+	render_settings resolve_settings = settings;
+
+	if (!completed)
+	{
+		// The features of a cancelled render may be incomplete, which the denoiser would mistake for edges
+		resolve_settings.denoise.iterations = 0;
+
+		// Complete the output with the tiles that were not handed over yet
+		for (int tile_index = 0; on_tile_finished && tile_index < tile_count; ++tile_index)
+		{
+			if (!tile_handed_over[tile_index])
+			{
+				hand_over_tile(accumulation, tile_index, on_tile_finished);
+			}
+		}
+	}
+
+	{
+		trace::scope trace_resolve("resolve_image");
+		resolve_image(accumulation, &features, resolve_settings, image, tf, completed ? on_tile_finished : nullptr);
+	}
 
 	for (const unsigned& ray_count : statistics)
 	{
 		*inout_ray_count += ray_count;
 	}
+
+	return completed;
+}
+
+// Renders from the default camera
+bool render(const scene& scene, image* image, unsigned* inout_ray_count, const render_settings& settings = {}, const tile_callback& on_tile_finished = nullptr)
+{
+	return render(scene, camera(static_cast<float>(image->width) / image->height), image, inout_ray_count, settings, on_tile_finished);
 }
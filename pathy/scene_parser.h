@@ -0,0 +1,657 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <istream>
+#include <iostream>
+#include <charconv>
+
+#include "pathy.h"
+
+// The element and attribute names the scene parser understands. Names are interned while they are read,
+// everything after that compares small integers instead of strings.
+enum class xml_name : uint8_t
+{
+	unknown,
+	scene,
+	emitter,
+	shape,
+	transform,
+	translate,
+	point,
+	rgb,
+	float_,
+	bsdf,
+	name,
+	type,
+	value,
+	x,
+	y,
+	z,
+};
+
+inline xml_name intern_xml_name(std::string_view name)
+{
+	static const std::pair<std::string_view, xml_name> names[] = {
+		{ "scene", xml_name::scene },
+		{ "emitter", xml_name::emitter },
+		{ "shape", xml_name::shape },
+		{ "transform", xml_name::transform },
+		{ "translate", xml_name::translate },
+		{ "point", xml_name::point },
+		{ "rgb", xml_name::rgb },
+		{ "float", xml_name::float_ },
+		{ "bsdf", xml_name::bsdf },
+		{ "name", xml_name::name },
+		{ "type", xml_name::type },
+		{ "value", xml_name::value },
+		{ "x", xml_name::x },
+		{ "y", xml_name::y },
+		{ "z", xml_name::z },
+	};
+
+	for (const auto& entry : names)
+	{
+		if (entry.first == name)
+		{
+			return entry.second;
+		}
+	}
+
+	return xml_name::unknown;
+}
+
+// A pull parser that reads XML elements from a stream through a fixed size buffer, so memory use does
+// not grow with the size of the file. Text, comments, CDATA sections, processing instructions and the
+// document type are skipped. Only the attributes with known names are kept.
+class xml_reader
+{
+public:
+	enum class token
+	{
+		start_element,
+		end_element, // also reported right after the start of an empty element like <a/>
+		end_of_file,
+		error,
+	};
+
+	explicit xml_reader(std::istream& stream) :
+		_stream(stream),
+		_buffer(buffer_size)
+	{
+	}
+
+	token next()
+	{
+		if (_pending_end)
+		{
+			_pending_end = false;
+			return token::end_element;
+		}
+
+		for (;;)
+		{
+			// Skip text up to the next markup
+			int c;
+			while ((c = get()) != '<')
+			{
+				if (c == eof)
+				{
+					return token::end_of_file;
+				}
+			}
+
+			c = peek();
+
+			if (c == '?')
+			{
+				if (!skip_past("?>"))
+				{
+					return token::error;
+				}
+			}
+			else if (c == '!')
+			{
+				get();
+				if (peek() == '-')
+				{
+					if (!skip_past("-->"))
+					{
+						return token::error;
+					}
+				}
+				else if (peek() == '[')
+				{
+					if (!skip_past("]]>"))
+					{
+						return token::error;
+					}
+				}
+				else if (!skip_past(">"))
+				{
+					return token::error;
+				}
+			}
+			else if (c == '/')
+			{
+				get();
+				_element = read_name();
+				skip_whitespace();
+				return (get() == '>') ? token::end_element : token::error;
+			}
+			else
+			{
+				return read_start_element() ? token::start_element : token::error;
+			}
+		}
+	}
+
+	xml_name element() const { return _element; }
+
+	// The value of an attribute of the last start element, empty if the element does not have it
+	std::string_view attribute(xml_name name) const
+	{
+		for (const attribute_value& a : _attributes)
+		{
+			if (a.name == name)
+			{
+				return std::string_view(_attribute_text.data() + a.begin, a.end - a.begin);
+			}
+		}
+		return {};
+	}
+
+	int line() const { return _line; }
+
+private:
+	static constexpr int eof = -1;
+	static constexpr size_t buffer_size = 64 * 1024;
+
+	struct attribute_value
+	{
+		xml_name name;
+		size_t begin, end;
+	};
+
+	int peek()
+	{
+		if (_position == _size && !fill())
+		{
+			return eof;
+		}
+		return static_cast<unsigned char>(_buffer[_position]);
+	}
+
+	int get()
+	{
+		const int c = peek();
+		if (c != eof)
+		{
+			++_position;
+			_line += (c == '\n');
+		}
+		return c;
+	}
+
+	bool fill()
+	{
+		_stream.read(_buffer.data(), buffer_size);
+		_size = static_cast<size_t>(_stream.gcount());
+		_position = 0;
+		return _size > 0;
+	}
+
+	static bool is_whitespace(int c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+	static bool is_name_character(int c) { return c != eof && !is_whitespace(c) && c != '=' && c != '>' && c != '/' && c != '<' && c != '"' && c != '\''; }
+
+	void skip_whitespace()
+	{
+		while (is_whitespace(peek()))
+		{
+			get();
+		}
+	}
+
+	// Skips past the next occurrence of the terminator, which is at most four characters long
+	bool skip_past(const char* terminator)
+	{
+		const size_t length = strlen(terminator);
+		char window[4] = {};
+		for (;;)
+		{
+			const int c = get();
+			if (c == eof)
+			{
+				return false;
+			}
+
+			memmove(window, window + 1, length - 1);
+			window[length - 1] = static_cast<char>(c);
+
+			if (memcmp(window, terminator, length) == 0)
+			{
+				return true;
+			}
+		}
+	}
+
+	xml_name read_name()
+	{
+		_name.clear();
+		while (is_name_character(peek()))
+		{
+			_name.push_back(static_cast<char>(get()));
+		}
+		return intern_xml_name(_name);
+	}
+
+	bool read_start_element()
+	{
+		_attributes.clear();
+		_attribute_text.clear();
+
+		_element = read_name();
+		if (_name.empty())
+		{
+			return false;
+		}
+
+		for (;;)
+		{
+			skip_whitespace();
+
+			const int c = peek();
+			if (c == '>')
+			{
+				get();
+				return true;
+			}
+			if (c == '/')
+			{
+				get();
+				_pending_end = true;
+				return get() == '>';
+			}
+
+			const xml_name name = read_name();
+			if (_name.empty())
+			{
+				return false;
+			}
+
+			skip_whitespace();
+			if (get() != '=')
+			{
+				return false;
+			}
+			skip_whitespace();
+
+			const int quote = get();
+			if (quote != '"' && quote != '\'')
+			{
+				return false;
+			}
+
+			const size_t begin = _attribute_text.size();
+			for (int v = get(); v != quote; v = get())
+			{
+				if (v == eof || v == '<')
+				{
+					return false;
+				}
+				if (v == '&')
+				{
+					v = read_entity();
+					if (v == eof)
+					{
+						return false;
+					}
+				}
+				if (name != xml_name::unknown)
+				{
+					_attribute_text.push_back(static_cast<char>(v));
+				}
+			}
+
+			if (name != xml_name::unknown)
+			{
+				_attributes.push_back({ name, begin, _attribute_text.size() });
+			}
+		}
+	}
+
+	// The predefined entities, the ampersand has been read already
+	int read_entity()
+	{
+		char entity[8];
+		size_t length = 0;
+		for (int c = get(); c != ';'; c = get())
+		{
+			if (c == eof || length == sizeof(entity) - 1)
+			{
+				return eof;
+			}
+			entity[length++] = static_cast<char>(c);
+		}
+
+		const std::string_view e(entity, length);
+		if (e == "lt") return '<';
+		if (e == "gt") return '>';
+		if (e == "amp") return '&';
+		if (e == "quot") return '"';
+		if (e == "apos") return '\'';
+		return eof;
+	}
+
+	std::istream& _stream;
+	std::vector<char> _buffer;
+	size_t _size = 0;
+	size_t _position = 0;
+	int _line = 1;
+
+	xml_name _element = xml_name::unknown;
+	bool _pending_end = false;
+
+	std::string _name;
+	std::string _attribute_text;
+	std::vector<attribute_value> _attributes;
+};
+
+// Parses count numbers separated by commas and whitespace, as in value="0.1, 0.2, 0.3"
+inline bool parse_floats(std::string_view text, float* out_values, int count)
+{
+	const char* p = text.data();
+	const char* end = text.data() + text.size();
+
+	for (int i = 0; i < count; ++i)
+	{
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		{
+			++p;
+		}
+
+		const std::from_chars_result result = std::from_chars(p, end, out_values[i]);
+		if (result.ec != std::errc())
+		{
+			return false;
+		}
+		p = result.ptr;
+	}
+
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	{
+		++p;
+	}
+
+	return p == end;
+}
+
+// Builds the scene while reading a Mitsuba style scene file in one pass, without keeping a document
+// tree in memory. Understands point and constant emitters at the top level and spheres that are either
+// area lights or have a diffuse or conductor bsdf. Everything else is skipped. Returns false if the
+// file is not well formed or has no scene element, the acceleration structures are not built.
+inline bool parse_scene(std::istream& stream, scene* out_scene, const char* filepath = "scene")
+{
+	xml_reader reader(stream);
+
+	// The element path from the scene element down to the current element
+	std::vector<xml_name> path;
+
+	auto warning = [&](const char* message, std::string_view detail)
+	{
+		std::cerr << filepath << "(" << reader.line() << "): " << message << detail << std::endl;
+	};
+
+	auto parse_rgb = [&](math::vec<3>* out_color)
+	{
+		const std::string_view value = reader.attribute(xml_name::value);
+		math::vec<3> color;
+		if (!parse_floats(value, &color[0], 3))
+		{
+			warning("failed to parse color: ", value);
+			return;
+		}
+		*out_color = color;
+	};
+
+	auto parse_float = [&](xml_name attribute, float* out_value)
+	{
+		const std::string_view value = reader.attribute(attribute);
+		if (!value.empty() && !parse_floats(value, out_value, 1))
+		{
+			warning("failed to parse number: ", value);
+		}
+	};
+
+	// The top level element being read
+	enum class item
+	{
+		none,
+		point_light,
+		constant_light,
+		sphere,
+	};
+
+	item current = item::none;
+
+	point_light point_light;
+	constant_light constant_light;
+
+	sphere sphere;
+	bool has_translate = false;
+	bool has_radius = false;
+	enum class sphere_kind
+	{
+		none,
+		area_light,
+		material,
+		invalid,
+	};
+	sphere_kind kind = sphere_kind::none;
+	material material;
+	math::vec<3> area_light_intensity;
+	bool has_color = false;
+
+	bool seen_scene = false;
+
+	for (;;)
+	{
+		const xml_reader::token token = reader.next();
+
+		if (token == xml_reader::token::error)
+		{
+			warning("malformed xml", "");
+			return false;
+		}
+
+		if (token == xml_reader::token::end_of_file)
+		{
+			if (!path.empty())
+			{
+				warning("unexpected end of file", "");
+				return false;
+			}
+			if (!seen_scene)
+			{
+				warning("no scene element", "");
+				return false;
+			}
+			return true;
+		}
+
+		if (token == xml_reader::token::end_element)
+		{
+			if (path.empty() || path.back() != reader.element())
+			{
+				warning("mismatched end tag", "");
+				return false;
+			}
+			path.pop_back();
+
+			if (path.size() == 1)
+			{
+				if (current == item::point_light)
+				{
+					out_scene->point_lights.push_back(point_light);
+				}
+				else if (current == item::constant_light)
+				{
+					out_scene->constant_light = constant_light;
+				}
+				else if (current == item::sphere)
+				{
+					if (kind == sphere_kind::area_light)
+					{
+						out_scene->sphere_area_lights.push_back({ sphere.position, sphere.radius, area_light_intensity });
+					}
+					else if (kind == sphere_kind::material)
+					{
+						out_scene->spheres.push_back(sphere);
+						out_scene->sphere_materials.push_back(material);
+					}
+				}
+
+				current = item::none;
+			}
+
+			continue;
+		}
+
+		const xml_name element = reader.element();
+		path.push_back(element);
+
+		const size_t depth = path.size();
+		const std::string_view type = reader.attribute(xml_name::type);
+		const std::string_view name = reader.attribute(xml_name::name);
+
+		if (depth == 1)
+		{
+			if (element != xml_name::scene)
+			{
+				warning("expected a scene element", "");
+				return false;
+			}
+			seen_scene = true;
+		}
+		else if (depth == 2 && path[0] == xml_name::scene)
+		{
+			if (element == xml_name::emitter)
+			{
+				if (type == "point")
+				{
+					current = item::point_light;
+					point_light = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+				}
+				else if (type == "constant")
+				{
+					current = item::constant_light;
+					constant_light = { { 0.0f, 0.0f, 0.0f } };
+				}
+				else
+				{
+					warning("emitter has unsupported type: ", type);
+				}
+			}
+			else if (element == xml_name::shape)
+			{
+				if (type == "sphere")
+				{
+					current = item::sphere;
+					sphere = { { 0.0f, 0.0f, 0.0f }, 1.0f };
+					has_translate = false;
+					has_radius = false;
+					kind = sphere_kind::none;
+					material = {};
+					area_light_intensity = { 1.0f, 1.0f, 1.0f };
+					has_color = false;
+				}
+				else
+				{
+					warning("shape has unsupported type: ", type);
+				}
+			}
+		}
+		else if (current == item::point_light && depth == 3)
+		{
+			if (element == xml_name::point && name == "position")
+			{
+				parse_float(xml_name::x, &point_light.position.x);
+				parse_float(xml_name::y, &point_light.position.y);
+				parse_float(xml_name::z, &point_light.position.z);
+			}
+			else if (element == xml_name::rgb && name == "intensity")
+			{
+				parse_rgb(&point_light.intensity);
+			}
+		}
+		else if (current == item::constant_light && depth == 3)
+		{
+			if (element == xml_name::rgb && name == "radiance")
+			{
+				parse_rgb(&constant_light.radiance);
+			}
+		}
+		else if (current == item::sphere && depth == 3)
+		{
+			if (element == xml_name::float_ && name == "radius" && !has_radius)
+			{
+				parse_float(xml_name::value, &sphere.radius);
+				has_radius = true;
+			}
+			else if (element == xml_name::emitter && (kind == sphere_kind::none || kind == sphere_kind::material))
+			{
+				// An emitter makes the sphere a light even when it also has a bsdf
+				if (type == "area")
+				{
+					kind = sphere_kind::area_light;
+					has_color = false;
+				}
+				else
+				{
+					warning("emitter has unsupported type: ", type);
+					kind = sphere_kind::invalid;
+				}
+			}
+			else if (element == xml_name::bsdf && kind == sphere_kind::none)
+			{
+				if (type == "diffuse" || type == "conductor")
+				{
+					kind = sphere_kind::material;
+					material.is_mirror = (type == "conductor");
+				}
+				else
+				{
+					warning("bsdf has unsupported type: ", type);
+					kind = sphere_kind::invalid;
+				}
+			}
+		}
+		else if (current == item::sphere && depth == 4)
+		{
+			const xml_name parent = path[2];
+
+			if (parent == xml_name::transform && element == xml_name::translate && !has_translate)
+			{
+				parse_float(xml_name::x, &sphere.position.x);
+				parse_float(xml_name::y, &sphere.position.y);
+				parse_float(xml_name::z, &sphere.position.z);
+				has_translate = true;
+			}
+			else if (parent == xml_name::emitter && kind == sphere_kind::area_light && element == xml_name::rgb && name == "intensity" && !has_color)
+			{
+				parse_rgb(&area_light_intensity);
+				has_color = true;
+			}
+			else if (parent == xml_name::bsdf && kind == sphere_kind::material && element == xml_name::rgb && !has_color &&
+				(material.is_mirror ? name == "specularReflectance" : name == "reflectance"))
+			{
+				parse_rgb(&material.base_color);
+				has_color = true;
+			}
+		}
+	}
+}
@@ -0,0 +1,552 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <filesystem>
+
+#include "pathy.h"
+#include "net.h"
+
+// A long running render process. Scenes stay loaded between requests and requests from any number of
+// clients share one task pool. Every client connection may queue several requests and receives a
+// preview of each after every pass, followed by the final image.
+namespace server
+{
+	constexpr uint32_t protocol_version = 1;
+
+	// Requests only hold a scene path and a few settings, anything larger is refused
+	constexpr uint32_t max_request_size = 64 * 1024;
+
+	// Bounds of the work one request may ask for. The denoiser's footprint doubles every iteration.
+	constexpr int samples_per_pixel_limit = 1 << 16;
+	constexpr int denoise_iterations_limit = 8;
+
+	enum class message_type : uint32_t
+	{
+		request = 1, // client to server: render_request
+		progress,    // server to client: request id, pass, width, height, BGR pixels
+		result,      // server to client: request id, ray count, width, height, BGR pixels
+		error,       // server to client: request id, reason
+	};
+
+	using message = net::message<message_type>;
+
+	struct render_request
+	{
+		uint32_t id = 0; // chosen by the client to tell its requests apart
+		std::string scene_filepath;
+		int width = 640;
+		int height = 480;
+		math::vec<3> eye = { 0, 2, 3 };
+		math::vec<3> at = { 0, 0, 0 };
+		float fovy = math::pi / 3;
+		int min_samples_per_pixel = 4;
+		int max_samples_per_pixel = 64;
+		int samples_per_pass = 4;
+		float max_relative_error = 0.02f;
+		int denoise_iterations = 5;
+
+		void write(message* m) const
+		{
+			m->write(protocol_version);
+			m->write(id);
+			m->write_vector(std::vector<char>(scene_filepath.begin(), scene_filepath.end()));
+			m->write(width);
+			m->write(height);
+			m->write(eye);
+			m->write(at);
+			m->write(fovy);
+			m->write(min_samples_per_pixel);
+			m->write(max_samples_per_pixel);
+			m->write(samples_per_pass);
+			m->write(max_relative_error);
+			m->write(denoise_iterations);
+		}
+
+		bool read(message* m)
+		{
+			uint32_t version;
+			std::vector<char> filepath;
+			if (!m->read(&version) || version != protocol_version ||
+				!m->read(&id) ||
+				!m->read_vector(&filepath) ||
+				!m->read(&width) ||
+				!m->read(&height) ||
+				!m->read(&eye) ||
+				!m->read(&at) ||
+				!m->read(&fovy) ||
+				!m->read(&min_samples_per_pixel) ||
+				!m->read(&max_samples_per_pixel) ||
+				!m->read(&samples_per_pass) ||
+				!m->read(&max_relative_error) ||
+				!m->read(&denoise_iterations))
+			{
+				return false;
+			}
+
+			scene_filepath.assign(filepath.begin(), filepath.end());
+
+			return width > 0 && height > 0 && width * static_cast<int64_t>(height) <= (1 << 26) &&
+				min_samples_per_pixel > 0 && max_samples_per_pixel >= min_samples_per_pixel && max_samples_per_pixel <= samples_per_pixel_limit &&
+				samples_per_pass > 0 && samples_per_pass <= max_samples_per_pixel &&
+				denoise_iterations >= 0 && denoise_iterations <= denoise_iterations_limit;
+		}
+	};
+
+	// Returns false when the scene can't be loaded
+	using scene_loader = std::function<bool(const char* filepath, scene* out_scene)>;
+
+	// Keeps every scene that was requested loaded along with its acceleration structures. A scene is
+	// loaded again once its file was modified since it was last loaded.
+	class scene_cache
+	{
+	public:
+		explicit scene_cache(scene_loader loader) :
+			_loader(std::move(loader))
+		{
+		}
+
+		std::shared_ptr<const scene> get(const std::string& filepath)
+		{
+			std::error_code error;
+			const std::filesystem::file_time_type modified = std::filesystem::last_write_time(filepath, error);
+			if (error)
+			{
+				return nullptr;
+			}
+
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			entry& cached = _entries[filepath];
+			if (!cached.scene || cached.modified != modified)
+			{
+				// Requests that still render the previous version keep it alive
+				std::shared_ptr<scene> loaded = std::make_shared<scene>();
+				if (!_loader(filepath.c_str(), loaded.get()))
+				{
+					_entries.erase(filepath);
+					return nullptr;
+				}
+
+				cached.scene = std::move(loaded);
+				cached.modified = modified;
+			}
+
+			return cached.scene;
+		}
+
+	private:
+		struct entry
+		{
+			std::shared_ptr<const ::scene> scene;
+			std::filesystem::file_time_type modified;
+		};
+
+		scene_loader _loader;
+		std::unordered_map<std::string, entry> _entries;
+		std::mutex _mutex;
+	};
+
+	class render_server
+	{
+	public:
+		render_server(scene_loader loader, unsigned num_threads = std::max(1u, std::thread::hardware_concurrency())) :
+			_scenes(std::move(loader)),
+			_tf(num_threads)
+		{
+		}
+
+		~render_server()
+		{
+			for (std::unique_ptr<client>& c : _clients)
+			{
+				disconnect(c.get());
+			}
+		}
+
+		// Serves the clients that connect to the listener. Returns when the listener fails.
+		void run(net::socket& listener)
+		{
+			while (listener.valid())
+			{
+				// Only block while there is nothing to render
+				if (!net::wait_readable({ &listener }, _jobs.empty() ? 50 : 0).empty())
+				{
+					net::socket socket = listener.accept();
+					if (socket.valid())
+					{
+						socket.set_timeouts(io_timeout_milliseconds);
+
+						_clients.emplace_back(new client());
+						client* c = _clients.back().get();
+						c->socket = std::move(socket);
+						c->reader = std::thread([this, c]() { read_requests(c); });
+						c->writer = std::thread([c]() { write_messages(c); });
+					}
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(_arrived_jobs_mutex);
+					for (std::unique_ptr<job>& j : _arrived_jobs)
+					{
+						_jobs.push_back(std::move(j));
+					}
+					_arrived_jobs.clear();
+				}
+
+				if (!_jobs.empty())
+				{
+					render_round();
+				}
+
+				remove_disconnected_clients();
+			}
+		}
+
+	private:
+		// A message that starts arriving, or that is being sent, must make progress within this time
+		static constexpr int io_timeout_milliseconds = 10000;
+
+		// Every client has a thread receiving its requests and one sending its images, so that a client
+		// that sends slowly or stops reading only holds up itself. The render loop never blocks on a
+		// client, it hands the images to the sending thread.
+		struct client
+		{
+			net::socket socket;
+			std::atomic<bool> connected = { true };
+
+			std::mutex outgoing_mutex;
+			std::condition_variable outgoing_changed;
+			std::deque<std::pair<uint32_t, message>> outgoing; // request id and message
+
+			std::thread reader;
+			std::thread writer;
+		};
+
+		// The state of a request in progress
+		struct job
+		{
+			job(client* owner, const render_request& request, std::shared_ptr<const ::scene> scene) :
+				owner(owner),
+				id(request.id),
+				scene(std::move(scene)),
+				camera(static_cast<float>(request.width) / request.height, request.eye, request.at, request.fovy),
+				accumulation(request.width, request.height),
+				features(request.width, request.height),
+				statistics(tile_count_x(request.width) * tile_count_y(request.height), 0),
+				tile_converged(statistics.size(), false),
+				tile_order(tile_dispatch_order(request.width, request.height))
+			{
+				settings.min_samples_per_pixel = request.min_samples_per_pixel;
+				settings.max_samples_per_pixel = request.max_samples_per_pixel;
+				settings.samples_per_pass = request.samples_per_pass;
+				settings.max_relative_error = request.max_relative_error;
+				settings.denoise.iterations = request.denoise_iterations;
+
+				max_passes = max_render_passes(settings);
+			}
+
+			client* owner;
+			uint32_t id;
+			std::shared_ptr<const ::scene> scene;
+			render_settings settings;
+			::camera camera;
+			accumulation_buffer accumulation;
+			feature_buffer features;
+			std::vector<unsigned> statistics;
+			std::vector<uint8_t> tile_converged;
+			std::vector<int> tile_order;
+			int pass = 0;
+			int max_passes = 0;
+		};
+
+		// Runs on the client's reader thread. Loading the scene happens here too, so that a slow load
+		// does not delay the passes of other requests.
+		void read_requests(client* c)
+		{
+			while (c->connected)
+			{
+				// A client may stay quiet for as long as it likes between requests, only a request that
+				// started arriving has to be complete within the timeout
+				if (net::wait_readable({ &c->socket }, 250).empty())
+				{
+					continue;
+				}
+
+				message m;
+				render_request request;
+				if (!m.receive(c->socket, max_request_size) || m.type != message_type::request || !request.read(&m))
+				{
+					break;
+				}
+
+				std::shared_ptr<const scene> scene = _scenes.get(request.scene_filepath);
+				if (!scene)
+				{
+					message error(message_type::error);
+					error.write(request.id);
+					const std::string reason = "failed to load " + request.scene_filepath;
+					error.write_vector(std::vector<char>(reason.begin(), reason.end()));
+					post(c, request.id, std::move(error));
+					continue;
+				}
+
+				std::unique_ptr<job> j(new job(c, request, std::move(scene)));
+
+				std::lock_guard<std::mutex> lock(_arrived_jobs_mutex);
+				_arrived_jobs.push_back(std::move(j));
+			}
+
+			c->connected = false;
+			c->outgoing_changed.notify_all();
+		}
+
+		// Runs on the client's writer thread
+		static void write_messages(client* c)
+		{
+			for (;;)
+			{
+				message m;
+				{
+					std::unique_lock<std::mutex> lock(c->outgoing_mutex);
+					c->outgoing_changed.wait(lock, [c]() { return !c->outgoing.empty() || !c->connected; });
+					if (!c->connected)
+					{
+						return;
+					}
+
+					m = std::move(c->outgoing.front().second);
+					c->outgoing.pop_front();
+				}
+
+				if (!m.send(c->socket))
+				{
+					c->connected = false;
+					return;
+				}
+			}
+		}
+
+		// Queues a message for the client's writer thread. A preview still waiting to be sent is replaced
+		// by the newer one of the same request, so a client that reads slowly gets fewer previews rather
+		// than an ever growing queue.
+		static void post(client* c, uint32_t id, message m)
+		{
+			std::lock_guard<std::mutex> lock(c->outgoing_mutex);
+
+			if (m.type == message_type::progress)
+			{
+				for (std::pair<uint32_t, message>& queued : c->outgoing)
+				{
+					if (queued.first == id && queued.second.type == message_type::progress)
+					{
+						queued.second = std::move(m);
+						return;
+					}
+				}
+			}
+
+			c->outgoing.emplace_back(id, std::move(m));
+			c->outgoing_changed.notify_one();
+		}
+
+		// Renders one pass of every request in progress, so that concurrent requests advance at the same
+		// rate no matter how large they are or when they arrived. The tiles of all requests go into the
+		// pool together, which keeps it busy until the slowest tile of the round is done.
+		void render_round()
+		{
+			for (const std::unique_ptr<job>& j : _jobs)
+			{
+				for (int tile_index : j->tile_order)
+				{
+					if (j->tile_converged[tile_index])
+					{
+						continue;
+					}
+
+					job* current = j.get();
+					_tf.silent_emplace([current, tile_index]()
+					{
+						current->tile_converged[tile_index] = render_tile_pass(*current->scene, current->camera, current->settings, tile_index, current->pass,
+							&current->accumulation, &current->features, &current->statistics[tile_index]);
+					});
+				}
+			}
+
+			_tf.wait_for_all();
+
+			for (std::unique_ptr<job>& j : _jobs)
+			{
+				++j->pass;
+
+				const bool finished = j->pass == j->max_passes ||
+					std::all_of(j->tile_converged.begin(), j->tile_converged.end(), [](uint8_t converged) { return converged != 0; });
+
+				if (!j->owner->connected)
+				{
+					continue;
+				}
+
+				image image(j->accumulation.width, j->accumulation.height);
+
+				if (finished)
+				{
+					resolve_image(j->accumulation, &j->features, j->settings, &image, _tf, nullptr);
+
+					unsigned ray_count = 0;
+					for (unsigned count : j->statistics)
+					{
+						ray_count += count;
+					}
+
+					post_image(j->owner, message_type::result, j->id, ray_count, image);
+				}
+				else
+				{
+					// Previews skip the denoiser, it would run again for every pass
+					render_settings preview_settings = j->settings;
+					preview_settings.denoise.iterations = 0;
+					resolve_image(j->accumulation, &j->features, preview_settings, &image, _tf, nullptr);
+
+					post_image(j->owner, message_type::progress, j->id, j->pass, image);
+				}
+
+				if (finished)
+				{
+					j.reset();
+				}
+			}
+
+			_jobs.erase(std::remove(_jobs.begin(), _jobs.end(), nullptr), _jobs.end());
+		}
+
+		static void post_image(client* c, message_type type, uint32_t id, uint32_t value, const image& image)
+		{
+			message m(type);
+			m.write(id);
+			m.write(value);
+			m.write(image.width);
+			m.write(image.height);
+			m.write_vector(image.data);
+
+			post(c, id, std::move(m));
+		}
+
+		// Wakes up the client's threads and waits for them to finish
+		static void disconnect(client* c)
+		{
+			c->connected = false;
+			c->socket.shutdown();
+			c->outgoing_changed.notify_all();
+
+			if (c->reader.joinable())
+			{
+				c->reader.join();
+			}
+			if (c->writer.joinable())
+			{
+				c->writer.join();
+			}
+
+			c->socket.close();
+		}
+
+		// Requests of clients that went away are dropped with them
+		void remove_disconnected_clients()
+		{
+			_jobs.erase(std::remove_if(_jobs.begin(), _jobs.end(), [](const std::unique_ptr<job>& j) { return !j->owner->connected; }), _jobs.end());
+
+			for (std::unique_ptr<client>& c : _clients)
+			{
+				if (!c->connected)
+				{
+					disconnect(c.get());
+
+					// Jobs the reader queued after the last round still point at the client
+					{
+						std::lock_guard<std::mutex> lock(_arrived_jobs_mutex);
+						_arrived_jobs.erase(std::remove_if(_arrived_jobs.begin(), _arrived_jobs.end(), [&c](const std::unique_ptr<job>& j) { return j->owner == c.get(); }), _arrived_jobs.end());
+					}
+
+					c.reset();
+				}
+			}
+
+			_clients.erase(std::remove(_clients.begin(), _clients.end(), nullptr), _clients.end());
+		}
+
+		scene_cache _scenes;
+		tf::Taskflow _tf;
+
+		std::vector<std::unique_ptr<client>> _clients;
+		std::vector<std::unique_ptr<job>> _jobs;
+
+		// Requests whose scene is loaded, handed from the reader threads to the render loop
+		std::mutex _arrived_jobs_mutex;
+		std::vector<std::unique_ptr<job>> _arrived_jobs;
+	};
+
+	// Sends a request to a render server and passes every image it sends back to on_image, the final
+	// one with final set. Returns false if the server failed the request or the connection was lost.
+	inline bool request_render(net::socket& socket, const render_request& request, const std::function<void(const image& image, bool final)>& on_image)
+	{
+		message m(message_type::request);
+		request.write(&m);
+		if (!m.send(socket))
+		{
+			return false;
+		}
+
+		// Images of the requested size and error messages are all the server sends
+		const uint64_t image_message_size = 64 + static_cast<uint64_t>(std::max(request.width, 0)) * std::max(request.height, 0) * sizeof(image::pixel);
+		const uint32_t max_message_size = static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(image_message_size, max_request_size), UINT32_MAX));
+
+		while (m.receive(socket, max_message_size))
+		{
+			uint32_t id, value;
+			int width, height;
+			if (!m.read(&id) || id != request.id)
+			{
+				return false;
+			}
+
+			if (m.type == message_type::error)
+			{
+				std::vector<char> reason;
+				m.read_vector(&reason);
+				std::cerr << std::string(reason.begin(), reason.end()) << std::endl;
+
+				return false;
+			}
+
+			if (!m.read(&value) || !m.read(&width) || !m.read(&height) || width <= 0 || height <= 0)
+			{
+				return false;
+			}
+
+			image image(width, height);
+			if (!m.read_vector(&image.data) || static_cast<int>(image.data.size()) != width * height)
+			{
+				return false;
+			}
+
+			on_image(image, m.type == message_type::result);
+
+			if (m.type == message_type::result)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <immintrin.h>
+
+// The AVX2 and AVX-512 wrappers are compiled for their instruction sets, GCC refuses to inline the
+// intrinsics into functions compiled for less. They must only run in kernels dispatched to those levels.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#define SIMD_AVX512 __attribute__((target("avx512f")))
+#else
+#define SIMD_AVX2
+#define SIMD_AVX512
+#endif
+
+// Thin wrappers around SIMD registers so that kernels can be written with ordinary operators, once for
+// every width. float4 uses SSE2, which is part of the x64 baseline, float8 AVX2 and float16 AVX-512.
+// Masks are vectors with all bits of a lane set where a comparison holds.
+namespace simd
+{
+	struct float4
+	{
+		static constexpr int width = 4;
+		using half = float4; // the next narrower type, float4 is the narrowest
+
+		float4() = default;
+
+		float4(__m128 v) : v(v) {}
+
+		explicit float4(float splat) : v(_mm_set1_ps(splat)) {}
+
+		float4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+
+		static float4 load(const float* aligned) { return _mm_load_ps(aligned); }
+
+		static float4 loadu(const float* p) { return _mm_loadu_ps(p); }
+
+		void store(float* aligned) const { _mm_store_ps(aligned, v); }
+
+		void storeu(float* p) const { _mm_storeu_ps(p, v); }
+
+		__m128 v;
+	};
+
+	inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+	inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+	inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+	inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+	inline float4 operator-(float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+
+	inline float4& operator+=(float4& a, float4 b) { a = a + b; return a; }
+	inline float4& operator-=(float4& a, float4 b) { a = a - b; return a; }
+	inline float4& operator*=(float4& a, float4 b) { a = a * b; return a; }
+
+	// Comparisons return a lane mask with all bits set where the comparison holds
+	inline float4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+	inline float4 operator<=(float4 a, float4 b) { return _mm_cmple_ps(a.v, b.v); }
+	inline float4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+	inline float4 operator>=(float4 a, float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+
+	inline float4 operator&(float4 a, float4 b) { return _mm_and_ps(a.v, b.v); }
+	inline float4 operator|(float4 a, float4 b) { return _mm_or_ps(a.v, b.v); }
+
+	inline float4 min(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+	inline float4 max(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+	inline float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+	inline float4 abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+
+	// Picks b where the mask is set and a elsewhere
+	inline float4 select(float4 mask, float4 a, float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, b.v), _mm_andnot_ps(mask.v, a.v)); }
+
+	// One bit per lane, set where the mask is set
+	inline int movemask(float4 mask) { return _mm_movemask_ps(mask.v); }
+
+	inline float horizontal_min(float4 a)
+	{
+		__m128 m = _mm_min_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1)));
+		m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		return _mm_cvtss_f32(m);
+	}
+
+	// Rounds every lane toward zero
+	inline float4 truncate(float4 a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v)); }
+
+	// Rounds every lane toward zero and stores it as an integer
+	inline void store_truncated(float4 a, int32_t* aligned) { _mm_store_si128(reinterpret_cast<__m128i*>(aligned), _mm_cvttps_epi32(a.v)); }
+
+	// a 2^n for integral n that keep the result normal
+	inline float4 ldexp(float4 a, float4 n) { return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(a.v), _mm_slli_epi32(_mm_cvttps_epi32(n.v), 23))); }
+
+	// Splits positive, normal x into 2^e m with the mantissa m in [1, 2). Returns e.
+	inline float4 split_exponent(float4 x, float4* out_mantissa)
+	{
+		const __m128i bits = _mm_castps_si128(x.v);
+		*out_mantissa = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+		return _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+	}
+
+	struct float8
+	{
+		static constexpr int width = 8;
+		using half = float4;
+
+		float8() = default;
+
+		SIMD_AVX2 float8(__m256 v) : v(v) {}
+
+		SIMD_AVX2 explicit float8(float splat) : v(_mm256_set1_ps(splat)) {}
+
+		SIMD_AVX2 static float8 load(const float* aligned) { return _mm256_load_ps(aligned); }
+
+		SIMD_AVX2 static float8 loadu(const float* p) { return _mm256_loadu_ps(p); }
+
+		SIMD_AVX2 void store(float* aligned) const { _mm256_store_ps(aligned, v); }
+
+		SIMD_AVX2 void storeu(float* p) const { _mm256_storeu_ps(p, v); }
+
+		__m256 v;
+	};
+
+	SIMD_AVX2 inline float8 operator+(float8 a, float8 b) { return _mm256_add_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 operator-(float8 a, float8 b) { return _mm256_sub_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 operator*(float8 a, float8 b) { return _mm256_mul_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 operator/(float8 a, float8 b) { return _mm256_div_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 operator-(float8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+
+	SIMD_AVX2 inline float8& operator+=(float8& a, float8 b) { a = a + b; return a; }
+	SIMD_AVX2 inline float8& operator-=(float8& a, float8 b) { a = a - b; return a; }
+	SIMD_AVX2 inline float8& operator*=(float8& a, float8 b) { a = a * b; return a; }
+
+	SIMD_AVX2 inline float8 operator<(float8 a, float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+	SIMD_AVX2 inline float8 operator<=(float8 a, float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+	SIMD_AVX2 inline float8 operator>(float8 a, float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+	SIMD_AVX2 inline float8 operator>=(float8 a, float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+
+	SIMD_AVX2 inline float8 operator&(float8 a, float8 b) { return _mm256_and_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 operator|(float8 a, float8 b) { return _mm256_or_ps(a.v, b.v); }
+
+	SIMD_AVX2 inline float8 min(float8 a, float8 b) { return _mm256_min_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 max(float8 a, float8 b) { return _mm256_max_ps(a.v, b.v); }
+	SIMD_AVX2 inline float8 sqrt(float8 a) { return _mm256_sqrt_ps(a.v); }
+	SIMD_AVX2 inline float8 abs(float8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+
+	SIMD_AVX2 inline float8 select(float8 mask, float8 a, float8 b) { return _mm256_blendv_ps(a.v, b.v, mask.v); }
+
+	SIMD_AVX2 inline int movemask(float8 mask) { return _mm256_movemask_ps(mask.v); }
+
+	SIMD_AVX2 inline float horizontal_min(float8 a)
+	{
+		return horizontal_min(float4(_mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1))));
+	}
+
+	SIMD_AVX2 inline float8 truncate(float8 a) { return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a.v)); }
+
+	SIMD_AVX2 inline void store_truncated(float8 a, int32_t* aligned) { _mm256_store_si256(reinterpret_cast<__m256i*>(aligned), _mm256_cvttps_epi32(a.v)); }
+
+	SIMD_AVX2 inline float8 ldexp(float8 a, float8 n) { return _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(a.v), _mm256_slli_epi32(_mm256_cvttps_epi32(n.v), 23))); }
+
+	SIMD_AVX2 inline float8 split_exponent(float8 x, float8* out_mantissa)
+	{
+		const __m256i bits = _mm256_castps_si256(x.v);
+		*out_mantissa = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000)));
+		return _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+	}
+
+	// AVX-512 compares into mask registers, which are widened to vector masks here to keep one
+	// interface for every width
+	struct float16
+	{
+		static constexpr int width = 16;
+		using half = float8;
+
+		float16() = default;
+
+		SIMD_AVX512 float16(__m512 v) : v(v) {}
+
+		SIMD_AVX512 explicit float16(float splat) : v(_mm512_set1_ps(splat)) {}
+
+		SIMD_AVX512 static float16 load(const float* aligned) { return _mm512_load_ps(aligned); }
+
+		SIMD_AVX512 static float16 loadu(const float* p) { return _mm512_loadu_ps(p); }
+
+		SIMD_AVX512 void store(float* aligned) const { _mm512_store_ps(aligned, v); }
+
+		SIMD_AVX512 void storeu(float* p) const { _mm512_storeu_ps(p, v); }
+
+		__m512 v;
+	};
+
+	namespace detail
+	{
+		SIMD_AVX512 inline float16 widen(__mmask16 mask) { return _mm512_castsi512_ps(_mm512_maskz_set1_epi32(mask, -1)); }
+
+		SIMD_AVX512 inline __mmask16 narrow(float16 mask) { return _mm512_test_epi32_mask(_mm512_castps_si512(mask.v), _mm512_castps_si512(mask.v)); }
+
+		SIMD_AVX512 inline __m512i bits(float16 a) { return _mm512_castps_si512(a.v); }
+	}
+
+	SIMD_AVX512 inline float16 operator+(float16 a, float16 b) { return _mm512_add_ps(a.v, b.v); }
+	SIMD_AVX512 inline float16 operator-(float16 a, float16 b) { return _mm512_sub_ps(a.v, b.v); }
+	SIMD_AVX512 inline float16 operator*(float16 a, float16 b) { return _mm512_mul_ps(a.v, b.v); }
+	SIMD_AVX512 inline float16 operator/(float16 a, float16 b) { return _mm512_div_ps(a.v, b.v); }
+	SIMD_AVX512 inline float16 operator-(float16 a) { return _mm512_castsi512_ps(_mm512_xor_si512(detail::bits(a), _mm512_set1_epi32(INT32_MIN))); }
+
+	SIMD_AVX512 inline float16& operator+=(float16& a, float16 b) { a = a + b; return a; }
+	SIMD_AVX512 inline float16& operator-=(float16& a, float16 b) { a = a - b; return a; }
+	SIMD_AVX512 inline float16& operator*=(float16& a, float16 b) { a = a * b; return a; }
+
+	SIMD_AVX512 inline float16 operator<(float16 a, float16 b) { return detail::widen(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)); }
+	SIMD_AVX512 inline float16 operator<=(float16 a, float16 b) { return detail::widen(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)); }
+	SIMD_AVX512 inline float16 operator>(float16 a, float16 b) { return detail::widen(_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)); }
+	SIMD_AVX512 inline float16 operator>=(float16 a, float16 b) { return detail::widen(_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)); }
+
+	SIMD_AVX512 inline float16 operator&(float16 a, float16 b) { return _mm512_castsi512_ps(_mm512_and_si512(detail::bits(a), detail::bits(b))); }
+	SIMD_AVX512 inline float16 operator|(float16 a, float16 b) { return _mm512_castsi512_ps(_mm512_or_si512(detail::bits(a), detail::bits(b))); }
+
+	SIMD_AVX512 inline float16 min(float16 a, float16 b) { return _mm512_min_ps(a.v, b.v); }
+	SIMD_AVX512 inline float16 max(float16 a, float16 b) { return _mm512_max_ps(a.v, b.v); }
+	SIMD_AVX512 inline float16 sqrt(float16 a) { return _mm512_sqrt_ps(a.v); }
+	SIMD_AVX512 inline float16 abs(float16 a) { return _mm512_castsi512_ps(_mm512_and_si512(detail::bits(a), _mm512_set1_epi32(INT32_MAX))); }
+
+	SIMD_AVX512 inline float16 select(float16 mask, float16 a, float16 b) { return _mm512_mask_blend_ps(detail::narrow(mask), a.v, b.v); }
+
+	SIMD_AVX512 inline int movemask(float16 mask) { return detail::narrow(mask); }
+
+	SIMD_AVX512 inline float horizontal_min(float16 a)
+	{
+		const __m256 halves = _mm256_min_ps(_mm512_castps512_ps256(a.v), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a.v), 1)));
+		return horizontal_min(float4(_mm_min_ps(_mm256_castps256_ps128(halves), _mm256_extractf128_ps(halves, 1))));
+	}
+
+	SIMD_AVX512 inline float16 truncate(float16 a) { return _mm512_cvtepi32_ps(_mm512_cvttps_epi32(a.v)); }
+
+	SIMD_AVX512 inline void store_truncated(float16 a, int32_t* aligned) { _mm512_store_si512(aligned, _mm512_cvttps_epi32(a.v)); }
+
+	SIMD_AVX512 inline float16 ldexp(float16 a, float16 n) { return _mm512_castsi512_ps(_mm512_add_epi32(detail::bits(a), _mm512_slli_epi32(_mm512_cvttps_epi32(n.v), 23))); }
+
+	SIMD_AVX512 inline float16 split_exponent(float16 x, float16* out_mantissa)
+	{
+		const __m512i bits = detail::bits(x);
+		*out_mantissa = _mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)), _mm512_set1_epi32(0x3f800000)));
+		return _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(127)));
+	}
+
+	// Names a vector type without holding one, which dispatch_isa_wide passes to pick the width
+	template <typename V>
+	struct lanes
+	{
+		using type = V;
+	};
+
+	// The widest type up to V whose width divides n, for kernels over n lanes
+	template <typename V, int N>
+	struct fitting
+	{
+		using type = typename std::conditional<N % V::width == 0, V, typename fitting<typename V::half, N>::type>::type;
+	};
+
+	template <int N>
+	struct fitting<float4, N>
+	{
+		static_assert(N % float4::width == 0, "the lane count must be a multiple of four");
+		using type = float4;
+	};
+
+	template <typename V, int N>
+	using fitting_t = typename fitting<V, N>::type;
+
+	// The functions below are written once for every width, V is float4, float8 or float16
+
+	// Approximation of 2^x with a relative error of about 2e-5, meant for weights and color curves rather than exact math
+	template <typename V, int = V::width>
+	V exp2(V x)
+	{
+		x = min(max(x, V(-126.0f)), V(127.0f));
+
+		// 2^x = 2^n 2^f with integer n and f in [0, 1)
+		const V truncated = truncate(x);
+		const V n = truncated - ((truncated > x) & V(1.0f));
+		const V f = x - n;
+
+		// Taylor series of 2^f
+		V p = V(1.54035304e-4f);
+		p = p * f + V(1.33335581e-3f);
+		p = p * f + V(9.61812911e-3f);
+		p = p * f + V(5.55041087e-2f);
+		p = p * f + V(2.40226507e-1f);
+		p = p * f + V(6.93147182e-1f);
+		p = p * f + V(1.0f);
+
+		return ldexp(p, n);
+	}
+
+	template <typename V, int = V::width>
+	V exp(V x)
+	{
+		return exp2(x * V(1.44269504f));
+	}
+
+	// Approximation of log2(x) for positive, normal x with an absolute error of about 1e-7
+	template <typename V, int = V::width>
+	V log2(V x)
+	{
+		// Split x into 2^e m with the mantissa m in [sqrt(1/2), sqrt(2))
+		V m;
+		V exponent = split_exponent(x, &m);
+
+		const V large = m > V(1.41421356f);
+		m = select(large, m, m * V(0.5f));
+		exponent = exponent + (large & V(1.0f));
+
+		// log2(m) = 2 / ln(2) atanh(t) with t = (m - 1) / (m + 1)
+		const V t = (m - V(1.0f)) / (m + V(1.0f));
+		const V t2 = t * t;
+		V p = V(1.0f / 7);
+		p = p * t2 + V(1.0f / 5);
+		p = p * t2 + V(1.0f / 3);
+		p = p * t2 + V(1.0f);
+
+		return exponent + p * t * V(2.88539008f);
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "simd.h"
+#include "cpu.h"
+
+// The sRGB transfer function, linear near black and a 1/2.4 power curve elsewhere
+inline float linear_to_srgb(float linear)
+{
+	linear = std::min(std::max(linear, 0.0f), 1.0f);
+	return (linear <= 0.0031308f) ? 12.92f * linear : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+}
+
+// For simd::float4, float8 and float16
+template <typename V, int = V::width>
+V linear_to_srgb(V linear)
+{
+	linear = simd::min(simd::max(linear, V(0.0f)), V(1.0f));
+
+	// Clamp away from zero before taking the logarithm, those values take the linear segment anyway
+	const V curve = V(1.055f) * simd::exp2(simd::log2(simd::max(linear, V(1e-6f))) * V(1.0f / 2.4f)) - V(0.055f);
+
+	return simd::select(linear <= V(0.0031308f), curve, linear * V(12.92f));
+}
+
+// Thresholds of a 4x4 ordered dither, centered around zero and in units of one quantization step
+inline float ordered_dither_threshold(int x, int y)
+{
+	static const uint8_t bayer[4][4] = {
+		{  0,  8,  2, 10 },
+		{ 12,  4, 14,  6 },
+		{  3, 11,  1,  9 },
+		{ 15,  7, 13,  5 },
+	};
+
+	return (bayer[y & 3][x & 3] + 0.5f) / 16.0f - 0.5f;
+}
+
+// Converts a row of linear color given as one array per channel to 8 bit sRGB, written as interleaved
+// BGR. As many pixels as the widest vector of the instruction set level holds are converted at a time.
+// The row index selects the dither pattern's row.
+inline void encode_srgb8_row(const float* r, const float* g, const float* b, int width, int y, bool dither, uint8_t* out_bgr)
+{
+	return dispatch_isa_wide([&](auto lanes)
+	{
+		using V = typename decltype(lanes)::type;
+
+		const float* channels[3] = { b, g, r };
+
+		// The pattern repeats every four pixels, which every vector width is a multiple of.
+		// Rounding to nearest is folded into the dither offset.
+		alignas(64) float offsets[V::width];
+		for (int i = 0; i < V::width; ++i)
+		{
+			offsets[i] = (dither ? ordered_dither_threshold(i, y) : 0.0f) + 0.5f;
+		}
+		const V offset = V::load(offsets);
+
+		for (int x = 0; x < width; x += V::width)
+		{
+			// The end of the row is padded rather than converted with the scalar linear_to_srgb, so that
+			// every pixel is encoded the same whichever width the level converts at a time
+			const int count = std::min(V::width, width - x);
+
+			alignas(64) int32_t quantized[3][V::width];
+
+			for (int c = 0; c < 3; ++c)
+			{
+				V linear;
+				if (count == V::width)
+				{
+					linear = V::loadu(channels[c] + x);
+				}
+				else
+				{
+					alignas(64) float padded[V::width] = {};
+					std::copy(channels[c] + x, channels[c] + x + count, padded);
+					linear = V::load(padded);
+				}
+
+				const V scaled = simd::min(linear_to_srgb(linear) * V(255.0f) + offset, V(255.0f));
+				simd::store_truncated(simd::max(scaled, V(0.0f)), quantized[c]);
+			}
+
+			for (int i = 0; i < count; ++i)
+			{
+				for (int c = 0; c < 3; ++c)
+				{
+					out_bgr[3 * (x + i) + c] = static_cast<uint8_t>(quantized[c][i]);
+				}
+			}
+		}
+	});
+}
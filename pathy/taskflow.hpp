@@ -32,6 +32,7 @@
 #include <algorithm>
 #include <thread>
 #include <future>
+#include <atomic>
 #include <functional>
 #include <unordered_map>
 #include <unordered_set>
@@ -41,6 +42,8 @@
 #include <numeric>
 #include <iomanip>
 
+#include "arena.h"
+
 namespace tf {
 
 template <typename... ArgsT>
@@ -112,6 +115,21 @@ MoveOnCopy(T&&) -> MoveOnCopy<T>;
 
 // ------------------------------------------------------------------------------------------------
 
+// Class: WorkerObserver
+// Notified by every worker right before and after it runs a task. Workers are numbered from zero
+// in the order they were spawned.
+class WorkerObserver {
+
+  public:
+
+    virtual ~WorkerObserver() = default;
+
+    virtual void on_entry(unsigned worker_id) = 0;
+    virtual void on_exit(unsigned worker_id) = 0;
+};
+
+// ------------------------------------------------------------------------------------------------
+
 // Class: Threadpool
 class Threadpool {
 
@@ -120,6 +138,14 @@ class Threadpool {
     SHUTDOWN
   };
 
+  // Struct: Job
+  // Work small enough for the inline storage of std::function, like the node scheduling of a
+  // taskflow, is queued without allocating.
+  struct Job {
+    std::function<void()> work;
+    Signal signal;
+  };
+
   public:
 
     inline Threadpool(unsigned);
@@ -139,13 +165,24 @@ class Threadpool {
 
     inline bool is_worker() const;
 
+    inline void observe(WorkerObserver*);
+
   private:
 
     mutable std::mutex _mutex;
 
+    std::atomic<WorkerObserver*> _observer {nullptr};
+
     std::condition_variable _worker_signal;
-    std::deque<std::function<Signal()>> _task_queue;
+
+    // A queue that keeps its capacity, the jobs are popped at _task_queue_head and the storage is
+    // reused once the queue has run empty.
+    std::vector<Job> _task_queue;
+    size_t _task_queue_head {0};
+
     std::vector<std::thread> _threads;
+
+    inline void _push(std::function<void()>&&, Signal);
     std::unordered_set<std::thread::id> _worker_ids;
 };
 
@@ -164,7 +201,7 @@ inline Threadpool::~Threadpool() {
 // the size of the task_queue since the task can be popped out from the task queue while 
 // not yet finished.
 inline size_t Threadpool::num_tasks() const {
-  return _task_queue.size();
+  return _task_queue.size() - _task_queue_head;
 }
 
 inline size_t Threadpool::num_workers() const {
@@ -176,6 +213,13 @@ inline bool Threadpool::is_worker() const {
   return _worker_ids.find(std::this_thread::get_id()) != _worker_ids.end();
 }
 
+// Procedure: observe
+// Set the observer notified around every task, or nullptr to stop observing. The observer must
+// outlive the tasks that run while it is set.
+inline void Threadpool::observe(WorkerObserver* observer) {
+  _observer.store(observer, std::memory_order_release);
+}
+
 // Procedure: spawn
 // The procedure spawns "n" threads monitoring the task queue and executing each task. After the
 // task is finished, the thread reacts to the returned signal.
@@ -187,7 +231,9 @@ inline void Threadpool::spawn(unsigned N) {
   
   for(size_t i=0; i<N; ++i) {
 
-    _threads.emplace_back([this] () -> void { 
+    const unsigned worker_id = static_cast<unsigned>(_threads.size());
+
+    _threads.emplace_back([this, worker_id] () -> void { 
 
       {  // Acquire lock
         std::scoped_lock<std::mutex> lock(_mutex);
@@ -197,17 +243,31 @@ inline void Threadpool::spawn(unsigned N) {
       bool stop {false}; 
 
       while(!stop) {
-        decltype(_task_queue)::value_type task;
+        Job task;
 
         { // Acquire lock. --------------------------------
           std::unique_lock<std::mutex> lock(_mutex);
-          _worker_signal.wait(lock, [this] () { return _task_queue.size() != 0; });
-          task = std::move(_task_queue.front());
-          _task_queue.pop_front();
+          _worker_signal.wait(lock, [this] () { return num_tasks() != 0; });
+          task = std::move(_task_queue[_task_queue_head++]);
+          if(_task_queue_head == _task_queue.size()) {
+            _task_queue.clear();
+            _task_queue_head = 0;
+          }
         } // Release lock. --------------------------------
 
-        // Execute the task and react to the returned signal.
-        switch(task()) {
+        // Execute the task and react to the signal it was queued with.
+        auto observer = _observer.load(std::memory_order_acquire);
+        if(observer) {
+          observer->on_entry(worker_id);
+        }
+
+        task.work();
+
+        if(observer) {
+          observer->on_exit(worker_id);
+        }
+
+        switch(task.signal) {
           case Signal::SHUTDOWN:
             stop = true;
           break;      
@@ -227,6 +287,12 @@ inline void Threadpool::spawn(unsigned N) {
   }
 }
 
+// Procedure: _push
+// Queue a job, the caller holds the lock.
+inline void Threadpool::_push(std::function<void()>&& work, Signal sig) {
+  _task_queue.push_back(Job{std::move(work), sig});
+}
+
 // Function: silent_async
 // Insert a task without giving future.
 template <typename C>
@@ -240,12 +306,7 @@ auto Threadpool::silent_async(C&& c, Signal sig) {
   else {
     {
       std::unique_lock lock(_mutex);
-      _task_queue.emplace_back(
-        [c=std::forward<C>(c), ret=sig] () mutable { 
-          c();
-          return ret;
-        }
-      );
+      _push(std::forward<C>(c), sig);
     }
     _worker_signal.notify_one();
   }
@@ -277,36 +338,22 @@ auto Threadpool::async(C&& c, Signal sig) {
       std::unique_lock lock(_mutex);
       
       if constexpr(std::is_same_v<void, R>) {
-        _task_queue.emplace_back(
-          [p = MoveOnCopy(std::move(p)), c = std::forward<C>(c), ret = sig]() mutable {
+        _push(
+          [p = MoveOnCopy(std::move(p)), c = std::forward<C>(c)]() mutable {
             c();
             p.get().set_value();
-            return ret;
-          }
+          },
+          sig
         );
       }
       else {
-        _task_queue.emplace_back(
-          [p = MoveOnCopy(std::move(p)), c = std::forward<C>(c), ret = sig]() mutable {
+        _push(
+          [p = MoveOnCopy(std::move(p)), c = std::forward<C>(c)]() mutable {
             p.get().set_value(c());
-            return ret;
-          }
+          },
+          sig
         );
       }
-      
-      // This can cause MSVS not to compile ...
-      /*_task_queue.emplace_back(
-        [p=MoveOnCopy(std::move(p)), c=std::forward<C>(c), ret=sig] () mutable { 
-          if constexpr(std::is_same_v<void, R>) {
-            c();
-            p.get().set_value();
-          }
-          else {
-            p.get().set_value(c());
-          }
-          return ret;
-        }
-      );*/
     }
     _worker_signal.notify_one();
   }
@@ -337,16 +384,19 @@ inline void Threadpool::shutdown() {
 //-------------------------------------------------------------------------------------------------
 
 // Class: BasicTaskflow
+// The nodes of the graph, their edges and their work live in an arena that is reset once all
+// dispatched graphs have finished, so building the graph of every further pass allocates nothing.
+// Building the graph is only allowed from one thread at a time.
 template <typename F>
 class BasicTaskflow {
   
   // Struct: Node
   struct Node {
   
-    Node() = default;
+    Node(arena&);
   
     template <typename C>
-    Node(C&&);
+    Node(arena&, C&&);
 
     const std::string& name() const;
     
@@ -359,16 +409,18 @@ class BasicTaskflow {
   
     F _work;
     
-    std::vector<Node*> _successors;
+    std::vector<Node*, arena_allocator<Node*>> _successors;
     std::atomic<int> _dependents {0};
   };
+
+  using NodeList = std::forward_list<Node, arena_allocator<Node>>;
   
   // Struct: Topology
   struct Topology{
 
-    Topology(std::forward_list<Node>&&);
+    Topology(arena&, NodeList&&);
 
-    std::forward_list<Node> nodes;
+    NodeList nodes;
     std::shared_future<void> future;
 
     Node source;
@@ -470,6 +522,7 @@ class BasicTaskflow {
     //auto parallel_range(const I, const I, C&&, ssize_t = 1);
 
     void num_workers(size_t);
+    void observe(WorkerObserver*);
 
     size_t num_nodes() const;
     size_t num_workers() const;
@@ -481,12 +534,18 @@ class BasicTaskflow {
 
     Threadpool _threadpool;
 
-    std::forward_list<Node> _nodes;
-    std::forward_list<Topology> _topologies;
+    // Declared before the graph so that it is destroyed after it
+    arena _arena;
+
+    NodeList _nodes {arena_allocator<Node>(&_arena)};
+    std::forward_list<Topology, arena_allocator<Topology>> _topologies {arena_allocator<Topology>(&_arena)};
 
     void _schedule(Node&);
     void _wait_for_topologies();
 
+    template <typename C>
+    auto _store(C&&);
+
     template <typename L>
     void _linearize(L&);
 
@@ -494,10 +553,15 @@ class BasicTaskflow {
     auto _reduce(I, O, const size_t, const size_t, const size_t, const int, Task&);
 };
 
+// Constructor
+template <typename F>
+BasicTaskflow<F>::Node::Node(arena& a) : _successors {arena_allocator<Node*>(&a)} {
+}
+
 // Constructor
 template <typename F>
 template <typename C>
-BasicTaskflow<F>::Node::Node(C&& c) : _work {std::forward<C>(c)} {
+BasicTaskflow<F>::Node::Node(arena& a, C&& c) : _work {std::forward<C>(c)}, _successors {arena_allocator<Node*>(&a)} {
 }
 
 // Procedure:
@@ -531,8 +595,8 @@ const std::string& BasicTaskflow<F>::Node::name() const {
 
 // Constructor
 template <typename F>
-BasicTaskflow<F>::Topology::Topology(std::forward_list<Node>&& t) : 
-  nodes(std::move(t)) {
+BasicTaskflow<F>::Topology::Topology(arena& a, NodeList&& t) : 
+  nodes(std::move(t)), source(a), target(a) {
   
   std::promise<void> promise;
 
@@ -708,6 +772,12 @@ void BasicTaskflow<F>::num_workers(size_t W) {
   _threadpool.spawn(W);
 }
 
+// Procedure: observe
+template <typename F>
+void BasicTaskflow<F>::observe(WorkerObserver* observer) {
+  _threadpool.observe(observer);
+}
+
 // Function: num_nodes
 template <typename F>
 size_t BasicTaskflow<F>::num_nodes() const {
@@ -788,7 +858,7 @@ auto BasicTaskflow<F>::silent_dispatch() {
 
   if(_nodes.empty()) return;
 
-  auto& topology = _topologies.emplace_front(std::move(_nodes));
+  auto& topology = _topologies.emplace_front(_arena, std::move(_nodes));
 
   // Start the taskflow
   _schedule(topology.source);
@@ -802,7 +872,7 @@ auto BasicTaskflow<F>::dispatch() {
     return std::async(std::launch::deferred, [](){}).share();
   }
 
-  auto& topology = _topologies.emplace_front(std::move(_nodes));
+  auto& topology = _topologies.emplace_front(_arena, std::move(_nodes));
 
   // Start the taskflow
   _schedule(topology.source);
@@ -826,12 +896,27 @@ void BasicTaskflow<F>::_wait_for_topologies() {
     t.future.get();
   }
   _topologies.clear();
+
+  // Nothing refers to the arena anymore unless a graph is being built
+  if(_nodes.empty()) {
+    _arena.reset();
+  }
+}
+
+// Function: _store
+// Move a callable into the arena and return a callable that invokes it there, which is small
+// enough for std::function to hold without allocating.
+template <typename F>
+template <typename C>
+auto BasicTaskflow<F>::_store(C&& c) {
+  auto* stored = _arena.create<std::decay_t<C>>(std::forward<C>(c));
+  return [stored] () { (*stored)(); };
 }
 
 // Function: placeholder
 template <typename F>
 auto BasicTaskflow<F>::placeholder() {
-  auto& node = _nodes.emplace_front();
+  auto& node = _nodes.emplace_front(_arena);
   return Task(&node);
 }
 
@@ -839,7 +924,7 @@ auto BasicTaskflow<F>::placeholder() {
 template <typename F>
 template <typename C>
 auto BasicTaskflow<F>::silent_emplace(C&& c) {
-  auto& node = _nodes.emplace_front(std::forward<C>(c));
+  auto& node = _nodes.emplace_front(_arena, _store(std::forward<C>(c)));
   return Task(&node);
 }
 
@@ -860,7 +945,7 @@ auto BasicTaskflow<F>::emplace(C&& c) {
   std::promise<R> p;
   auto fu = p.get_future();
 
-  auto& node = _nodes.emplace_front([p=MoveOnCopy(std::move(p)), c=std::forward<C>(c)] () mutable { 
+  auto& node = _nodes.emplace_front(_arena, _store([p=MoveOnCopy(std::move(p)), c=std::forward<C>(c)] () mutable { 
     if constexpr(std::is_same_v<void, R>) {
       c();
       p.get().set_value();
@@ -868,7 +953,7 @@ auto BasicTaskflow<F>::emplace(C&& c) {
     else {
       p.get().set_value(c());
     }
-  });
+  }));
   
   return std::make_pair(Task(&node), std::move(fu));
 }
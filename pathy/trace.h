@@ -0,0 +1,288 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+
+#include "taskflow.hpp"
+
+// Records a timeline of a render that chrome://tracing and ui.perfetto.dev can show: the tasks every
+// worker ran, the tiles and passes they rendered and the time the caller spent waiting for them. Each
+// thread writes to its own ring buffer, so recording takes no locks, and once a buffer is full its
+// oldest events are overwritten. While tracing is stopped recording an event costs one atomic load.
+namespace trace
+{
+	struct event
+	{
+		const char* name; // must outlive the trace, usually a string literal
+		int64_t begin_ns;
+		int64_t end_ns;
+		int worker;
+		int tile_x;
+		int tile_y;
+		int pass;
+	};
+
+	class ring_buffer
+	{
+	public:
+		static constexpr size_t capacity = 1 << 16;
+
+		explicit ring_buffer(int thread_index) :
+			thread_index(thread_index)
+		{
+		}
+
+		void push(const event& e)
+		{
+			if (_events.size() < capacity)
+			{
+				_events.push_back(e);
+			}
+			else
+			{
+				_events[_next] = e;
+			}
+			_next = (_next + 1) % capacity;
+		}
+
+		// Visits the events oldest first
+		template <typename F>
+		void for_each(F&& f) const
+		{
+			const size_t first = (_events.size() < capacity) ? 0 : _next;
+			for (size_t i = 0; i < _events.size(); ++i)
+			{
+				f(_events[(first + i) % capacity]);
+			}
+		}
+
+		void clear()
+		{
+			_events.clear();
+			_events.shrink_to_fit();
+			_next = 0;
+		}
+
+		const int thread_index;
+		int worker = -1;              // the pool worker id of the thread, if it is one
+		std::atomic<bool> retired = { false }; // set when the thread exits
+
+	private:
+		std::vector<event> _events;
+		size_t _next = 0;
+	};
+
+	std::atomic<bool> g_enabled = { false };
+	std::chrono::steady_clock::time_point g_start;
+
+	// Buffers are only removed by start() once their thread has exited
+	std::mutex g_buffers_mutex;
+	std::vector<std::unique_ptr<ring_buffer>> g_buffers;
+	int g_next_thread_index = 0;
+
+	inline bool enabled()
+	{
+		return g_enabled.load(std::memory_order_relaxed);
+	}
+
+	inline int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_start).count();
+	}
+
+	inline ring_buffer* this_thread_buffer()
+	{
+		struct owner
+		{
+			ring_buffer* buffer = nullptr;
+
+			~owner()
+			{
+				if (buffer)
+				{
+					buffer->retired = true;
+				}
+			}
+		};
+
+		thread_local owner this_thread;
+
+		if (!this_thread.buffer)
+		{
+			std::lock_guard<std::mutex> lock(g_buffers_mutex);
+			g_buffers.emplace_back(new ring_buffer(g_next_thread_index++));
+			this_thread.buffer = g_buffers.back().get();
+		}
+
+		return this_thread.buffer;
+	}
+
+	// Drops the events of an earlier trace and starts recording
+	inline void start()
+	{
+		std::lock_guard<std::mutex> lock(g_buffers_mutex);
+
+		g_buffers.erase(std::remove_if(g_buffers.begin(), g_buffers.end(), [](const std::unique_ptr<ring_buffer>& b) { return b->retired.load(); }), g_buffers.end());
+		for (std::unique_ptr<ring_buffer>& b : g_buffers)
+		{
+			b->clear();
+		}
+
+		g_start = std::chrono::steady_clock::now();
+		g_enabled = true;
+	}
+
+	inline void stop()
+	{
+		g_enabled = false;
+	}
+
+	// Records the lifetime of the scope as one event. Whether it is recorded is decided when the scope
+	// is entered.
+	class scope
+	{
+	public:
+		explicit scope(const char* name, int tile_x = -1, int tile_y = -1, int pass = -1)
+		{
+			if (enabled())
+			{
+				_event = { name, now_ns(), 0, -1, tile_x, tile_y, pass };
+				_recording = true;
+			}
+		}
+
+		~scope()
+		{
+			if (_recording)
+			{
+				_event.end_ns = now_ns();
+				this_thread_buffer()->push(_event);
+			}
+		}
+
+		scope(const scope&) = delete;
+		scope& operator=(const scope&) = delete;
+
+	private:
+		event _event;
+		bool _recording = false;
+	};
+
+	// Records every task a pool worker runs
+	class task_observer : public tf::WorkerObserver
+	{
+	public:
+		void on_entry(unsigned worker_id) override
+		{
+			ring_buffer* buffer = this_thread_buffer();
+			buffer->worker = static_cast<int>(worker_id);
+			_begin_ns = now_ns();
+		}
+
+		void on_exit(unsigned worker_id) override
+		{
+			this_thread_buffer()->push({ "task", _begin_ns, now_ns(), static_cast<int>(worker_id), -1, -1, -1 });
+		}
+
+	private:
+		static thread_local int64_t _begin_ns;
+	};
+
+	thread_local int64_t task_observer::_begin_ns = 0;
+
+	task_observer g_task_observer;
+
+	// Has the workers of the pool record their tasks if tracing is on. The pool keeps recording until
+	// it is destroyed, even if tracing is stopped in the meantime.
+	inline void observe(tf::Taskflow& tf)
+	{
+		if (enabled())
+		{
+			tf.observe(&g_task_observer);
+		}
+	}
+
+	// Writes the recorded events in the Chrome trace event format. Call it once tracing was stopped
+	// and no thread is recording anymore.
+	inline bool write_chrome_trace(const char* filepath)
+	{
+		std::ofstream file(filepath);
+		if (!file)
+		{
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(g_buffers_mutex);
+
+		file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+		bool first = true;
+		auto separate = [&]()
+		{
+			if (!first)
+			{
+				file << ",\n";
+			}
+			first = false;
+		};
+
+		char number[32];
+		auto microseconds = [&number](int64_t ns)
+		{
+			snprintf(number, sizeof(number), "%lld.%03d", static_cast<long long>(ns / 1000), static_cast<int>(ns % 1000));
+			return number;
+		};
+
+		for (const std::unique_ptr<ring_buffer>& b : g_buffers)
+		{
+			separate();
+			file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->thread_index << ",\"args\":{\"name\":\"";
+			if (b->worker >= 0)
+			{
+				file << "worker " << b->worker;
+			}
+			else
+			{
+				file << "thread " << b->thread_index;
+			}
+			file << "\"}}";
+
+			b->for_each([&](const event& e)
+			{
+				separate();
+				file << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->thread_index;
+				file << ",\"ts\":" << microseconds(e.begin_ns);
+				file << ",\"dur\":" << microseconds(e.end_ns - e.begin_ns);
+				file << ",\"args\":{";
+
+				const char* separator = "";
+				if (e.worker >= 0)
+				{
+					file << "\"worker\":" << e.worker;
+					separator = ",";
+				}
+				if (e.tile_x >= 0)
+				{
+					file << separator << "\"tile_x\":" << e.tile_x << ",\"tile_y\":" << e.tile_y;
+					separator = ",";
+				}
+				if (e.pass >= 0)
+				{
+					file << separator << "\"pass\":" << e.pass;
+				}
+				file << "}}";
+			});
+		}
+
+		file << "\n]}\n";
+
+		return static_cast<bool>(file);
+	}
+}
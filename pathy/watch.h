@@ -0,0 +1,142 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <thread>
+#include <system_error>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#undef min
+#undef max
+#elif defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// Tells when a file was written. The directory holding the file is watched with directory change
+// notifications on Windows and inotify on Linux, so that editors that save by replacing the file are
+// noticed too, and the file's modification time decides whether the file itself changed. Other
+// platforms only poll the modification time.
+class file_watcher
+{
+public:
+	explicit file_watcher(const std::string& filepath) :
+		_filepath(filepath)
+	{
+		std::filesystem::path directory = std::filesystem::path(filepath).parent_path();
+		if (directory.empty())
+		{
+			directory = ".";
+		}
+
+#ifdef _WIN32
+		_handle = FindFirstChangeNotificationA(directory.string().c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+#elif defined(__linux__)
+		_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_fd >= 0)
+		{
+			inotify_add_watch(_fd, directory.string().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+		}
+#endif
+
+		_modified = modification_time();
+	}
+
+	~file_watcher()
+	{
+#ifdef _WIN32
+		if (_handle != INVALID_HANDLE_VALUE)
+		{
+			FindCloseChangeNotification(_handle);
+		}
+#elif defined(__linux__)
+		if (_fd >= 0)
+		{
+			close(_fd);
+		}
+#endif
+	}
+
+	file_watcher(const file_watcher&) = delete;
+	file_watcher& operator=(const file_watcher&) = delete;
+
+	// Blocks for at most the timeout. Returns true if the file was written since the last change
+	// was reported.
+	bool wait_for_change(int timeout_milliseconds)
+	{
+#ifdef _WIN32
+		if (_handle != INVALID_HANDLE_VALUE)
+		{
+			if (WaitForSingleObject(_handle, timeout_milliseconds) == WAIT_OBJECT_0)
+			{
+				FindNextChangeNotification(_handle);
+			}
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_milliseconds));
+		}
+#elif defined(__linux__)
+		if (_fd >= 0)
+		{
+			pollfd fd = { _fd, POLLIN, 0 };
+			if (poll(&fd, 1, timeout_milliseconds) > 0)
+			{
+				// Only the modification time matters, drain the events
+				char events[4096];
+				while (read(_fd, events, sizeof(events)) > 0)
+				{
+				}
+			}
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_milliseconds));
+		}
+#else
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeout_milliseconds));
+#endif
+
+		const std::filesystem::file_time_type modified = modification_time();
+		if (modified == _modified)
+		{
+			return false;
+		}
+
+		// Editors often write a file in several steps, wait until the writes have settled
+		std::filesystem::file_time_type settled = modified;
+		do
+		{
+			_modified = settled;
+			std::this_thread::sleep_for(std::chrono::milliseconds(settle_milliseconds));
+			settled = modification_time();
+		} while (settled != _modified);
+
+		return true;
+	}
+
+private:
+	static constexpr int settle_milliseconds = 50;
+
+	std::filesystem::file_time_type modification_time() const
+	{
+		std::error_code error;
+		const std::filesystem::file_time_type modified = std::filesystem::last_write_time(_filepath, error);
+		return error ? std::filesystem::file_time_type::min() : modified;
+	}
+
+	std::string _filepath;
+	std::filesystem::file_time_type _modified;
+
+#ifdef _WIN32
+	HANDLE _handle = INVALID_HANDLE_VALUE;
+#elif defined(__linux__)
+	int _fd = -1;
+#endif
+};